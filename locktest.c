@@ -0,0 +1,167 @@
+/* Check that concurrent processes don't lose each other's changes to a manifest */
+/* Usage: locktest [writers [rounds]] */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "setupdb.h"
+
+static char name[64];
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if ( !ok ) {
+        ++failures;
+    }
+}
+
+/* Run ourselves to open the product from another process, as a forked
+   one would share our locks. Returns the pid of the new process.
+ */
+static pid_t spawn(const char *argv0, const char *mode)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if ( pid == 0 ) {
+        execl(argv0, argv0, mode, name, (char *)NULL);
+        _exit(2);
+    }
+    return pid;
+}
+
+/* Returns 0 if another process could open the product within 100ms */
+static int try_open(const char *argv0, const char *mode)
+{
+    int status;
+    pid_t pid = spawn(argv0, mode);
+
+    if ( pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+/* Each writer adds its own components, one open at a time */
+static int writer(int id, int rounds)
+{
+    char comp[64];
+    product_t *product;
+    int i;
+
+    for ( i = 0; i < rounds; ++i ) {
+        product = loki_openproduct(name);
+        if ( !product ) {
+            return 1;
+        }
+        snprintf(comp, sizeof(comp), "w%d-%d", id, i);
+        loki_create_component(product, comp, "1.0");
+        if ( loki_closeproduct(product) < 0 ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char root[] = "/tmp/locktestXXXXXX";
+    int writers = (argc > 1) ? atoi(argv[1]) : 8;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+    product_component_t *comp;
+    product_t *product, *other;
+    int i, count, status;
+    pid_t pid;
+
+    /* Run by spawn(): -r and -w try to open, -s holds a shared lock for a second */
+    if ( argc == 3 && argv[1][0] == '-' ) {
+        loki_setlocktimeout(100);
+        product = loki_openproduct_flags(argv[2], strcmp(argv[1], "-w") ? LOKI_OPEN_READONLY : 0);
+        if ( product ) {
+            if ( !strcmp(argv[1], "-s") ) {
+                sleep(1);
+            }
+            loki_closeproduct(product);
+            return 0;
+        }
+        return 1;
+    }
+
+    if ( !mkdtemp(root) ) {
+        perror(root);
+        return 2;
+    }
+    snprintf(name, sizeof(name), "locktest-%d", (int)getpid());
+    product = loki_create_product(name, root, "Locking test", "");
+    if ( !product || loki_closeproduct(product) < 0 ) {
+        fprintf(stderr, "Unable to create product %s\n", name);
+        return 2;
+    }
+
+    /* Writers exclude everyone else */
+    product = loki_openproduct(name);
+    check(try_open(argv[0], "-r") == 1, "reader times out while a writer holds the manifest");
+    check(try_open(argv[0], "-w") == 1, "writer times out while a writer holds the manifest");
+    other = loki_openproduct(name);
+    check(other == NULL, "second writable open in the same process is refused");
+    other = loki_openproduct_flags(name, LOKI_OPEN_READONLY);
+    check(other != NULL, "read-only open in the same process shares the lock");
+    loki_closeproduct(other);
+    loki_closeproduct(product);
+
+    /* Readers only exclude writers */
+    product = loki_openproduct_flags(name, LOKI_OPEN_READONLY);
+    check(try_open(argv[0], "-r") == 0, "readers share the manifest");
+    check(try_open(argv[0], "-w") == 1, "writer times out while a reader holds the manifest");
+    loki_closeproduct(product);
+
+    /* Upgrading a shared lock gives up after the timeout, and keeps it shared */
+    pid = spawn(argv[0], "-s");
+    usleep(300000);
+    product = loki_openproduct_flags(name, LOKI_OPEN_READONLY);
+    loki_setlocktimeout(100);
+    other = loki_openproduct(name);
+    check(other == NULL, "upgrading times out while another process reads the manifest");
+    check(try_open(argv[0], "-w") == 1, "the shared lock is kept after a failed upgrade");
+    waitpid(pid, &status, 0);
+    other = loki_openproduct(name);
+    check(other != NULL, "upgrading succeeds once the other reader is gone");
+    loki_closeproduct(other);
+    loki_closeproduct(product);
+    loki_setlocktimeout(-1);
+
+    /* Concurrent writers must all see their changes saved */
+    fflush(stdout);
+    for ( i = 0; i < writers; ++i ) {
+        pid = fork();
+        if ( pid == 0 ) {
+            _exit(writer(i, rounds));
+        }
+    }
+    count = 0;
+    while ( wait(&status) > 0 ) {
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+            ++count;
+        }
+    }
+    check(count == 0, "all the writers completed");
+
+    product = loki_openproduct(name);
+    count = 0;
+    for ( comp = loki_getfirst_component(product); comp; comp = loki_getnext_component(comp) ) {
+        ++count;
+    }
+    printf("%d components out of %d\n", count, writers * rounds);
+    check(count == writers * rounds, "no change was lost");
+    loki_removeproduct(product);
+    rmdir(root);
+
+    return failures ? 1 : 0;
+}
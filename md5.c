@@ -34,6 +34,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #ifndef NO_ZLIB
 #include <zlib.h>
@@ -344,45 +345,77 @@ unsigned char *get_md5_bin(const char *asciisum)
     return buf;
 }
 
-int md5_compute(const char *path, char md5sum[], int unpack)
+/* Same as get_md5(), into a caller-supplied buffer */
+static void format_md5(const unsigned char *binsum, char md5sum[])
+{
+	static const char *trans = "0123456789abcdef";
+	int i, j;
+
+	for( i = 0, j = 0; i < 16; ++i ) {
+		md5sum[j++] = trans[binsum[i] >> 4];
+		md5sum[j++] = trans[binsum[i] & 0xF];
+	}
+	md5sum[j] = '\0';
+}
+
+int md5_compute_fd(int fd, char md5sum[], int unpack)
+{
+    return md5_compute_fd_size(fd, -1, md5sum, unpack);
+}
+
+int md5_compute_fd_size(int fd, off_t size, char md5sum[], int unpack)
 {
     char buf[4096];
-    size_t count;
+    ssize_t count;
+    off_t total = 0;
     MD5_CONTEXT ctx;
 
-#ifdef NO_ZLIB
-    if ( 1 ) {
-#else
-    if ( unpack ) {
-        gzFile fd = gzopen(path, "rb");
-        if ( !fd ) {
-            perror(path);
+    md5_init(&ctx);
+    count = read(fd, buf, sizeof(buf));
+#ifndef NO_ZLIB
+    /* Only gzip files go through zlib, the others are hashed as they are read */
+    if ( unpack && count >= 2 && (unsigned char)buf[0] == 0x1f && (unsigned char)buf[1] == 0x8b ) {
+        gzFile gz;
+
+        if ( lseek(fd, 0, SEEK_SET) < 0 || !(gz = gzdopen(fd, "rb")) ) {
+            close(fd);
             return -1;
         }
-        md5_init(&ctx);
-        while ( (count = gzread(fd, buf, sizeof(buf))) > 0 ){        
+        while ( (count = gzread(gz, buf, sizeof(buf))) > 0 ){
             md5_write(&ctx, (unsigned char *)buf, count);
         }
         md5_final(&ctx);
-        gzclose(fd);
-    } else {
+        gzclose(gz);
+        format_md5(ctx.buf, md5sum);
+        return 0;
+    }
 #endif
-        FILE *fd = fopen(path, "rb");
-        if ( !fd ) {
-            perror(path);
-            return -1;
-        }
-        md5_init(&ctx);
-        while ( (count = fread(buf, 1, sizeof(buf), fd)) > 0 ){        
-            md5_write(&ctx, (unsigned char *)buf, count);
-        }
-        md5_final(&ctx);
-        fclose(fd);
+    while ( count > 0 ) {
+        md5_write(&ctx, (unsigned char *)buf, count);
+        total += count;
+        count = read(fd, buf, sizeof(buf));
     }
-    strcpy(md5sum, get_md5(ctx.buf));
+    md5_final(&ctx);
+    close(fd);
+    /* The file changed since its size was known */
+    if ( count < 0 || (size >= 0 && total != size) ) {
+        return -1;
+    }
+    format_md5(ctx.buf, md5sum);
     return 0;
 }
 
+int md5_compute(const char *path, char md5sum[], int unpack)
+{
+    int fd = open(path, O_RDONLY);
+
+    if ( fd < 0 ) {
+        perror(path);
+        return -1;
+    }
+    return md5_compute_fd(fd, md5sum, unpack);
+}
+
 #ifdef MD5SUM_PROGRAM
 
 #ifdef HAVE_FTW
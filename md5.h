@@ -1,6 +1,8 @@
 #ifndef _MD5_H_
 #define _MD5_H_
 
+#include <sys/types.h>
+
 #define CHECKSUM_SIZE   32
 
 typedef struct {
@@ -33,6 +35,11 @@ void md5_final( MD5_CONTEXT *hd );
  */
 int md5_compute(const char *path, char md5sum[], int unpack);
 
+/* Same as above, on an open file descriptor which is closed when done */
+int md5_compute_fd(int fd, char md5sum[], int unpack);
+/* Same, failing if the file doesn't have the given size (-1 if unknown) */
+int md5_compute_fd_size(int fd, off_t size, char md5sum[], int unpack);
+
 /* Get the ASCII representation of a binary MD5 checksum */
 const char *get_md5(unsigned char *binsum);
 
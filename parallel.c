@@ -0,0 +1,228 @@
+/* Minimal worker pool used to process arrays of independent items */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+/* Items are handed out in small batches to keep the lock cold */
+#define BATCH_SIZE 16
+
+typedef struct {
+    char *items;
+    size_t count, size, batch, next;
+    parallel_func func;
+    void *data;
+    pthread_mutex_t lock;
+} parallel_job_t;
+
+int parallel_cpus(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (n > 0) ? (int)n : 1;
+}
+
+static void *parallel_worker(void *arg)
+{
+    parallel_job_t *job = (parallel_job_t *)arg;
+    size_t i, end;
+
+    for ( ;; ) {
+        pthread_mutex_lock(&job->lock);
+        i = job->next;
+        end = i + job->batch;
+        if ( end > job->count ) {
+            end = job->count;
+        }
+        job->next = end;
+        pthread_mutex_unlock(&job->lock);
+
+        if ( i >= end ) {
+            break;
+        }
+        for ( ; i < end; ++i ) {
+            job->func(job->items + i*job->size, job->data);
+        }
+    }
+    return NULL;
+}
+
+void parallel_run(void *items, size_t count, size_t size, int nthreads,
+                  parallel_func func, void *data)
+{
+    parallel_run_batch(items, count, size, BATCH_SIZE, nthreads, func, data);
+}
+
+void parallel_run_batch(void *items, size_t count, size_t size, size_t batch, int nthreads,
+                        parallel_func func, void *data)
+{
+    parallel_job_t job;
+    pthread_t *threads;
+    int i, started = 0;
+
+    if ( nthreads <= 0 ) {
+        nthreads = parallel_cpus();
+    }
+    if ( batch < 1 ) {
+        batch = 1;
+    }
+    if ( nthreads > (count + batch - 1) / batch ) {
+        nthreads = (count + batch - 1) / batch;
+    }
+
+    job.items = (char *)items;
+    job.count = count;
+    job.size = size;
+    job.batch = batch;
+    job.next = 0;
+    job.func = func;
+    job.data = data;
+    pthread_mutex_init(&job.lock, NULL);
+
+    threads = NULL;
+    if ( nthreads > 1 ) {
+        threads = (pthread_t *)malloc((nthreads-1) * sizeof(pthread_t));
+        for ( i = 0; threads && i < nthreads-1; ++i ) {
+            if ( pthread_create(&threads[started], NULL, parallel_worker, &job) == 0 ) {
+                ++started;
+            }
+        }
+    }
+    /* Whatever the number of threads we could start, the job gets done */
+    parallel_worker(&job);
+    for ( i = 0; i < started; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+}
+
+/* Background queue */
+
+typedef struct _parallel_item_t {
+    void *item;
+    struct _parallel_item_t *next;
+} parallel_item_t;
+
+struct _parallel_queue_t {
+    parallel_func func;
+    void *data;
+    parallel_item_t *head, *tail;
+    int pending;    /* Queued or being processed */
+    int quit;
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+};
+
+static void *queue_worker(void *arg)
+{
+    parallel_queue_t *queue = (parallel_queue_t *)arg;
+    parallel_item_t *node;
+
+    pthread_mutex_lock(&queue->lock);
+    for ( ;; ) {
+        while ( !queue->head && !queue->quit ) {
+            pthread_cond_wait(&queue->work, &queue->lock);
+        }
+        if ( !queue->head ) {
+            break;
+        }
+        node = queue->head;
+        queue->head = node->next;
+        if ( !queue->head ) {
+            queue->tail = NULL;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        queue->func(node->item, queue->data);
+        free(node);
+
+        pthread_mutex_lock(&queue->lock);
+        if ( --queue->pending == 0 ) {
+            pthread_cond_broadcast(&queue->idle);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+parallel_queue_t *parallel_queue_new(int nthreads, parallel_func func, void *data)
+{
+    parallel_queue_t *queue;
+    int i;
+
+    if ( nthreads <= 0 ) {
+        nthreads = parallel_cpus();
+    }
+    queue = (parallel_queue_t *)calloc(1, sizeof(parallel_queue_t));
+    queue->func = func;
+    queue->data = data;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    pthread_cond_init(&queue->idle, NULL);
+    queue->threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    for ( i = 0; i < nthreads; ++i ) {
+        if ( pthread_create(&queue->threads[queue->nthreads], NULL, queue_worker, queue) == 0 ) {
+            ++queue->nthreads;
+        }
+    }
+    return queue;
+}
+
+void parallel_queue_push(parallel_queue_t *queue, void *item)
+{
+    parallel_item_t *node;
+
+    /* Without threads, the work is done right away */
+    if ( !queue->nthreads ) {
+        queue->func(item, queue->data);
+        return;
+    }
+    node = (parallel_item_t *)malloc(sizeof(parallel_item_t));
+    node->item = item;
+    node->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if ( queue->tail ) {
+        queue->tail->next = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    ++queue->pending;
+    pthread_cond_signal(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void parallel_queue_wait(parallel_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while ( queue->pending ) {
+        pthread_cond_wait(&queue->idle, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void parallel_queue_free(parallel_queue_t *queue)
+{
+    int i;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->quit = 1;
+    pthread_cond_broadcast(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+    for ( i = 0; i < queue->nthreads; ++i ) {
+        pthread_join(queue->threads[i], NULL);
+    }
+    free(queue->threads);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->work);
+    pthread_cond_destroy(&queue->idle);
+    free(queue);
+}
@@ -0,0 +1,40 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+/* Minimal worker pool used to process arrays of independent items */
+
+#include <stddef.h>
+
+typedef void (*parallel_func)(void *item, void *data);
+
+/* Number of online processors, at least 1 */
+int parallel_cpus(void);
+
+/* Call 'func' on each of the 'count' items of 'size' bytes in 'items', using up
+   to 'nthreads' threads (0 means one per processor). The calling thread takes part,
+   and the function returns once all the items have been processed.
+ */
+void parallel_run(void *items, size_t count, size_t size, int nthreads,
+                  parallel_func func, void *data);
+
+/* Same as parallel_run(), handing out 'batch' items at a time instead of a fixed
+   number, e.g. 1 for items that each take a long time */
+void parallel_run_batch(void *items, size_t count, size_t size, size_t batch, int nthreads,
+                        parallel_func func, void *data);
+
+/* Queue of items processed in the background by a set of threads */
+typedef struct _parallel_queue_t parallel_queue_t;
+
+/* Start 'nthreads' threads (0 means one per processor) calling 'func' on the items */
+parallel_queue_t *parallel_queue_new(int nthreads, parallel_func func, void *data);
+
+/* Add an item to the queue, it is processed in the order it was added */
+void parallel_queue_push(parallel_queue_t *queue, void *item);
+
+/* Wait until all the items added so far have been processed */
+void parallel_queue_wait(parallel_queue_t *queue);
+
+/* Process what is left in the queue, stop the threads and free it */
+void parallel_queue_free(parallel_queue_t *queue);
+
+#endif /* __PARALLEL_H__ */
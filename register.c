@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
 
 #include "arch.h"
 #include "setupdb.h"
@@ -22,21 +24,45 @@ void print_usage(const char *argv0)
 		   "      Register files in the component / option\n"
 		   "   script <component> <pre|post> <name> <path-to-script>\n"
 		   "      Register a new pre/post-uninstall script for the component\n"
+		   "   extract <component> <option> <archive.tar[.gz]>\n"
+		   "      Extract an archive under the install path and register its contents\n"
+		   "   import [-c] <component> <option> <md5sum list>\n"
+		   "      Register the files in a checksum list; -c spot-checks some of them\n"
 		   "   update <component> <option> <files>\n"
 		   "      Updates registration information\n"
 		   "   message <component> <\"message\">\n"
 		   "      Add an uninstallation warning message to the component\n"
 		   "   remove file [file [file ...]]\n"
 		   "      Remove specified files from the product\n"
+		   "   remove --prefix dir [dir ...]\n"
+		   "      Remove everything registered under the directories\n"
 		   "   listfiles [component]\n"
 		   "      List files installed under product [or component]\n"
+		   "   check [-j N] [--format=text|nul|json] [--only-problems] [component]\n"
+		   "      Verify the installed files, exits with 1 if any changed or was removed\n"
+		   "      --tier=stat|fingerprint|full stops at the size or partial fingerprint\n"
+		   "   check --sample <N%%|bytes[K|M|G]> [--seed N] [-j N] [--format=...] [--only-problems]\n"
+		   "      Only verify a random, size-weighted part of the files\n"
 		   "   desktop <component> <binary>\n"
 		   "      List all desktop items installed for a binary\n"
 		   "   printtags [component]\n"
 		   "      Print installed option tags\n"
+		   "   orphans\n"
+		   "      List the files under the install path that are not registered\n"
+		   "   refresh [-d]\n"
+		   "      Update checksums of the files changed on disk; -d drops missing files\n"
+		   "   todb <database>\n"
+		   "      Export the manifest to an SQLite database, for use by other tools\n"
 		   "   sysinfo\n"
-		   "      Print out system information as detected.\n",
-           argv0);
+		   "      Print out system information as detected.\n"
+		   "\n"
+		   "       %s which <path>\n"
+		   "      Print the product, component and option owning a file\n"
+		   "       %s reindex\n"
+		   "      Rebuild the index of the files owned by all products\n"
+		   "       %s fromdb <database> <product> <manifest.xml>\n"
+		   "      Write a product copied to a database back as an XML manifest\n",
+           argv0, argv0, argv0, argv0);
 }
 
 /* Create - does not update the version or tags ! */
@@ -154,12 +180,81 @@ int register_files(const char *component, const char *option, char **files)
     return 0;
 }
 
+int extract_archive(const char *component, const char *option, const char *archive)
+{
+    product_component_t *comp;
+    product_option_t *opt;
+
+    comp = loki_find_component(product, component);
+    if ( ! comp ) {
+        fprintf(stderr,"Unable to find component %s !\n", component);
+        return 1;
+    }
+    opt = loki_find_option(comp, option);
+    if ( ! opt ) {
+        fprintf(stderr,"Unable to find option %s !\n", option);
+        return 1;
+    }
+    if ( loki_extract_tarball(opt, archive, 0) < 0 ) {
+        fprintf(stderr,"Error while extracting %s\n", archive);
+        return 1;
+    }
+    return 0;
+}
+
+int import_list(int argc, char **argv)
+{
+    product_component_t *comp;
+    product_option_t *opt;
+    int flags = 0;
+
+    if ( argc > 0 && !strcmp(argv[0], "-c") ) {
+        flags |= LOKI_IMPORT_VERIFY;
+        --argc;
+        ++argv;
+    }
+    if ( argc != 3 ) {
+        print_usage("setupdb");
+        return 1;
+    }
+    comp = loki_find_component(product, argv[0]);
+    if ( ! comp ) {
+        fprintf(stderr,"Unable to find component %s !\n", argv[0]);
+        return 1;
+    }
+    opt = loki_find_option(comp, argv[1]);
+    if ( ! opt ) {
+        fprintf(stderr,"Unable to find option %s !\n", argv[1]);
+        return 1;
+    }
+    if ( loki_import_checksums(opt, argv[2], flags) < 0 ) {
+        fprintf(stderr,"Error while importing %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
+
 int remove_files(char **files)
 {
-    for ( ; *files; files ++ ) {
-        if ( loki_unregister_file(loki_findpath(*files, product)) < 0) {
-            fprintf(stderr,"Error while removing %s\n", *files);
+    int n, unmatched, ret = 0;
+
+    if ( !strcmp(*files, "--prefix") ) {
+        for ( ++files; *files; files ++ ) {
+            n = loki_unregister_prefix(product, *files);
+            if ( n < 0 ) {
+                fprintf(stderr,"Refusing to remove everything under the install path %s\n", *files);
+                ret = 1;
+            } else if ( n == 0 ) {
+                fprintf(stderr,"Nothing registered under %s\n", *files);
+            }
         }
+        return ret;
+    }
+    for ( n = 0; files[n]; ++n )
+        ;
+    loki_unregister_paths(product, (const char **)files, n, &unmatched);
+    if ( unmatched > 0 ) {
+        fprintf(stderr,"%d of the files were not registered\n", unmatched);
     }
     return 0;
 }
@@ -217,6 +312,179 @@ int list_files(const char *component)
 	return 0;
 }
 
+/* Output of the check command */
+enum { FORMAT_TEXT, FORMAT_NUL, FORMAT_JSON };
+
+typedef struct {
+	int format, only_problems, count;
+} check_output_t;
+
+static const char *check_status[] = { "OK", "CHANGED", "REMOVED" };
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for ( ; *str; ++str ) {
+		if ( *str == '"' || *str == '\\' ) {
+			putchar('\\');
+			putchar(*str);
+		} else if ( (unsigned char)*str < 0x20 ) {
+			printf("\\u%04x", *str);
+		} else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+static void print_check(product_file_t *file, file_check_t status, void *data)
+{
+	check_output_t *out = (check_output_t *)data;
+
+	if ( status == LOKI_OK && out->only_problems ) {
+		return;
+	}
+	switch ( out->format ) {
+		case FORMAT_NUL:
+			printf("%s %s%c", check_status[status], loki_getpath_file(file), '\0');
+			break;
+		case FORMAT_JSON:
+			printf("%s\n  {\"path\": ", out->count ? "," : "");
+			print_json_string(loki_getpath_file(file));
+			printf(", \"status\": \"%s\"}", check_status[status]);
+			break;
+		default:
+			printf("%s %s\n", check_status[status], loki_getpath_file(file));
+			break;
+	}
+	++out->count;
+}
+
+/* Parse a sampling budget, either a percentage or a number of bytes */
+static double parse_budget(const char *str)
+{
+	char *end;
+	double value = strtod(str, &end);
+
+	switch ( *end ) {
+		case '%':
+			value /= 100.0;
+			break;
+		case 'k': case 'K':
+			value *= 1024.0;
+			break;
+		case 'm': case 'M':
+			value *= 1024.0*1024.0;
+			break;
+		case 'g': case 'G':
+			value *= 1024.0*1024.0*1024.0;
+			break;
+		case '\0':
+			break;
+		default:
+			return -1.0;
+	}
+	return value;
+}
+
+int check_files(int argc, char **argv)
+{
+	product_component_t *comp = NULL;
+	check_output_t out;
+	sample_summary_t summary;
+	double budget = -1.0;
+	unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	int nthreads = 0, problems, level = -1;
+
+	out.format = FORMAT_TEXT;
+	out.only_problems = 0;
+	out.count = 0;
+	for ( ; argc > 0 && argv[0][0] == '-'; --argc, ++argv ) {
+		if ( !strcmp(argv[0], "-j") && argc > 1 ) {
+			nthreads = atoi(argv[1]);
+			--argc;
+			++argv;
+		} else if ( !strncmp(argv[0], "-j", 2) && argv[0][2] ) {
+			nthreads = atoi(argv[0]+2);
+		} else if ( !strcmp(argv[0], "--format=text") ) {
+			out.format = FORMAT_TEXT;
+		} else if ( !strcmp(argv[0], "--format=nul") ) {
+			out.format = FORMAT_NUL;
+		} else if ( !strcmp(argv[0], "--format=json") ) {
+			out.format = FORMAT_JSON;
+		} else if ( !strcmp(argv[0], "--only-problems") ) {
+			out.only_problems = 1;
+		} else if ( !strcmp(argv[0], "--tier=stat") ) {
+			level = LOKI_CHECK_STAT;
+		} else if ( !strcmp(argv[0], "--tier=fingerprint") ) {
+			level = LOKI_CHECK_FINGERPRINT;
+		} else if ( !strcmp(argv[0], "--tier=full") ) {
+			level = LOKI_CHECK_FULL;
+		} else if ( !strcmp(argv[0], "--sample") && argc > 1 ) {
+			budget = parse_budget(argv[1]);
+			if ( budget < 0.0 ) {
+				fprintf(stderr, "Invalid sample size: %s\n", argv[1]);
+				return 2;
+			}
+			--argc;
+			++argv;
+		} else if ( !strcmp(argv[0], "--seed") && argc > 1 ) {
+			seed = (unsigned int)strtoul(argv[1], NULL, 10);
+			--argc;
+			++argv;
+		} else {
+			print_usage("setupdb");
+			return 2;
+		}
+	}
+	if ( argc > 1 ) {
+		print_usage("setupdb");
+		return 2;
+	} else if ( argc == 1 ) {
+		if ( budget >= 0.0 ) {
+			fprintf(stderr, "Sampling checks the whole product\n");
+			return 2;
+		}
+		comp = loki_find_component(product, argv[0]);
+		if ( ! comp ) {
+			fprintf(stderr,"Unable to find component %s !\n", argv[0]);
+			return 2;
+		}
+	}
+
+	/* Results are written as they come, but not a line at a time */
+	setvbuf(stdout, NULL, _IOFBF, 1024*1024);
+	if ( out.format == FORMAT_JSON ) {
+		putchar('[');
+	}
+	if ( budget >= 0.0 ) {
+		problems = loki_check_product_sampled(product, budget, seed,
+											  nthreads, print_check, &out, &summary);
+	} else if ( level >= 0 ) {
+		problems = loki_check_product_tiered(product, comp, (check_level_t)level, nthreads,
+											 print_check, &out);
+	} else {
+		problems = loki_check_product(product, comp, nthreads, print_check, &out);
+	}
+	if ( out.format == FORMAT_JSON ) {
+		printf("%s]\n", out.count ? "\n" : "");
+	}
+	fflush(stdout);
+	if ( budget >= 0.0 && problems >= 0 ) {
+		/* Kept out of the way of machine-readable output */
+		fprintf(stderr, "%d executables and desktop items checked, %d problems\n",
+				summary.forced, summary.forced_problems);
+		fprintf(stderr, "%d files sampled with seed %u, %lu bytes in all, %d problems: "
+				"an estimated %.2f%% of the data changed, at most %.2f%% at 95%% confidence\n",
+				summary.sampled, seed, (unsigned long)summary.bytes,
+				summary.problems, summary.rate * 100.0, summary.upper * 100.0);
+	}
+	if ( problems < 0 ) {
+		return 2;
+	}
+	return problems > 0;
+}
+
 int list_desktop(const char *component, const char *binary)
 {
 	product_component_t *comp;
@@ -243,9 +511,103 @@ int list_desktop(const char *component, const char *binary)
 	return 0;
 }
 
+int refresh(int argc, char **argv)
+{
+	refresh_summary_t summary;
+	int flags = 0;
+
+	if ( argc > 0 && !strcmp(argv[0], "-d") ) {
+		flags |= LOKI_REFRESH_DROP_MISSING;
+	}
+	if ( loki_refresh_product(product, flags, 0, &summary) < 0 ) {
+		return 2;
+	}
+	printf("%d files checked, %d rehashed, %d changed, %d missing, %d dropped\n",
+		   summary.checked, summary.rehashed, summary.changed, summary.missing,
+		   summary.dropped);
+	if ( summary.failed > 0 ) {
+		fprintf(stderr, "%d files could not be read and were left unchanged\n", summary.failed);
+		return 1;
+	}
+	return 0;
+}
+
+static void print_orphan(const char *path, file_type_t type)
+{
+	printf("%s%s\n", path, (type == LOKI_FILE_DIRECTORY) ? "/" : "");
+}
+
+static void print_owner(const char *path, const char *prod, const char *component,
+						const char *option)
+{
+	printf("%s: %s / %s / %s\n", path, prod, component, option);
+}
+
+/* Print the owners of a file, from the index */
+int which_path(const char *path)
+{
+	char buf[PATH_MAX];
+	int count;
+
+	if ( *path != '/' ) {
+		if ( !getcwd(buf, sizeof(buf)) ) {
+			perror("getcwd");
+			return 1;
+		}
+		strncat(buf, "/", sizeof(buf)-strlen(buf)-1);
+		strncat(buf, path, sizeof(buf)-strlen(buf)-1);
+		path = buf;
+	}
+	count = loki_find_owners(path, print_owner);
+	if ( count < 0 ) {
+		fprintf(stderr, "Unable to read the file index\n");
+		return 1;
+	} else if ( count == 0 ) {
+		fprintf(stderr, "%s is not owned by any product\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+/* Copy the manifest of the product to an SQLite database */
+int to_database(const char *path)
+{
+	loki_sqlite_t *db = loki_sqlite_open(path);
+	int ret;
+
+	if ( ! db ) {
+		return 1;
+	}
+	ret = loki_sqlite_from_xml(db, loki_getinfo_product(product)->registry_path) < 0;
+	loki_sqlite_close(db);
+	return ret;
+}
+
+/* Write a product from an SQLite database back to an XML manifest */
+int from_database(const char *path, const char *name, const char *manifest)
+{
+	loki_sqlite_t *db = loki_sqlite_open(path);
+	int ret;
+
+	if ( ! db ) {
+		return 1;
+	}
+	ret = loki_sqlite_to_xml(db, name, manifest) < 0;
+	loki_sqlite_close(db);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int ret = 1;
+
+	if ( argc == 3 && !strcmp(argv[1], "which") ) {
+		return which_path(argv[2]);
+	} else if ( argc == 2 && !strcmp(argv[1], "reindex") ) {
+		return loki_rebuild_path_index() < 0;
+	} else if ( argc == 5 && !strcmp(argv[1], "fromdb") ) {
+		return from_database(argv[2], argv[3], argv[4]);
+	}
     if ( argc < 3 ) {
         print_usage(argv[0]);
         return 1;
@@ -260,7 +622,14 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-    product = loki_openproduct(argv[1]);
+	/* Commands that only read the manifest don't keep writers out */
+	if ( !strcmp(argv[2], "listfiles") || !strcmp(argv[2], "desktop") ||
+		 !strcmp(argv[2], "printtags") || !strcmp(argv[2], "orphans") ||
+		 !strcmp(argv[2], "check") || !strcmp(argv[2], "todb") ) {
+		product = loki_openproduct_flags(argv[1], LOKI_OPEN_READONLY);
+	} else {
+		product = loki_openproduct(argv[1]);
+	}
     if ( ! product ) {
         fprintf(stderr,"Unable to open product %s\n", argv[1]);
         return 1;
@@ -271,6 +640,14 @@ int main(int argc, char **argv)
         } else {
             ret = register_files(argv[3], argv[4], &argv[5]);
         }
+    } else if ( !strcmp(argv[2], "extract") ) {
+        if ( argc != 6 ) {
+            print_usage(argv[0]);
+        } else {
+            ret = extract_archive(argv[3], argv[4], argv[5]);
+        }
+    } else if ( !strcmp(argv[2], "import") ) {
+        ret = import_list(argc-3, &argv[3]);
     } else if ( !strcmp(argv[2], "remove") ) {
         if ( argc < 4 ) {
             print_usage(argv[0]);
@@ -303,6 +680,8 @@ int main(int argc, char **argv)
 		}
     } else if ( !strcmp(argv[2], "listfiles") ) {
 		ret = list_files(argc>3 ? argv[3] : NULL);
+    } else if ( !strcmp(argv[2], "check") ) {
+		ret = check_files(argc-3, &argv[3]);
     } else if ( !strcmp(argv[2], "desktop") ) {
         if ( argc != 5 ) {
             print_usage(argv[0]);
@@ -311,6 +690,16 @@ int main(int argc, char **argv)
 		}
 	} else if ( !strcmp(argv[2], "printtags") ) {
 		ret = printtags(argv[3]);
+	} else if ( !strcmp(argv[2], "orphans") ) {
+		ret = loki_scan_orphans(product, 0, print_orphan) < 0;
+	} else if ( !strcmp(argv[2], "refresh") ) {
+		ret = refresh(argc-3, &argv[3]);
+	} else if ( !strcmp(argv[2], "todb") ) {
+		if ( argc != 4 ) {
+			print_usage(argv[0]);
+		} else {
+			ret = to_database(argv[3]);
+		}
     } else {
         print_usage(argv[0]);
     }
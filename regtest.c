@@ -0,0 +1,475 @@
+/* Behaviour tests of the registry library, mostly for malformed input */
+/* Usage: regtest */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "setupdb.h"
+
+static char root[] = "/tmp/regtestXXXXXX";
+static char name[64];
+static char registry[PATH_MAX-16]; /* Where the manifest links and the index are */
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if ( !ok ) {
+        ++failures;
+    }
+}
+
+static int exists(const char *path)
+{
+    char full[PATH_MAX];
+    struct stat st;
+
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    return lstat(full, &st) == 0;
+}
+
+static void write_file(const char *path, const char *data)
+{
+    char full[PATH_MAX];
+    FILE *fp;
+
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    fp = fopen(full, "w");
+    if ( fp ) {
+        fputs(data, fp);
+        fclose(fp);
+    }
+}
+
+static void make_dir(const char *path)
+{
+    char full[PATH_MAX];
+
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    mkdir(full, 0755);
+}
+
+/* Files or empty directories */
+static void remove_file(const char *path)
+{
+    char full[PATH_MAX];
+
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    remove(full);
+}
+
+/* Write a ustar header, with 'size' as a base-256 field if 'binsize' is set */
+static void tar_header(FILE *fp, const char *path, char type, long long size,
+                       const char *linkname, int binsize)
+{
+    unsigned char block[512];
+    unsigned int sum = 0;
+    int i;
+
+    memset(block, 0, sizeof(block));
+    snprintf((char *)block, 100, "%s", path);
+    snprintf((char *)block + 100, 8, "%07o", 0644);
+    snprintf((char *)block + 108, 8, "%07o", 0);
+    snprintf((char *)block + 116, 8, "%07o", 0);
+    if ( binsize ) {
+        for ( i = 0; i < 8; ++i ) {
+            block[135-i] = (unsigned char)(size >> (8*i));
+        }
+        block[124] |= 0x80;
+    } else {
+        snprintf((char *)block + 124, 12, "%011llo", size);
+    }
+    snprintf((char *)block + 136, 12, "%011o", 0);
+    block[156] = type;
+    if ( linkname ) {
+        snprintf((char *)block + 157, 100, "%s", linkname);
+    }
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memset(block + 148, ' ', 8);
+    for ( i = 0; i < 512; ++i ) {
+        sum += block[i];
+    }
+    snprintf((char *)block + 148, 8, "%06o", sum);
+    fwrite(block, 1, sizeof(block), fp);
+}
+
+static void tar_data(FILE *fp, const char *data, size_t len)
+{
+    char pad[512];
+
+    memset(pad, 0, sizeof(pad));
+    fwrite(data, 1, len, fp);
+    fwrite(pad, 1, (512 - len % 512) % 512, fp);
+}
+
+static void tar_end(FILE *fp)
+{
+    char block[1024];
+
+    memset(block, 0, sizeof(block));
+    fwrite(block, 1, sizeof(block), fp);
+    fclose(fp);
+}
+
+/* Each archive gets its own option, returns what loki_extract_tarball() did */
+static int extract(product_t *product, const char *archive)
+{
+    product_option_t *opt;
+
+    opt = loki_create_option(loki_find_component(product, "base"), archive, NULL);
+    return loki_extract_tarball(opt, archive, 0);
+}
+
+static void test_tar(product_t *product)
+{
+    char archive[PATH_MAX];
+    const char *pax = "14 size=-5000\n";
+    FILE *fp;
+
+    snprintf(archive, sizeof(archive), "%s.tar", root);
+
+    fp = fopen(archive, "w");
+    tar_header(fp, "good", '0', 5, NULL, 0);
+    tar_data(fp, "hello", 5);
+    tar_end(fp);
+    check(extract(product, archive) == 1 && exists("good"), "a well-formed archive is extracted");
+
+    fp = fopen(archive, "w");
+    tar_header(fp, "negative", '0', -100000, NULL, 1);
+    tar_data(fp, "hello", 5);
+    tar_end(fp);
+    check(extract(product, archive) < 0, "a negative base-256 size is an error");
+
+    fp = fopen(archive, "w");
+    tar_header(fp, "huge", '0', 0x7FFFFFFFFFFFFFFFLL, NULL, 1);
+    tar_end(fp);
+    check(extract(product, archive) < 0, "an overflowing base-256 size is an error");
+
+    fp = fopen(archive, "w");
+    tar_header(fp, "PaxHeader", 'x', strlen(pax), NULL, 0);
+    tar_data(fp, pax, strlen(pax));
+    tar_header(fp, "paxed", '0', 5, NULL, 0);
+    tar_data(fp, "hello", 5);
+    tar_end(fp);
+    check(extract(product, archive) < 0 && !exists("paxed"), "a negative pax size is an error");
+
+    fp = fopen(archive, "w");
+    tar_header(fp, "truncated", '0', 100000, NULL, 0);
+    tar_data(fp, "hello", 5);
+    fclose(fp);
+    check(extract(product, archive) < 0, "a truncated member is an error");
+
+    fp = fopen(archive, "w");
+    tar_header(fp, "../evil", '0', 5, NULL, 0);
+    tar_data(fp, "hello", 5);
+    tar_header(fp, "abs", '2', 0, "/etc", 0);
+    tar_header(fp, "up", '2', 0, "../..", 0);
+    tar_header(fp, "sub", '5', 0, NULL, 0);
+    tar_header(fp, "sub/ok", '2', 0, "../good", 0);
+    tar_header(fp, "hard", '1', 0, "../evil", 0);
+    tar_end(fp);
+    check(extract(product, archive) == 2, "only the members beneath the root are extracted");
+    check(!exists("abs") && !exists("up") && !exists("hard"), "links out of the root are skipped");
+    check(exists("sub/ok"), "links inside the root are extracted");
+    check(access("/tmp/evil", F_OK) < 0, "nothing is written above the root");
+
+    /* A member under a symbolic link must not follow it out of the root */
+    fp = fopen(archive, "w");
+    tar_header(fp, "escape", '2', 0, "sub", 0);
+    tar_header(fp, "escape/x", '0', 5, NULL, 0);
+    tar_data(fp, "hello", 5);
+    tar_end(fp);
+    extract(product, archive);
+    check(!exists("sub/x"), "members are not written through symbolic links");
+    unlink(archive);
+}
+
+/* Files whose checksums are still pending may be removed with their option */
+static void test_deferred(product_t *product)
+{
+    product_component_t *comp;
+    product_option_t *opt;
+    char path[32];
+    int i, j;
+
+    loki_defer_hashes(product, 2);
+    comp = loki_create_component(product, "deferred", "1.0");
+    for ( i = 0; i < 200; ++i ) {
+        snprintf(path, sizeof(path), "hashed%03d", i);
+        write_file(path, path);
+    }
+    for ( j = 0; j < 2; ++j ) {
+        opt = loki_create_option(comp, j ? "second" : "first", NULL);
+        for ( i = 0; i < 200; ++i ) {
+            snprintf(path, sizeof(path), "hashed%03d", i);
+            loki_register_file(opt, path, NULL);
+        }
+        if ( !j ) {
+            loki_remove_option(opt);
+        }
+    }
+    loki_remove_component(comp);
+    check(loki_flush_hashes(product) == 0, "pending checksums of removed files are dropped");
+    loki_defer_hashes(product, -1);
+    for ( i = 0; i < 200; ++i ) {
+        snprintf(path, sizeof(path), "hashed%03d", i);
+        remove_file(path);
+    }
+}
+
+/* Bulk removal of paths, and of everything under a directory */
+static void test_unregister(product_t *product)
+{
+    static const char *files[] = { "a/1", "a/2", "a/sub/3", "ab/1", "b/1", "b/2", "c", NULL };
+    const char *paths[4];
+    char full[PATH_MAX];
+    product_option_t *opt;
+    int i, unmatched = -1;
+
+    opt = loki_create_option(loki_create_component(product, "unregister", "1.0"), "files", NULL);
+    make_dir("a");
+    make_dir("a/sub");
+    make_dir("ab");
+    make_dir("b");
+    loki_register_file(opt, "a/sub", NULL);
+    for ( i = 0; files[i]; ++i ) {
+        write_file(files[i], files[i]);
+        loki_register_file(opt, files[i], NULL);
+    }
+
+    snprintf(full, sizeof(full), "%s/b/1", root);
+    paths[0] = "b/1";
+    paths[1] = full; /* The same file again */
+    paths[2] = "missing";
+    paths[3] = "c/";
+    check(loki_unregister_paths(product, paths, 4, &unmatched) == 2 && unmatched == 1,
+          "a list of paths is unregistered at once");
+    check(!loki_findpath("b/1", product) && !loki_findpath("c", product) &&
+          loki_findpath("b/2", product), "only the listed paths are unregistered");
+
+    check(loki_unregister_prefix(product, "a/") == 4, "a directory is unregistered with its contents");
+    check(!loki_findpath("a/sub/3", product) && loki_findpath("ab/1", product),
+          "paths only starting with the same name are kept");
+    check(loki_unregister_prefix(product, root) < 0 && loki_findpath("b/2", product),
+          "the install path itself is not unregistered");
+    check(loki_unregister_prefix(product, "missing") == 0, "nothing is unregistered under a missing directory");
+
+    loki_remove_option(opt);
+    for ( i = 0; files[i]; ++i ) {
+        remove_file(files[i]);
+    }
+    remove_file("a/sub");
+    remove_file("a");
+    remove_file("ab");
+    remove_file("b");
+}
+
+/* Run the setupdb tool on the product, which must be saved */
+static int run_setupdb(const char *args)
+{
+    char cmd[256];
+    int status;
+
+    snprintf(cmd, sizeof(cmd), "./setupdb %s %s >/dev/null 2>&1", name, args);
+    status = system(cmd);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* The exit status of the check command tells whether anything changed */
+static product_t *test_check(product_t *product)
+{
+    product_option_t *opt;
+
+    write_file("checked", "checked");
+    write_file("removed", "removed");
+    opt = loki_create_option(loki_create_component(product, "check", "1.0"), "files", NULL);
+    loki_register_file(opt, "checked", NULL);
+    loki_register_file(opt, "removed", NULL);
+    loki_closeproduct(product);
+    check(run_setupdb("check") == 0, "check succeeds when nothing changed");
+    check(run_setupdb("check -j 2 --tier=stat --format=json") == 0, "tiered checks succeed too");
+    write_file("checked", "CHECKED");
+    check(run_setupdb("check --only-problems") == 1, "check fails when a file changed");
+    write_file("checked", "checked");
+    remove_file("removed");
+    check(run_setupdb("check --format=nul check") == 1, "check fails when a file was removed");
+    check(run_setupdb("check nosuchcomponent") == 2, "check reports bad arguments apart");
+    write_file("removed", "removed");
+    return loki_openproduct(name);
+}
+
+static void remove_index(void)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/.paths", registry);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.paths.log", registry);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.paths.lock", registry);
+    unlink(path);
+}
+
+static int index_exists(void)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/.paths", registry);
+    return access(path, F_OK) == 0;
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static int owners(const char *path)
+{
+    char full[PATH_MAX];
+
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    return loki_find_owners(full, NULL);
+}
+
+/* Saving only appends the changes to the journal of the index */
+static product_t *test_index(product_t *product)
+{
+    char index[PATH_MAX], journal[PATH_MAX], full[PATH_MAX], path[32];
+    product_option_t *opt;
+    product_t *other;
+    off_t size;
+    int i;
+
+    snprintf(index, sizeof(index), "%s/.paths", registry);
+    snprintf(journal, sizeof(journal), "%s/.paths.log", registry);
+    loki_rebuild_path_index();
+    write_file("shared", "shared");
+    opt = loki_create_option(loki_create_component(product, "index", "1.0"), "files", NULL);
+    loki_register_file(opt, "shared", NULL);
+    loki_closeproduct(product);
+    product = loki_openproduct(name);
+    check(owners("shared") == 1, "a registered file is found in the index");
+
+    /* Another product owning the same file */
+    snprintf(full, sizeof(full), "%s/other", root);
+    mkdir(full, 0755);
+    other = loki_create_product("regtest-other", full, "Registry tests", "");
+    opt = loki_create_option(loki_create_component(other, "base", "1.0"), "files", NULL);
+    snprintf(full, sizeof(full), "%s/shared", root);
+    loki_register_file(opt, full, NULL);
+    check(loki_path_refcount(other, full, NULL) == 2, "unsaved files are counted as references");
+    size = file_size(index);
+    loki_closeproduct(other);
+    check(owners("shared") == 2, "files of several products have several owners");
+    check(file_size(index) == size && file_size(journal) > 0, "saving appends to the journal");
+
+    other = loki_openproduct("REGTEST-OTHER");
+    loki_unregister_path(loki_find_option(loki_find_component(other, "base"), "files"), full);
+    check(loki_path_refcount(other, full, NULL) == 1, "unregistered files are no longer references");
+    loki_closeproduct(other);
+    check(owners("shared") == 1, "unregistered files are dropped from the index");
+    other = loki_openproduct("regtest-other");
+    loki_register_file(loki_find_option(loki_find_component(other, "base"), "files"), full, NULL);
+    loki_closeproduct(other);
+    check(owners("shared") == 2, "files registered again are back in the index");
+    loki_removeproduct(loki_openproduct("regtest-other"));
+    check(owners("shared") == 1, "the files of a removed product are dropped from the index");
+
+    /* A large journal gets merged into the index */
+    opt = loki_find_option(loki_find_component(product, "index"), "files");
+    for ( i = 0; i < 2000; ++i ) {
+        snprintf(path, sizeof(path), "many%04d", i);
+        write_file(path, path);
+        loki_register_file(opt, path, NULL);
+    }
+    snprintf(full, sizeof(full), "%s/many1999", root);
+    check(loki_path_refcount(product, full, NULL) == 1 && loki_findpath("many0000", product),
+          "registered files are found by path");
+    loki_closeproduct(product);
+    check(file_size(index) > size && file_size(journal) <= 0, "the journal is merged into the index");
+    check(owners("many0000") == 1 && owners("many1999") == 1 && owners("shared") == 1,
+          "the merged index has all the files");
+    product = loki_openproduct(name);
+    opt = loki_find_option(loki_find_component(product, "index"), "files");
+    for ( i = 0; i < 2000; ++i ) {
+        snprintf(path, sizeof(path), "many%04d", i);
+        loki_unregister_path(opt, path);
+        remove_file(path);
+    }
+    loki_closeproduct(product);
+    check(owners("many0000") == 0 && owners("many1999") == 0 && owners("shared") == 1,
+          "the merged index drops the unregistered files");
+
+    remove_index();
+    check(owners("shared") == 1, "a missing index is built again");
+    return loki_openproduct(name);
+}
+
+/* The first save of a product builds the index, from the writer thread too */
+static product_t *test_async(product_t *product)
+{
+    loki_close_handle_t *handle;
+
+    remove_index();
+    loki_create_component(product, "async", "1.0");
+    handle = loki_closeproduct_async(product);
+    check(loki_wait_close(handle) == 0, "asynchronous close without an index");
+    check(index_exists(), "the index is built by the writer thread");
+    return loki_openproduct(name);
+}
+
+int main(void)
+{
+    product_component_t *comp, *next;
+    product_t *product;
+    struct passwd *pwent;
+
+    /* A hang is a failure too */
+    alarm(60);
+    if ( !mkdtemp(root) ) {
+        perror(root);
+        return 2;
+    }
+    /* Keep away from the real registry */
+    snprintf(name, sizeof(name), "regtest-%d", (int)getpid());
+    setenv("SETUPDB_XML_BASE", name, 1);
+    pwent = getpwuid(geteuid());
+    snprintf(registry, sizeof(registry), "%s/.loki/installed/%s", pwent ? pwent->pw_dir : "/", name);
+    product = loki_create_product(name, root, "Registry tests", "");
+    if ( !product ) {
+        fprintf(stderr, "Unable to create product %s\n", name);
+        return 2;
+    }
+    loki_create_component(product, "base", "1.0");
+
+    test_tar(product);
+    test_deferred(product);
+    test_unregister(product);
+    product = test_check(product);
+    product = test_async(product);
+    product = test_index(product);
+
+    /* Uninstalling removes the files, and the product its root once empty */
+    for ( comp = loki_getfirst_component(product); comp; comp = next ) {
+        next = loki_getnext_component(comp);
+        loki_uninstall_component(comp, LOKI_UNINSTALL_ALL, 1, NULL);
+    }
+    loki_removeproduct(product);
+    if ( access(root, F_OK) == 0 ) {
+        fprintf(stderr, "Leaving %s behind\n", root);
+    }
+    remove_index();
+    rmdir(registry);
+
+    return failures ? 1 : 0;
+}
@@ -18,6 +18,7 @@
 #define XML_CHILDREN(node) ((node)->childs)
 #define XML_ADD_TEXT(parent, text)
 #define XML_SAVE_FILE(path, doc) xmlSaveFile(path, doc)
+#define XML_COPY_NODE(node, doc) xmlCopyNode(node, 1)
 
 /* Useful if using Glade */
 #define GLADE_XML_UNREF(glade) gtk_object_unref(GTK_OBJECT(glade))
@@ -32,6 +33,7 @@ int xmlUnsetProp(xmlNodePtr node, const xmlChar *name);
 #define XML_CHILDREN(node) ((node)->children)
 #define XML_ADD_TEXT(parent, text) xmlAddChild((parent),xmlNewText(text))
 #define XML_SAVE_FILE(path, doc) xmlSaveFormatFile(path, doc, 1)
+#define XML_COPY_NODE(node, doc) xmlDocCopyNode(node, doc, 1)
 
 #define GLADE_XML_UNREF(glade) g_object_unref(G_OBJECT(glade))
 #define GLADE_XML_NEW(a, b) glade_xml_new(a, b, NULL)
@@ -1,6 +1,7 @@
 /* Implementation of the Loki Product DB API */
 /* $Id: setupdb.c,v 1.89 2007-01-26 03:01:22 megastep Exp $ */
 
+#define _GNU_SOURCE /* copy_file_range(), O_PATH */
 #include "config.h"
 #include <glob.h>
 #include <unistd.h>
@@ -13,10 +14,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#ifdef __linux
+#include <sys/xattr.h>
+#endif
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
 #include <ctype.h>
+#include <time.h>
+#include <math.h>
 
 #ifdef HAVE_SYS_MKDEV_H
 #include <sys/mkdev.h>
@@ -29,6 +39,8 @@
 #include "setupdb.h"
 #include "arch.h"
 #include "md5.h"
+#include "parallel.h"
+#include "tar.h"
 
 typedef struct _loki_envvar_t 
 {
@@ -38,6 +50,13 @@ typedef struct _loki_envvar_t
 	struct _loki_envvar_t *next;
 } product_envvar_t;
 
+typedef struct _loki_change_t
+{
+	change_type_t op;
+	char *path;
+	struct _loki_change_t *next;
+} product_change_t;
+
 struct _loki_product_t
 {
     xmlDocPtr doc;
@@ -46,6 +65,23 @@ struct _loki_product_t
     product_component_t *components, *default_comp;
 	/* Environment variables */
 	product_envvar_t *envvars;
+	/* Generation of the saved file, and changes that will be logged in the next one */
+	unsigned long generation;
+	product_change_t *changes, *last_change;
+	int num_changes, changes_lost;
+	/* Lock held on the manifest, and whether it can be written back */
+	struct _loki_lock_t *lock;
+	int readonly;
+	/* Descriptor on the root directory, for the *at() calls */
+	int rootfd;
+	/* Checksums computed in the background, see loki_defer_hashes() */
+	parallel_queue_t *hasher;
+	struct _loki_hash_t *hashes, *last_hash;
+	/* Files from this size get chunk checksums, 0 if none do */
+	off_t chunk_min;
+	/* Registered files hashed by path, chained through file->path_next */
+	product_file_t **paths;
+	size_t paths_size, num_paths;
 };
 
 struct _loki_product_component_t
@@ -60,6 +96,9 @@ struct _loki_product_component_t
     product_file_t *scripts;
 	/* Environment variables */
 	product_envvar_t *envvars;
+	/* Total size of the files, and number of files of unknown size */
+	size_t size;
+	int unsized;
     product_component_t *next;
 };
 
@@ -71,6 +110,8 @@ struct _loki_product_option_t
 	char *tag;
     product_option_t *next;    
     product_file_t *files;
+	size_t size;
+	int unsized;
 };
 
 struct _loki_product_file_t {
@@ -81,7 +122,11 @@ struct _loki_product_file_t {
     unsigned int mode;
     unsigned int patched : 1;
 	unsigned int mutable : 1;
+	unsigned int removed : 1; /* Set while uninstalling */
+	unsigned int unsized : 1; /* Manifests from older versions have no sizes */
 	char *desktop;
+	size_t size;
+	time_t mtime; /* Of regular files, 0 if unknown */
     union {        
         unsigned char md5sum[16];
         script_type_t scr_type;
@@ -89,9 +134,27 @@ struct _loki_product_file_t {
 #ifdef __linux
 	char *se_context; /* SELinux context, optional */
 #endif
+	struct _loki_hash_t *hash; /* Checksum being computed in the background */
     product_file_t *next;
+	product_file_t *path_next; /* In the same bucket of product->paths */
 };
 
+/* A file to hash in the background */
+typedef struct _loki_hash_t
+{
+	product_file_t *file; /* NULL once the file is unregistered */
+	int update;           /* Whether the file was registered before */
+	int dirfd;
+	char *path;
+	off_t size;
+	int status;
+	char md5sum[CHECKSUM_SIZE+1];
+	char fingerprint[CHECKSUM_SIZE+1];
+	int chunked;          /* Whether the chunk checksums are wanted */
+	char *chunks;
+	struct _loki_hash_t *next;
+} product_hash_t;
+
 
 #if LIBXML_VERSION < 20000
 /* Implementation of this function that is only in libxml2 */
@@ -116,6 +179,14 @@ static int glob_index;
 
 static const char *script_types[] = { "pre-uninstall", "post-uninstall" };
 
+static const char *change_types[] = { "add", "update", "remove" };
+
+/* Maximum number of entries kept in the change log of a product */
+#define MAX_CHANGES 1024
+
+/* Default gzip level for compressed manifests */
+#define DEFAULT_COMPRESSION 6
+
 static const char *get_productname(char *inipath)
 {
     char *ret = strrchr(inipath, '/') + 1, *ptr;
@@ -135,6 +206,651 @@ static char *expand_path(product_t *prod, const char *path, char *buf, size_t le
     return loki_trim_slashes(buf);
 }
 
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* The root directory is opened the first time it is needed, as it may not
+   exist yet when the product is created. Callers running several threads
+   must make sure it is opened before starting them.
+ */
+static int get_rootfd(product_t *prod)
+{
+    if ( prod->rootfd < 0 ) {
+        prod->rootfd = open(prod->info.root, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    }
+    return prod->rootfd;
+}
+
+/* Get the directory descriptor and path to use with the *at() functions, so that
+   paths relative to the root don't have to be built and walked from / every time.
+   'buf' is only used if the root directory can't be opened.
+ */
+static const char *at_path(product_t *prod, const char *path, int *dirfd, char *buf, size_t len)
+{
+    if ( *path == '/' ) {
+        *dirfd = AT_FDCWD;
+        return path;
+    }
+    if ( get_rootfd(prod) >= 0 ) {
+        *dirfd = prod->rootfd;
+        return *path ? path : ".";
+    }
+    *dirfd = AT_FDCWD;
+    return expand_path(prod, path, buf, len);
+}
+
+/* Remember a change to a file, to be logged when the product is saved */
+static void record_change(product_t *product, change_type_t op, const char *path)
+{
+	product_change_t *change;
+
+	/* Consecutive updates to the same file only need to be logged once */
+	if ( op == LOKI_CHANGE_UPDATE && product->last_change &&
+		 product->last_change->op != LOKI_CHANGE_REMOVE &&
+		 !strcmp(product->last_change->path, path) ) {
+		return;
+	}
+
+	change = (product_change_t *)malloc(sizeof(product_change_t));
+	change->op = op;
+	change->path = strdup(path);
+	change->next = NULL;
+	if ( product->last_change ) {
+		product->last_change->next = change;
+	} else {
+		product->changes = change;
+	}
+	product->last_change = change;
+
+	/* The log is bounded, readers will have to rescan the product */
+	if ( ++product->num_changes > MAX_CHANGES ) {
+		change = product->changes;
+		product->changes = change->next;
+		free(change->path);
+		free(change);
+		product->num_changes --;
+		product->changes_lost = 1;
+	}
+}
+
+/* Thread-safe version of get_md5() */
+static void format_md5(const unsigned char *md5, char *sum)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for ( i = 0; i < 16; ++i ) {
+        sum[i*2] = hex[md5[i] >> 4];
+        sum[i*2+1] = hex[md5[i] & 15];
+    }
+    sum[32] = '\0';
+}
+
+/* Large files also get a partial fingerprint: the MD5 of their size and of their
+   first, middle and last blocks, which is enough to catch most changes to them
+   without reading them whole. Unlike the checksum, it is on the raw contents.
+ */
+#define FINGERPRINT_BLOCK (64*1024)
+#define FINGERPRINT_MIN   (16*FINGERPRINT_BLOCK)
+
+/* 'fingerprint' is left empty for smaller files, or if they can't be read */
+static void compute_fingerprint(int fd, off_t size, char fingerprint[])
+{
+    unsigned char *buf, sizebuf[8];
+    off_t offsets[3];
+    ssize_t count = 0;
+    size_t done;
+    MD5_CONTEXT ctx;
+    int i;
+
+    fingerprint[0] = '\0';
+    if ( size < FINGERPRINT_MIN || !(buf = (unsigned char *)malloc(FINGERPRINT_BLOCK)) ) {
+        return;
+    }
+    offsets[0] = 0;
+    offsets[1] = (size - FINGERPRINT_BLOCK) / 2;
+    offsets[2] = size - FINGERPRINT_BLOCK;
+    for ( i = 0; i < 8; ++i ) {
+        sizebuf[i] = (unsigned char)((unsigned long long)size >> (i*8));
+    }
+    md5_init(&ctx);
+    md5_write(&ctx, sizebuf, sizeof(sizebuf));
+    for ( i = 0; i < 3; ++i ) {
+        for ( done = 0; done < FINGERPRINT_BLOCK; done += count ) {
+            count = pread(fd, buf + done, FINGERPRINT_BLOCK - done, offsets[i] + done);
+            if ( count <= 0 ) {
+                free(buf);
+                return;
+            }
+        }
+        md5_write(&ctx, buf, FINGERPRINT_BLOCK);
+    }
+    md5_final(&ctx);
+    format_md5(ctx.buf, fingerprint);
+    free(buf);
+}
+
+/* Record the fingerprint of a regular file, returns whether it changed */
+static int set_file_fingerprint(product_file_t *file, const char *fingerprint)
+{
+    char *old = (char *)xmlGetProp(file->node, BAD_CAST "fingerprint");
+    int changed = old ? strcmp(old, fingerprint) != 0 : *fingerprint != '\0';
+
+    if ( changed ) {
+        if ( *fingerprint ) {
+            xmlSetProp(file->node, BAD_CAST "fingerprint", BAD_CAST fingerprint);
+        } else {
+            xmlUnsetProp(file->node, BAD_CAST "fingerprint");
+        }
+    }
+    xmlFree(old);
+    return changed;
+}
+
+/* Files of at least loki_setchunking_product() bytes also get the MD5 of each of
+   their CHUNK_SIZE byte chunks, as a string of hex digests one after the other, so
+   that they can be verified by several threads. These are on the raw contents, and
+   the checksum of the whole file is still the reference.
+ */
+#define CHUNK_SIZE (8*1024*1024)
+#define CHUNK_READ (64*1024)
+
+#define NUM_CHUNKS(size) ((size_t)(((size) + CHUNK_SIZE - 1) / CHUNK_SIZE))
+
+static int wants_chunks(product_t *product, off_t size)
+{
+    return product->chunk_min > 0 && size >= product->chunk_min;
+}
+
+typedef struct {
+    int fd, failed;
+    off_t size;
+    char *sums;
+} chunk_job_t;
+
+static void hash_chunk(void *item, void *data)
+{
+    size_t i = *(size_t *)item;
+    chunk_job_t *job = (chunk_job_t *)data;
+    off_t offset = (off_t)i * CHUNK_SIZE, end = offset + CHUNK_SIZE;
+    unsigned char *buf = (unsigned char *)malloc(CHUNK_READ);
+    char sum[CHECKSUM_SIZE+1];
+    ssize_t count = 0;
+    MD5_CONTEXT ctx;
+
+    if ( end > job->size ) {
+        end = job->size;
+    }
+    md5_init(&ctx);
+    for ( ; buf && offset < end; offset += count ) {
+        count = pread(job->fd, buf, (end - offset < CHUNK_READ) ? end - offset : CHUNK_READ, offset);
+        if ( count <= 0 ) {
+            break;
+        }
+        md5_write(&ctx, buf, count);
+    }
+    md5_final(&ctx);
+    /* Without the terminating zero, which would be over the next chunk */
+    format_md5(ctx.buf, sum);
+    memcpy(job->sums + i*CHECKSUM_SIZE, sum, CHECKSUM_SIZE);
+    if ( offset < end ) {
+        job->failed = 1;
+    }
+    free(buf);
+}
+
+/* Checksums of the chunks of a file with pread(), using up to 'nthreads' threads.
+   Returns a string to be freed, or NULL if the file couldn't be read. */
+static char *compute_chunks(int fd, off_t size, int nthreads)
+{
+    size_t i, num = NUM_CHUNKS(size), *items;
+    chunk_job_t job;
+
+    job.fd = fd;
+    job.size = size;
+    job.failed = 0;
+    job.sums = (char *)malloc(num*CHECKSUM_SIZE + 1);
+    items = (size_t *)malloc((num+1) * sizeof(size_t));
+    for ( i = 0; i < num; ++i ) {
+        items[i] = i;
+    }
+    parallel_run_batch(items, num, sizeof(size_t), 1, nthreads, hash_chunk, &job);
+    job.sums[num*CHECKSUM_SIZE] = '\0';
+    free(items);
+    if ( job.failed ) {
+        free(job.sums);
+        return NULL;
+    }
+    return job.sums;
+}
+
+/* Checksum of a file and of its chunks, reading it only once unless it is compressed.
+   The descriptor is closed. Fails if the file doesn't have the given size. */
+static int md5_compute_chunked(int fd, off_t size, char md5sum[], char **chunks)
+{
+    unsigned char magic[2], *buf;
+    off_t total;
+    ssize_t count = 0;
+    size_t want;
+    MD5_CONTEXT whole, part;
+
+    if ( pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b ) {
+        *chunks = compute_chunks(fd, size, 1);
+        return md5_compute_fd_size(fd, size, md5sum, 1);
+    }
+    buf = (unsigned char *)malloc(CHUNK_READ);
+    *chunks = (char *)malloc(NUM_CHUNKS(size)*CHECKSUM_SIZE + 1);
+    md5_init(&whole);
+    md5_init(&part);
+    for ( total = 0; total < size; total += count ) {
+        /* Reads don't cross the chunk boundaries */
+        want = CHUNK_SIZE - total % CHUNK_SIZE;
+        if ( want > CHUNK_READ ) {
+            want = CHUNK_READ;
+        }
+        count = read(fd, buf, want);
+        if ( count <= 0 ) {
+            break;
+        }
+        md5_write(&whole, buf, count);
+        md5_write(&part, buf, count);
+        if ( (total + count) % CHUNK_SIZE == 0 || total + count == size ) {
+            md5_final(&part);
+            format_md5(part.buf, *chunks + (total / CHUNK_SIZE)*CHECKSUM_SIZE);
+            md5_init(&part);
+        }
+    }
+    /* Make sure the file didn't grow meanwhile */
+    if ( total == size && count >= 0 ) {
+        count = read(fd, buf, 1);
+    }
+    close(fd);
+    free(buf);
+    if ( count != 0 || total != size ) {
+        free(*chunks);
+        *chunks = NULL;
+        return -1;
+    }
+    md5_final(&whole);
+    format_md5(whole.buf, md5sum);
+    return 0;
+}
+
+/* Record the chunk checksums of a regular file, or remove them if 'chunks' is NULL.
+   Returns whether they changed. */
+static int set_file_chunks(product_file_t *file, const char *chunks)
+{
+    char *old = (char *)xmlGetProp(file->node, BAD_CAST "chunks");
+    int changed = old ? (!chunks || strcmp(old, chunks)) : chunks != NULL;
+
+    if ( changed ) {
+        if ( chunks ) {
+            xmlSetProp(file->node, BAD_CAST "chunks", BAD_CAST chunks);
+        } else {
+            xmlUnsetProp(file->node, BAD_CAST "chunks");
+        }
+    }
+    xmlFree(old);
+    return changed;
+}
+
+/* Checksum of the uncompressed contents of a file, 'size' is -1 if it isn't known.
+   The fingerprint is computed as well if 'fingerprint' is not NULL, and the chunk
+   checksums if 'chunks' is not NULL. */
+static int md5_compute_at(int dirfd, const char *path, off_t size, char md5sum[],
+                          char fingerprint[], char **chunks)
+{
+    int fd = openat(dirfd, path, O_RDONLY|O_CLOEXEC);
+
+    if ( fd < 0 ) {
+        perror(path);
+        return -1;
+    }
+    if ( fingerprint ) {
+        compute_fingerprint(fd, size, fingerprint);
+    }
+    if ( chunks && size > 0 ) {
+        return md5_compute_chunked(fd, size, md5sum, chunks);
+    }
+    return md5_compute_fd_size(fd, size, md5sum, 1);
+}
+
+#ifdef __linux
+/* Contexts are only looked for when SELinux is there */
+static int selinux_enabled(void)
+{
+    static int enabled = -1;
+
+    if ( enabled < 0 ) {
+        enabled = (access("/sys/fs/selinux/enforce", F_OK) == 0 ||
+                   access("/selinux/enforce", F_OK) == 0);
+    }
+    return enabled;
+}
+
+/* Read the SELinux context of a file from an open descriptor, or from its path if
+   'fd' is -1. 'context' is left empty if there is none. */
+static void get_secontext(int fd, const char *path, char *context, size_t len)
+{
+    ssize_t count = -1;
+
+    if ( selinux_enabled() ) {
+        if ( fd >= 0 ) {
+            count = fgetxattr(fd, "security.selinux", context, len - 1);
+        } else {
+            count = lgetxattr(path, "security.selinux", context, len - 1);
+        }
+    }
+    context[(count > 0) ? count : 0] = '\0';
+}
+#endif
+
+static file_type_t stat_type(mode_t mode)
+{
+    if ( S_ISREG(mode) ) {
+        return LOKI_FILE_REGULAR;
+    } else if ( S_ISDIR(mode) ) {
+        return LOKI_FILE_DIRECTORY;
+    } else if ( S_ISLNK(mode) ) {
+        return LOKI_FILE_SYMLINK;
+    } else if ( S_ISFIFO(mode) ) {
+        return LOKI_FILE_FIFO;
+    } else if ( S_ISSOCK(mode) ) {
+        return LOKI_FILE_SOCKET;
+    } else if ( S_ISBLK(mode) || S_ISCHR(mode) ) {
+        return LOKI_FILE_DEVICE;
+    }
+    return LOKI_FILE_NONE;
+}
+
+static void hash_worker(void *item, void *data)
+{
+    product_hash_t *job = (product_hash_t *)item;
+
+    (void)data; /* The jobs carry everything they need */
+    job->status = md5_compute_at(job->dirfd, job->path, job->size, job->md5sum,
+                                 job->fingerprint, job->chunked ? &job->chunks : NULL);
+}
+
+/* Queue the checksum of a file that was just registered or updated */
+static void defer_hash(product_t *product, product_file_t *file, int update, off_t size)
+{
+    product_hash_t *job = (product_hash_t *)malloc(sizeof(product_hash_t));
+    char buf[PATH_MAX];
+
+    job->path = strdup(at_path(product, file->path, &job->dirfd, buf, sizeof(buf)));
+    job->size = size;
+    job->status = 0;
+    job->update = update;
+    job->chunked = wants_chunks(product, size);
+    job->chunks = NULL;
+    job->next = NULL;
+    /* A checksum still pending for an earlier version of the file is stale */
+    if ( file->hash ) {
+        file->hash->file = NULL;
+    }
+    job->file = file;
+    file->hash = job;
+    if ( product->last_hash ) {
+        product->last_hash->next = job;
+    } else {
+        product->hashes = job;
+    }
+    product->last_hash = job;
+    parallel_queue_push(product->hasher, job);
+}
+
+int loki_defer_hashes(product_t *product, int nthreads)
+{
+    if ( nthreads < 0 ) {
+        if ( product->hasher ) {
+            loki_flush_hashes(product);
+            parallel_queue_free(product->hasher);
+            product->hasher = NULL;
+        }
+        return 0;
+    }
+    if ( ! product->hasher ) {
+        /* The threads use the root descriptor, it can't be opened behind their back */
+        get_rootfd(product);
+        product->hasher = parallel_queue_new(nthreads, hash_worker, NULL);
+    }
+    return 0;
+}
+
+int loki_flush_hashes(product_t *product)
+{
+    product_hash_t *job, *next;
+    product_file_t *file;
+    unsigned char *md5bin;
+    int ret = 0;
+
+    if ( ! product->hashes ) {
+        return 0;
+    }
+    parallel_queue_wait(product->hasher);
+    for ( job = product->hashes; job; job = next ) {
+        next = job->next;
+        file = job->file;
+        if ( file ) {
+            file->hash = NULL;
+            if ( job->status < 0 ) {
+                ret = -1;
+            } else {
+                md5bin = get_md5_bin(job->md5sum);
+                xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST job->md5sum);
+                /* Same as registerfile_update() */
+                if ( job->update && memcmp(file->data.md5sum, md5bin, 16) ) {
+                    loki_setpatched_file(file, 1);
+                    product->changed |= LOKI_DIRTY_FILES;
+                    record_change(product, LOKI_CHANGE_UPDATE, file->path);
+                }
+                memcpy(file->data.md5sum, md5bin, 16);
+                if ( set_file_fingerprint(file, job->fingerprint) |
+                     set_file_chunks(file, job->chunks) ) {
+                    product->changed |= LOKI_DIRTY_FILES;
+                }
+            }
+        }
+        free(job->path);
+        free(job->chunks);
+        free(job);
+    }
+    product->hashes = product->last_hash = NULL;
+    return ret;
+}
+
+/* Stop the hashing threads, dropping whatever they computed */
+static void free_hashes(product_t *product)
+{
+    product_hash_t *job, *next;
+
+    if ( product->hasher ) {
+        parallel_queue_free(product->hasher);
+        product->hasher = NULL;
+    }
+    for ( job = product->hashes; job; job = next ) {
+        next = job->next;
+        free(job->path);
+        free(job->chunks);
+        free(job);
+    }
+    product->hashes = product->last_hash = NULL;
+}
+
+/* Add or remove the size of a file to the totals of its option and component */
+static void count_size(product_file_t *file, int add)
+{
+    product_option_t *opt = file->option;
+    int sign = add ? 1 : -1;
+
+    if ( file->type != LOKI_FILE_REGULAR ) {
+        return;
+    }
+    if ( file->unsized ) {
+        opt->unsized += sign;
+        opt->component->unsized += sign;
+    } else if ( add ) {
+        opt->size += file->size;
+        opt->component->size += file->size;
+    } else {
+        opt->size -= file->size;
+        opt->component->size -= file->size;
+    }
+}
+
+static unsigned long hash_path(const char *str, size_t len)
+{
+    unsigned long h = 2166136261UL;
+
+    while ( len-- ) {
+        h = (h ^ (unsigned char)*str++) * 16777619UL;
+    }
+    return h;
+}
+
+/* Add a file to the paths of its product, scripts and RPMs have none */
+static void map_path(product_t *product, product_file_t *file)
+{
+    product_file_t **link;
+
+    file->path_next = NULL;
+    if ( file->type == LOKI_FILE_SCRIPT || file->type == LOKI_FILE_RPM ) {
+        return;
+    }
+    if ( product->num_paths >= product->paths_size ) {
+        product_file_t **bigger, *old, *next;
+        size_t size = product->paths_size ? product->paths_size * 2 : 256;
+        size_t i;
+
+        bigger = (product_file_t **)calloc(size, sizeof(product_file_t *));
+        for ( i = 0; i < product->paths_size; ++i ) {
+            /* Keep the registration order within each bucket */
+            for ( old = product->paths[i]; old; old = next ) {
+                next = old->path_next;
+                old->path_next = NULL;
+                link = &bigger[hash_path(old->path, strlen(old->path)) & (size - 1)];
+                while ( *link ) {
+                    link = &(*link)->path_next;
+                }
+                *link = old;
+            }
+        }
+        free(product->paths);
+        product->paths = bigger;
+        product->paths_size = size;
+    }
+    link = &product->paths[hash_path(file->path, strlen(file->path)) & (product->paths_size - 1)];
+    while ( *link ) {
+        link = &(*link)->path_next;
+    }
+    *link = file;
+    ++product->num_paths;
+}
+
+static void unmap_path(product_t *product, product_file_t *file)
+{
+    product_file_t **link;
+
+    if ( !product->paths_size ) {
+        return;
+    }
+    link = &product->paths[hash_path(file->path, strlen(file->path)) & (product->paths_size - 1)];
+    for ( ; *link; link = &(*link)->path_next ) {
+        if ( *link == file ) {
+            *link = file->path_next;
+            --product->num_paths;
+            break;
+        }
+    }
+}
+
+/* The first registered file with this path relative to the root, if any */
+static product_file_t *lookup_path(product_t *product, const char *path)
+{
+    product_file_t *file = NULL;
+
+    if ( product->paths_size ) {
+        file = product->paths[hash_path(path, strlen(path)) & (product->paths_size - 1)];
+        while ( file && strcmp(file->path, path) ) {
+            file = file->path_next;
+        }
+    }
+    return file;
+}
+
+/* Free a file and its node, forgetting its pending checksum if any */
+static void delete_file(product_file_t *file)
+{
+    if ( file->hash ) {
+        file->hash->file = NULL;
+    }
+    if ( file->option ) {
+        unmap_path(file->option->component->product, file);
+    }
+    count_size(file, 0);
+    xmlUnlinkNode(file->node);
+    xmlFreeNode(file->node);
+    free(file->path);
+#ifdef __linux
+	free(file->se_context);
+#endif
+    free(file);
+}
+
+static int set_file_size(product_file_t *file, size_t size)
+{
+    char buf[32];
+
+    if ( !file->unsized && file->size == size ) {
+        return 0;
+    }
+    count_size(file, 0);
+    file->size = size;
+    file->unsized = 0;
+    count_size(file, 1);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)size);
+    xmlSetProp(file->node, BAD_CAST "size", BAD_CAST buf);
+    return 1;
+}
+
+static int set_file_mtime(product_file_t *file, time_t mtime)
+{
+    char buf[32];
+
+    if ( file->mtime == mtime ) {
+        return 0;
+    }
+    file->mtime = mtime;
+    snprintf(buf, sizeof(buf), "%ld", (long)mtime);
+    xmlSetProp(file->node, BAD_CAST "mtime", BAD_CAST buf);
+    return 1;
+}
+
+/* Get the sizes that the manifest didn't record, once */
+static void fill_sizes(product_option_t *opt)
+{
+    product_file_t *file;
+    struct stat st;
+    char buf[PATH_MAX];
+    const char *path;
+    int dirfd;
+
+    for ( file = opt->files; file && opt->unsized > 0; file = file->next ) {
+        if ( file->type == LOKI_FILE_REGULAR && file->unsized ) {
+            path = at_path(opt->component->product, file->path, &dirfd, buf, sizeof(buf));
+            set_file_size(file, (fstatat(dirfd, path, &st, 0) == 0) ? st.st_size : 0);
+        }
+    }
+}
+
 const char *loki_basename(const char *file)
 {
 	if ( file ) {
@@ -229,32 +945,148 @@ static const char *get_xml_string(product_t *product, xmlNodePtr node)
     return (const char *)text;
 }
 
-static void insert_end_file(product_file_t *file, product_file_t **opt)
+static void free_changes(product_t *product)
 {
-    file->next = NULL;
-    if ( *opt ) {
-        product_file_t *it;
-        for( it = *opt; it; it = it->next ) {
-            if ( it->next == NULL ) {
-                it->next = file;
-                return;
-            }
-        }
-    } else {
-        *opt = file;
-    }
+	product_change_t *change, *next;
+
+	for ( change = product->changes; change; change = next ) {
+		next = change->next;
+		free(change->path);
+		free(change);
+	}
+	product->changes = product->last_change = NULL;
+	product->num_changes = 0;
+	product->changes_lost = 0;
 }
 
-static const char *get_xml_base(void)
+static xmlNodePtr find_changes_node(product_t *product)
 {
-    const char *base;
+	xmlNodePtr node;
 
-    base = getenv("SETUPDB_XML_BASE");
-    if ( ! base ) {
-        base = ".";
-    }
-    return(base);
-}
+	for ( node = XML_CHILDREN(XML_ROOT(product->doc)); node; node = node->next ) {
+		if ( node->name && !strcmp((char *)node->name, "changes") ) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/* Bump the generation number and append the pending changes to the log */
+static void commit_changes(product_t *product)
+{
+	char gen[32];
+	char *str;
+	xmlNodePtr log, node, next;
+	product_change_t *change;
+	unsigned long first = 0, last_removed = 0;
+	int count = 0;
+
+	product->generation ++;
+	snprintf(gen, sizeof(gen), "%lu", product->generation);
+	xmlSetProp(XML_ROOT(product->doc), BAD_CAST "generation", BAD_CAST gen);
+
+	log = find_changes_node(product);
+	if ( log ) {
+		str = (char *)xmlGetProp(log, BAD_CAST "first");
+		if ( str ) {
+			first = strtoul(str, NULL, 10);
+			xmlFree(str);
+		}
+	} else {
+		log = xmlNewChild(XML_ROOT(product->doc), NULL, BAD_CAST "changes", NULL);
+		first = product->generation;
+	}
+	if ( product->changes_lost ) {
+		first = product->generation + 1;
+	}
+
+	for ( change = product->changes; change; change = change->next ) {
+		node = xmlNewChild(log, NULL, BAD_CAST "change", NULL);
+		xmlSetProp(node, BAD_CAST "generation", BAD_CAST gen);
+		xmlSetProp(node, BAD_CAST "op", BAD_CAST change_types[change->op]);
+		xmlSetProp(node, BAD_CAST "path", BAD_CAST change->path);
+	}
+	free_changes(product);
+
+	/* Drop the oldest entries, along with any whitespace left by the parser */
+	for ( node = XML_CHILDREN(log); node; node = node->next ) {
+		if ( node->type == XML_ELEMENT_NODE )
+			count ++;
+	}
+	for ( node = XML_CHILDREN(log); node; node = next ) {
+		next = node->next;
+		if ( node->type == XML_ELEMENT_NODE ) {
+			if ( count <= MAX_CHANGES )
+				continue;
+			str = (char *)xmlGetProp(node, BAD_CAST "generation");
+			if ( str ) {
+				last_removed = strtoul(str, NULL, 10);
+				xmlFree(str);
+			}
+			count --;
+		}
+		xmlUnlinkNode(node);
+		xmlFreeNode(node);
+	}
+	if ( last_removed >= first ) {
+		first = last_removed + 1;
+	}
+	snprintf(gen, sizeof(gen), "%lu", first);
+	xmlSetProp(log, BAD_CAST "first", BAD_CAST gen);
+}
+
+static void insert_end_file(product_file_t *file, product_file_t **opt)
+{
+    file->next = NULL;
+    if ( *opt ) {
+        product_file_t *it;
+        for( it = *opt; it; it = it->next ) {
+            if ( it->next == NULL ) {
+                it->next = file;
+                return;
+            }
+        }
+    } else {
+        *opt = file;
+    }
+}
+
+/* Check whether a manifest file is compressed with gzip */
+static int is_compressed(const char *path)
+{
+    unsigned char magic[2];
+    int ret = 0;
+    FILE *f = fopen(path, "rb");
+
+    if ( f ) {
+        ret = (fread(magic, 1, sizeof(magic), f) == sizeof(magic)) &&
+            magic[0] == 0x1f && magic[1] == 0x8b;
+        fclose(f);
+    }
+    return ret;
+}
+
+/* Default compression level for new manifests, from the environment */
+static int get_xml_compression(void)
+{
+    const char *level = getenv("SETUPDB_COMPRESS");
+
+    if ( level ) {
+        return *level ? atoi(level) : DEFAULT_COMPRESSION;
+    }
+    return 0;
+}
+
+static const char *get_xml_base(void)
+{
+    const char *base;
+
+    base = getenv("SETUPDB_XML_BASE");
+    if ( ! base ) {
+        base = ".";
+    }
+    return(base);
+}
 
 const char *loki_getfirstproduct(void)
 {
@@ -367,724 +1199,1986 @@ int loki_newer_version(const char *version1, const char *version2)
 }
 
 
-/* Open a product by name*/
+/* Advisory locks on the manifests, through a sidecar '.lock' file.
+   Locks are shared by all the opens of the same manifest within the process,
+   but only one of them may be writable at a time.
+ */
+struct _loki_lock_t
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    int exclusive, count, writers;
+    struct _loki_lock_t *next;
+};
 
-product_t *loki_openproduct(const char *name)
+#define LOCK_TIMEDOUT ((struct _loki_lock_t *)-1)
+#define LOCK_BUSY     ((struct _loki_lock_t *)-2) /* Already opened for writing */
+
+static pthread_mutex_t locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct _loki_lock_t *held_locks = NULL;
+static int lock_timeout = -1; /* In milliseconds, negative waits forever */
+
+void loki_setlocktimeout(int msecs)
 {
-    char buf[PATH_MAX];
-    int major, minor;
-    char *str;
-    xmlDocPtr doc = NULL;
-    xmlNodePtr node;
-    product_t *prod;
+    lock_timeout = msecs;
+}
 
-	LIBXML_TEST_VERSION;
+/* Get the name of the lock file of a manifest. Symlinks are resolved so that
+   all the ways to reach the manifest, even before it exists, use the same one.
+ */
+static int get_lock_path(const char *manifest, char *path, size_t len)
+{
+    char dir[PATH_MAX], real[PATH_MAX];
+    const char *slash;
 
-    if ( strchr(name, '/') != NULL ) { /* Absolute path to a manifest file */
-        doc = xmlParseFile(name);
-    } else {
-        /* Look for a matching case-insensitive file */
-        static glob_t xmls;
-        
-        snprintf(buf, sizeof(buf), "%s/" LOKI_DIRNAME "/installed/%s/*.xml", detect_home(), get_xml_base());
-        if ( glob(buf, GLOB_ERR, NULL, &xmls) != 0 ) {
+    if ( realpath(manifest, real) ) {
+        return snprintf(path, len, "%s.lock", real) < (int)len ? 0 : -1;
+    }
+    slash = strrchr(manifest, '/');
+    if ( slash && slash > manifest && (size_t)(slash - manifest) < sizeof(dir) ) {
+        memcpy(dir, manifest, slash - manifest);
+        dir[slash - manifest] = '\0';
+        if ( realpath(dir, real) ) {
+            return snprintf(path, len, "%s%s.lock", real, slash) < (int)len ? 0 : -1;
+        }
+    }
+    return snprintf(path, len, "%s.lock", manifest) < (int)len ? 0 : -1;
+}
+
+/* Wait for a lock on the file for at most the timeout.
+   Returns 0 once locked, 1 if timed out, or -1 if locking is not supported.
+ */
+static int wait_flock(int fd, int op)
+{
+    int waited = 0;
+
+    while ( flock(fd, op | (lock_timeout < 0 ? 0 : LOCK_NB)) < 0 ) {
+        if ( errno == EINTR ) {
+            continue;
+        } else if ( errno != EWOULDBLOCK ) {
+            return -1;
+        } else if ( waited >= lock_timeout ) {
+            return 1;
+        }
+        usleep(10000);
+        waited += 10;
+    }
+    return 0;
+}
+
+static void unlock_manifest(struct _loki_lock_t *lock, int exclusive);
+
+/* Returns NULL if the manifest can't be locked (e.g. read-only media),
+   in which case we go on without a lock, or LOCK_TIMEDOUT or LOCK_BUSY */
+static struct _loki_lock_t *lock_manifest(const char *manifest, int exclusive)
+{
+    char path[PATH_MAX];
+    struct _loki_lock_t *lock;
+    struct stat st, now;
+    int fd, ret;
+
+    if ( get_lock_path(manifest, path, sizeof(path)) < 0 ) {
+        return NULL;
+    }
+ retry:
+    fd = open(path, O_RDWR|O_CREAT, 0644);
+    if ( fd < 0 ) {
+        fd = open(path, O_RDONLY);
+        if ( fd < 0 ) {
             return NULL;
-        } else {
-            if ( xmls.gl_pathc == 0 ) {
-                return NULL;
-            } else {
-                int i;
-                for ( i = 0; i < xmls.gl_pathc; ++i ) {
-                    if ( !strcasecmp(name, get_productname(xmls.gl_pathv[i])) ) {
-                        /* The .xml extension was removed by get_productname() */
-                        snprintf(buf, sizeof(buf), "%s.xml", xmls.gl_pathv[i]);
-                        doc = xmlParseFile(buf);                                
-                        break;
-                    }
+        }
+    }
+    fstat(fd, &st);
+
+    pthread_mutex_lock(&locks_mutex);
+    for ( lock = held_locks; lock; lock = lock->next ) {
+        if ( lock->dev == st.st_dev && lock->ino == st.st_ino ) {
+            close(fd);
+            if ( exclusive && lock->writers > 0 ) {
+                pthread_mutex_unlock(&locks_mutex);
+                return LOCK_BUSY;
+            }
+            lock->count ++;
+            if ( exclusive ) {
+                lock->writers ++;
+            }
+            pthread_mutex_unlock(&locks_mutex);
+            /* Upgrade the lock if a reader already holds it (never downgraded).
+               flock() drops the shared lock first, so another writer may get in
+               meanwhile: this is fine as the manifest is only read once locked.
+             */
+            if ( exclusive && !lock->exclusive ) {
+                ret = wait_flock(lock->fd, LOCK_EX);
+                if ( ret > 0 ) {
+                    /* The shared lock was lost as well, get it back */
+                    wait_flock(lock->fd, LOCK_SH);
+                    unlock_manifest(lock, 1);
+                    return LOCK_TIMEDOUT;
                 }
+                lock->exclusive = (ret == 0);
             }
+            return lock;
         }
     }
-    if ( !doc )
-        return NULL;
-    prod = (product_t *)malloc(sizeof(product_t));
-    prod->doc = doc;
-    prod->changed = 0;
-
-    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "name");
-    strncpy(prod->info.name, str, sizeof(prod->info.name));
-	xmlFree(str);
-    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "desc");
-    if ( str ) {
-        strncpy(prod->info.description, str, sizeof(prod->info.description));
-		xmlFree(str);
-    } else {
-        *prod->info.description = '\0';
+    pthread_mutex_unlock(&locks_mutex);
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    ret = wait_flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+    if ( ret != 0 ) {
+        /* Either locking is not supported here, or timed out */
+        close(fd);
+        return (ret > 0) ? LOCK_TIMEDOUT : NULL;
     }
-    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "root");
-    strncpy(prod->info.root, str, sizeof(prod->info.root));
-	xmlFree(str);
-    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "prefix");
-	if ( str ) {
-		strncpy(prod->info.prefix, str, sizeof(prod->info.prefix));
-		xmlFree(str);
-	} else {
-		strcpy(prod->info.prefix, ".");
-	}
-    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "update_url");
-    strncpy(prod->info.url, str, sizeof(prod->info.url));
-	xmlFree(str);
-    if ( *name == '/' ) { /* Absolute path to a manifest.ini file */
-        strncpy(prod->info.registry_path, name,
-                sizeof(prod->info.registry_path));
-    } else {
-        snprintf(prod->info.registry_path, sizeof(prod->info.registry_path),
-                 "%s/.manifest/%s.xml", prod->info.root, prod->info.name);
+    /* The lock file may have been removed with its product while waiting */
+    if ( stat(path, &now) < 0 || now.st_dev != st.st_dev || now.st_ino != st.st_ino ) {
+        close(fd);
+        goto retry;
     }
 
-    /* Check for the xmlversion attribute for backwards compatibility */
-    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "xmlversion");
-    sscanf(str, "%d.%d", &major, &minor);
-    if ( (major > SETUPDB_VERSION_MAJOR) || 
-         ((major == SETUPDB_VERSION_MAJOR) && (minor > SETUPDB_VERSION_MINOR)) ) {
-        fprintf(stderr, "Warning: This XML file was generated with a later version of setupdb (%d.%d).\n"
-                "Problems may occur.\n", major, minor);
-    }
-	xmlFree(str);
+    lock = (struct _loki_lock_t *)malloc(sizeof(struct _loki_lock_t));
+    lock->fd = fd;
+    lock->dev = st.st_dev;
+    lock->ino = st.st_ino;
+    lock->exclusive = exclusive;
+    lock->count = 1;
+    lock->writers = exclusive ? 1 : 0;
+    pthread_mutex_lock(&locks_mutex);
+    lock->next = held_locks;
+    held_locks = lock;
+    pthread_mutex_unlock(&locks_mutex);
+    return lock;
+}
 
-    prod->components = prod->default_comp = NULL;
-	prod->envvars = NULL;
+static void unlock_manifest(struct _loki_lock_t *lock, int exclusive)
+{
+    struct _loki_lock_t *l, *prev = NULL;
 
-    /* Parse the XML tags and build a tree. Water every day so that it grows steadily. */
-    
-    for ( node = XML_CHILDREN(XML_ROOT(doc)); node; node = node->next ) {
-        if ( !strcmp((char *)node->name, "component") ) {
-            xmlNodePtr optnode;
+    if ( !lock || lock == LOCK_TIMEDOUT || lock == LOCK_BUSY )
+        return;
 
-            product_component_t *comp = (product_component_t *) malloc(sizeof(product_component_t));
+    pthread_mutex_lock(&locks_mutex);
+    if ( exclusive ) {
+        --lock->writers;
+    }
+    if ( --lock->count == 0 ) {
+        for ( l = held_locks; l; prev = l, l = l->next ) {
+            if ( l == lock ) {
+                if ( prev ) {
+                    prev->next = l->next;
+                } else {
+                    held_locks = l->next;
+                }
+                break;
+            }
+        }
+        close(lock->fd); /* Releases the lock */
+        free(lock);
+    }
+    pthread_mutex_unlock(&locks_mutex);
+}
 
-            comp->node = node;
-            comp->product = prod;
-            comp->name = (char *)xmlGetProp(node, BAD_CAST "name");
-            comp->version = (char *)xmlGetProp(node, BAD_CAST "version");
-            comp->url = (char *)xmlGetProp(node, BAD_CAST "update_url");
-            str = (char *)xmlGetProp(node, BAD_CAST "default");
-            comp->is_default = (str && *str=='y');
-			xmlFree(str);
-            if ( comp->is_default ) {
-                prod->default_comp = comp;
-            }
-            comp->options = NULL;
-            comp->scripts = NULL;
-			comp->envvars = NULL;
-            comp->next = prod->components;
-            prod->components = comp;
-
-            for ( optnode = XML_CHILDREN(node); optnode; optnode = optnode->next ) {
-                if ( !strcmp((char *)optnode->name, "option") ) {
-                    xmlNodePtr filenode;
-                    product_option_t *opt = (product_option_t *)malloc(sizeof(product_option_t));
-
-                    opt->node = optnode;
-                    opt->component = comp;
-                    opt->name = (char *)xmlGetProp(optnode, BAD_CAST "name");
-					opt->tag = (char *)xmlGetProp(optnode, BAD_CAST "tag");
-                    opt->files = NULL;
-                    opt->next = comp->options;
-                    comp->options = opt;
-
-                    for( filenode = XML_CHILDREN(optnode); filenode; filenode = filenode->next ) {
-                        file_type_t t;
-                        product_file_t *file;
-						const char *cstr;
-
-						if ( !XML_CHILDREN(filenode) )
-							continue; /* Skip nodes with no children - likely text nodes */
-
-						file = (product_file_t *) malloc(sizeof(product_file_t));
-                        memset(file->data.md5sum, 0, 16);
-                        if ( !strcmp((char *)filenode->name, "file") ) {
-                            char *md5;
-							md5 = (char *)xmlGetProp(filenode, BAD_CAST "md5");
-                            t = LOKI_FILE_REGULAR;
-                            if ( md5 ) {
-                                memcpy(file->data.md5sum, get_md5_bin(md5), 16);
-								xmlFree(md5);
-							}
-                        } else if ( !strcmp((char *)filenode->name, "directory") ) {
-                            t = LOKI_FILE_DIRECTORY;
-                        } else if ( !strcmp((char *)filenode->name, "symlink") ) {
-                            t = LOKI_FILE_SYMLINK;
-                        } else if ( !strcmp((char *)filenode->name, "fifo") ) {
-                            t = LOKI_FILE_FIFO;
-                        } else if ( !strcmp((char *)filenode->name, "device") ) {
-                            t = LOKI_FILE_DEVICE;
-                        } else if ( !strcmp((char *)filenode->name, "rpm") ) {
-                            t = LOKI_FILE_RPM;
-                        } else if ( !strcmp((char *)filenode->name, "script") ) {
-                            t = LOKI_FILE_SCRIPT;
-                            str = (char *)xmlGetProp(filenode, BAD_CAST "type");
-                            if ( str ) {
-                                if ( !strcmp(str, script_types[LOKI_SCRIPT_PREUNINSTALL]) ) {
-                                    file->data.scr_type = LOKI_SCRIPT_PREUNINSTALL;
-                                } else if ( !strcmp(str, script_types[LOKI_SCRIPT_POSTUNINSTALL]) ) {
-                                    file->data.scr_type = LOKI_SCRIPT_POSTUNINSTALL;
-                                }
-								xmlFree(str);
-                            }
-                        } else {
-                            t = LOKI_FILE_NONE;
-                        }
-                        file->node = filenode;
-                        file->option = opt;
-                        file->type = t;
-                        str = (char *)xmlGetProp(filenode, BAD_CAST "patched");
-                        if ( str && *str=='y' ) {
-                            file->patched = 1;
-                        } else {
-                            file->patched = 0;
-                        }
-						xmlFree(str);
-                        str = (char *)xmlGetProp(filenode, BAD_CAST "mutable");
-                        if ( str && *str=='y' ) {
-                            file->mutable = 1;
-                        } else {
-                            file->mutable = 0;
-                        }
-						xmlFree(str);
-                        str = (char *)xmlGetProp(filenode, BAD_CAST "desktop");
-                        if ( str ) {
-							file->desktop = strdup(str);
-							xmlFree(str);
-                        } else {
-							file->desktop = NULL;
-						}
-                        str = (char *)xmlGetProp(filenode, BAD_CAST "mode");
-                        if ( str ) {
-                            sscanf(str,"%o", &file->mode);
-                        } else {
-                            file->mode = 0644;
-                        }
-						xmlFree(str);
-#ifdef __linux
-						str = (char *)xmlGetProp(filenode, BAD_CAST "secontext");
-						if ( str ) {
-							file->se_context = strdup(str);
-						} else {
-							file->se_context = NULL;
-						}
-#endif
-                        cstr = get_xml_string(prod, filenode);
-                        file->path = strdup(cstr); /* The expansion is done in loki_getname_file() */
+/* Reverse index of the files owned by all the installed products, kept next to the
+   manifest symlinks. One line per file: absolute path, product, component,
+   option and checksum separated by tabs, sorted by path so that lookups can
+   bisect the file. Files without a checksum have '-' instead.
 
-                        insert_end_file(file, &opt->files);
-                    }
-                } else if ( !strcmp((char *)optnode->name, "script") ) {
-                    product_file_t *file = (product_file_t *) malloc(sizeof(product_file_t));
-                    file->node = optnode;
-                    file->type = LOKI_FILE_SCRIPT;
-					file->desktop = NULL;
+   Saving a product appends the entries of the paths it changed to a journal
+   instead, each batch after lines dropping the previous entries of the product
+   for these paths: '-', the path and the product, or an empty path for all of
+   them. The journal is merged into the index once it gets large.
+ */
+#define PATH_INDEX   ".paths"
+#define PATH_JOURNAL ".paths.log"
+#define JOURNAL_MIN  (64*1024)
 
-                    str = (char *)xmlGetProp(optnode, BAD_CAST "type");
-                    if ( str ) {
-                        if ( !strcmp(str, script_types[LOKI_SCRIPT_PREUNINSTALL]) ) {
-                            file->data.scr_type = LOKI_SCRIPT_PREUNINSTALL;
-                        } else if ( !strcmp(str, script_types[LOKI_SCRIPT_POSTUNINSTALL]) ) {
-                            file->data.scr_type = LOKI_SCRIPT_POSTUNINSTALL;
-                        }
-						xmlFree(str);
-                    }
-                    file->path = strdup(get_xml_string(prod, optnode));
-                    file->next = comp->scripts;                    
-                    comp->scripts = file;
-                } else if ( !strcmp((char *)optnode->name, "environment") ) {
-					product_envvar_t *var = malloc(sizeof(product_envvar_t));
-					
-					var->node = node;
-					var->name = (char *)xmlGetProp(node, BAD_CAST "var");
-					var->value = (char *)xmlGetProp(node, BAD_CAST "value");
-					var->next = comp->envvars;
-					comp->envvars = var;
-				}
-            }
-        } else if ( !strcmp((char *)node->name, "environment") ) {
-			product_envvar_t *var = malloc(sizeof(product_envvar_t));
+/* Internal flag for loki_openproduct_flags(): read-only, without any lock or
+   waiting for pending writes. Manifests are only ever replaced atomically, so
+   this is enough to read one while the index lock is held.
+ */
+#define OPEN_SNAPSHOT 0x100
 
-			var->node = node;
-			var->name = (char *)xmlGetProp(node, BAD_CAST "var");
-			var->value = (char *)xmlGetProp(node, BAD_CAST "value");
-			var->next = prod->envvars;
-			prod->envvars = var;
-		}
-    }
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    return prod;
+typedef struct {
+    char **lines;
+    int num, max;
+} index_lines_t;
+
+static void get_path_index(char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/" LOKI_DIRNAME "/installed/%s/" PATH_INDEX, detect_home(), get_xml_base());
 }
 
-char *loki_trim_slashes(char *str)
+static void get_path_journal(char *buf, size_t len)
 {
-	char *ptr = str+strlen(str);
-	while ( ptr > str ) {
-		ptr--;
-		if ( *ptr != '/' ) {
-			*(ptr+1) = '\0';
-			break;
-		}
-	}
-	return str;
+    snprintf(buf, len, "%s/" LOKI_DIRNAME "/installed/%s/" PATH_JOURNAL, detect_home(), get_xml_base());
 }
 
-/* Create a new product entry */
+static void add_index_line(index_lines_t *index, char *line)
+{
+    if ( index->num == index->max ) {
+        index->max = index->max ? index->max * 2 : 256;
+        index->lines = (char **)realloc(index->lines, index->max * sizeof(char *));
+    }
+    index->lines[index->num++] = line;
+}
 
-product_t *loki_create_product(const char *name, const char *root, const char *desc, const char *url)
+static void free_index_lines(index_lines_t *index)
 {
-    char homefile[PATH_MAX], manifest[PATH_MAX], myroot[PATH_MAX];
-    xmlDocPtr doc;
-    product_t *prod;
+    int i;
 
-	/* Create hierarchy if it doesn't exist already */
-	snprintf(homefile, sizeof(homefile), "%s/" LOKI_DIRNAME, detect_home());
-	mkdir(homefile, 0700);
+    for ( i = 0; i < index->num; ++i ) {
+        free(index->lines[i]);
+    }
+    free(index->lines);
+    index->lines = NULL;
+    index->num = index->max = 0;
+}
 
-	strncat(homefile, "/installed", sizeof(homefile)-strlen(homefile)-1);
-	mkdir(homefile, 0700);
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-	strncat(homefile, "/", sizeof(homefile)-strlen(homefile)-1);
-	strncat(homefile, get_xml_base(), sizeof(homefile)-strlen(homefile)-1);
-	mkdir(homefile, 0700);
+/* One line per file of the product: path, product, component, option, checksum.
+   Only the files with one of the sorted paths in 'only' are listed if it is set.
+ */
+static void add_product_lines(index_lines_t *index, product_t *product,
+                              char **only, int num_only)
+{
+    char path[PATH_MAX], line[PATH_MAX*2], sum[CHECKSUM_SIZE+1];
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file;
+    int len;
 
-	/* Clean up the root - it can't have a trailing slash */
-	strncpy(myroot, root, sizeof(myroot));
-	loki_trim_slashes(myroot);
-
-    snprintf(manifest, sizeof(manifest), "%s/.manifest", myroot);
-    mkdir(manifest, 0755);
-
-    /* Create a new XML tree from scratch; we'll have to dump it to disk later */
-    doc = xmlNewDoc(BAD_CAST "1.0");
-
-    if ( !doc ) {
-        return NULL;
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type == LOKI_FILE_SCRIPT || file->type == LOKI_FILE_RPM ) {
+                    continue;
+                }
+                if ( only && !bsearch(&file->path, only, num_only, sizeof(char *), compare_strings) ) {
+                    continue;
+                }
+                expand_path(product, file->path, path, sizeof(path));
+                /* Such paths would corrupt the index */
+                if ( strpbrk(path, "\t\n") ) {
+                    continue;
+                }
+                if ( file->type == LOKI_FILE_REGULAR ) {
+                    format_md5(file->data.md5sum, sum);
+                } else {
+                    strcpy(sum, "-");
+                }
+                len = snprintf(line, sizeof(line), "%s\t%s\t%s\t%s\t%s\n", path,
+                               product->info.name, comp->name, opt->name, sum);
+                if ( len < 0 || len >= (int)sizeof(line) ) {
+                    continue;
+                }
+                add_index_line(index, strdup(line));
+            }
+        }
     }
+}
 
-	strncat(homefile, "/", sizeof(homefile)-strlen(homefile)-1);
-	strncat(homefile, name, sizeof(homefile)-strlen(homefile)-1);
-	strncat(homefile, ".xml", sizeof(homefile)-strlen(homefile)-1);
+/* The journal lines for the changes about to be committed: all the entries of
+   the product if the changes are not all known or the root may have moved, only
+   those of the changed paths otherwise.
+ */
+static void collect_index_changes(product_t *product, index_lines_t *records)
+{
+    char path[PATH_MAX], line[PATH_MAX*2];
+    product_change_t *change;
+    char **changed;
+    int i, num = 0, len;
+
+    if ( product->changes_lost || (product->changed & LOKI_DIRTY_PRODUCT) ) {
+        snprintf(line, sizeof(line), "-\t\t%s\n", product->info.name);
+        add_index_line(records, strdup(line));
+        add_product_lines(records, product, NULL, 0);
+        return;
+    }
+    changed = (char **)malloc((product->num_changes+1) * sizeof(char *));
+    for ( change = product->changes; change; change = change->next ) {
+        changed[num++] = change->path;
+    }
+    qsort(changed, num, sizeof(char *), compare_strings);
+    for ( i = 0; i < num; ++i ) {
+        if ( i > 0 && !strcmp(changed[i], changed[i-1]) ) {
+            continue;
+        }
+        expand_path(product, changed[i], path, sizeof(path));
+        len = snprintf(line, sizeof(line), "-\t%s\t%s\n", path, product->info.name);
+        if ( len > 0 && len < (int)sizeof(line) && !strpbrk(path, "\t\n") ) {
+            add_index_line(records, strdup(line));
+        }
+    }
+    if ( num > 0 ) {
+        add_product_lines(records, product, changed, num);
+    }
+    free(changed);
+}
 
-	strncat(manifest, "/", sizeof(manifest)-strlen(manifest)-1);
-	strncat(manifest, name, sizeof(manifest)-strlen(manifest)-1);
-	strncat(manifest, ".xml", sizeof(manifest)-strlen(manifest)-1);
+/* Replace the index with the given lines, with the index lock held */
+static int write_path_index(const char *indexpath, index_lines_t *index)
+{
+    char tmp[PATH_MAX+16];
+    FILE *fp;
+    int i, ret = 0;
+
+    qsort(index->lines, index->num, sizeof(char *), compare_strings);
+    snprintf(tmp, sizeof(tmp), "%s.%05d", indexpath, (int)getpid());
+    fp = fopen(tmp, "w");
+    if ( !fp ) {
+        fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    for ( i = 0; i < index->num; ++i ) {
+        fputs(index->lines[i], fp);
+    }
+    if ( fclose(fp) != 0 || rename(tmp, indexpath) != 0 ) {
+        fprintf(stderr, "Unable to update %s: %s\n", indexpath, strerror(errno));
+        unlink(tmp);
+        ret = -1;
+    }
+    return ret;
+}
 
+/* Whether an index line belongs to the named product (case insensitive, as are the names) */
+static int index_line_owner(const char *line, const char *name, size_t len)
+{
+    const char *ptr = strchr(line, '\t');
 
-    /* Symlink the file in the 'installed' per-user directory */
-    unlink(homefile);
-    if ( symlink(manifest, homefile) < 0 )
-        fprintf(stderr, "Could not create symlink : %s\n", homefile);
+    return ptr && strncasecmp(ptr+1, name, len) == 0 && ptr[len+1] == '\t';
+}
 
-	/* Create the scripts subdirectory */
-	snprintf(manifest, sizeof(manifest), "%s/.manifest/scripts", root);
-	mkdir(manifest, 0755);
+/* Remove the entries of the named product from a list of index lines */
+static void drop_owner_lines(index_lines_t *index, const char *name, size_t len)
+{
+    int i, kept = 0;
 
-    prod = (product_t *)malloc(sizeof(product_t));
-    prod->doc = doc;
-    prod->changed = 1;
-    prod->components = prod->default_comp = NULL;
-	prod->envvars = NULL;
+    for ( i = 0; i < index->num; ++i ) {
+        if ( index_line_owner(index->lines[i], name, len) ) {
+            free(index->lines[i]);
+        } else {
+            index->lines[kept++] = index->lines[i];
+        }
+    }
+    index->num = kept;
+}
 
-    xmlDocSetRootElement(doc, xmlNewDocNode(doc, NULL, BAD_CAST "product", NULL));
+/* Build the index from all the manifests, with the index lock held */
+static int rebuild_path_index(const char *indexpath, const char *journal)
+{
+    char buf[PATH_MAX];
+    index_lines_t index = { NULL, 0, 0 };
+    product_t *product;
+    glob_t xmls;
+    size_t i;
+    int ret;
 
-    strncpy(prod->info.name, name, sizeof(prod->info.name));
-    xmlSetProp(XML_ROOT(doc), BAD_CAST "name", BAD_CAST name);
-    if ( desc ) {
-        strncpy(prod->info.description, desc, sizeof(prod->info.description));
-        xmlSetProp(XML_ROOT(doc), BAD_CAST "desc", BAD_CAST desc);
-    } else {
-        *prod->info.description = '\0';
+    snprintf(buf, sizeof(buf), "%s/" LOKI_DIRNAME "/installed/%s/*.xml", detect_home(), get_xml_base());
+    if ( glob(buf, GLOB_ERR, NULL, &xmls) == 0 ) {
+        for ( i = 0; i < xmls.gl_pathc; ++i ) {
+            product = loki_openproduct_flags(xmls.gl_pathv[i], OPEN_SNAPSHOT);
+            if ( product ) {
+                add_product_lines(&index, product, NULL, 0);
+                loki_closeproduct(product);
+            }
+        }
+        globfree(&xmls);
     }
-    snprintf(homefile, sizeof(homefile), "%d.%d", SETUPDB_VERSION_MAJOR, SETUPDB_VERSION_MINOR);
-    xmlSetProp(XML_ROOT(doc), BAD_CAST "xmlversion", BAD_CAST homefile);
-    strncpy(prod->info.root, myroot, sizeof(prod->info.root));
-    xmlSetProp(XML_ROOT(doc), BAD_CAST "root", BAD_CAST myroot);
-    strncpy(prod->info.url, url, sizeof(prod->info.url));
-    strcpy(prod->info.prefix, ".");
-    xmlSetProp(XML_ROOT(doc), BAD_CAST "update_url", BAD_CAST url);
-    snprintf(prod->info.registry_path, sizeof(prod->info.registry_path), "%s/.manifest/%s.xml",
-             myroot, name);
-
-    return prod;
+    ret = write_path_index(indexpath, &index);
+    if ( ret == 0 ) {
+        unlink(journal);
+    }
+    free_index_lines(&index);
+    return ret;
 }
 
-/* Set the install path of a product */
+/* Journal lines that dropped entries, by path and product */
+typedef struct {
+    char *key;
+    int seq;
+} index_drop_t;
 
-void loki_setroot_product(product_t *product, const char *root)
+static int compare_drops(const void *a, const void *b)
 {
-    strncpy(product->info.root, root, sizeof(product->info.root));
-    xmlSetProp(XML_ROOT(product->doc), BAD_CAST "root", BAD_CAST root);
-    product->changed = 1;
+    const index_drop_t *da = (const index_drop_t *)a, *db = (const index_drop_t *)b;
+    int cmp = strcmp(da->key, db->key);
+
+    return cmp ? cmp : (da->seq - db->seq);
 }
 
-/* Set a path prefix for the installation media for the product */
-void loki_setprefix_product(product_t *product, const char *prefix)
+/* "path\tproduct" with the product in lower case, from the start of an index line */
+static char *drop_key(const char *path, size_t pathlen, const char *product)
 {
-    strncpy(product->info.prefix, prefix, sizeof(product->info.prefix));
-    xmlSetProp(XML_ROOT(product->doc), BAD_CAST "prefix", BAD_CAST prefix);
-    product->changed = 1;
+    size_t len = strcspn(product, "\t\n");
+    char *key = (char *)malloc(pathlen + len + 2);
+    size_t i;
+
+    memcpy(key, path, pathlen);
+    key[pathlen] = '\t';
+    for ( i = 0; i < len; ++i ) {
+        key[pathlen+1+i] = tolower((unsigned char)product[i]);
+    }
+    key[pathlen+1+len] = '\0';
+    return key;
 }
 
-/* Set the update URL of a product */
-
-void loki_setupdateurl_product(product_t *product, const char *url)
+/* The last journal line dropping the entries of the product of an index line
+   for its path, or for all its paths, or -1 if there is none */
+static int last_drop(index_drop_t *drops, int num, const char *line)
 {
-    strncpy(product->info.url, url, sizeof(product->info.url));
-    xmlSetProp(XML_ROOT(product->doc), BAD_CAST "update_url", BAD_CAST url);
-    product->changed = 1;
-}
+    const char *tab = strchr(line, '\t');
+    index_drop_t key;
+    int i, lo, hi, mid, last = -1;
 
-/* Close a product entry and free all allocated memory.
-   Also writes back to the database all changes that may have been made.
- */
+    if ( !tab ) {
+        return -1;
+    }
+    for ( i = 0; i < 2; ++i ) {
+        key.key = drop_key(line, i ? 0 : (size_t)(tab - line), tab + 1);
+        key.seq = INT_MAX;
+        /* The drops of a key are sorted by line, the last one is just below */
+        lo = 0;
+        hi = num;
+        while ( lo < hi ) {
+            mid = lo + (hi - lo) / 2;
+            if ( compare_drops(&drops[mid], &key) < 0 ) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if ( lo > 0 && !strcmp(drops[lo-1].key, key.key) && drops[lo-1].seq > last ) {
+            last = drops[lo-1].seq;
+        }
+        free(key.key);
+    }
+    return last;
+}
 
-int loki_closeproduct(product_t *product)
+/* Merge the journal into the index, with the index lock held */
+static int merge_path_journal(const char *indexpath, const char *journal)
 {
-    int ret = 0;
-    product_component_t *comp, *next;
-	product_envvar_t *var, *nextvar;
+    char tmp[PATH_MAX+16], line[PATH_MAX*2];
+    index_lines_t records = { NULL, 0, 0 }, added = { NULL, 0, 0 };
+    index_drop_t *drops;
+    const char *path, *tab;
+    FILE *fp, *out;
+    size_t len;
+    int i, num_drops = 0, ret = 0;
+
+    fp = fopen(journal, "r");
+    if ( !fp ) {
+        return 0;
+    }
+    while ( fgets(line, sizeof(line), fp) ) {
+        len = strlen(line);
+        if ( len == 0 || line[len-1] != '\n' ) {
+            break; /* Never written completely */
+        }
+        add_index_line(&records, strdup(line));
+    }
+    fclose(fp);
+
+    drops = (index_drop_t *)malloc((records.num+1) * sizeof(index_drop_t));
+    for ( i = 0; i < records.num; ++i ) {
+        if ( records.lines[i][0] == '-' && records.lines[i][1] == '\t' ) {
+            path = records.lines[i] + 2;
+            tab = strchr(path, '\t');
+            if ( tab ) {
+                drops[num_drops].key = drop_key(path, tab - path, tab + 1);
+                drops[num_drops].seq = i;
+                ++num_drops;
+            }
+        }
+    }
+    qsort(drops, num_drops, sizeof(index_drop_t), compare_drops);
 
-    if ( product->changed ) {
-#if 1
-        char tmp[PATH_MAX];
-        /* This isn't harmful as long as it's not a world writeable directory */
-        snprintf(tmp, sizeof(tmp), "%s.%05d", product->info.registry_path, (int)getpid());
-        /* Write XML file to disk if it has changed */
-        XML_SAVE_FILE(tmp, product->doc);
-
-        if(rename(tmp, product->info.registry_path) != 0)
-        {
-            /* too bad but we can't do much about it */
-            fprintf(stderr, "Unable to overwrite %s: %s.\nRegistry saved as %s.\n",
-                    product->info.registry_path, strerror(errno), tmp);
+    /* The entries added after the last drop of their path are kept */
+    for ( i = 0; i < records.num; ++i ) {
+        if ( records.lines[i][0] != '-' && last_drop(drops, num_drops, records.lines[i]) < i ) {
+            add_index_line(&added, records.lines[i]);
+            records.lines[i] = NULL;
+        }
+    }
+    qsort(added.lines, added.num, sizeof(char *), compare_strings);
+
+    snprintf(tmp, sizeof(tmp), "%s.%05d", indexpath, (int)getpid());
+    fp = fopen(indexpath, "r");
+    out = fopen(tmp, "w");
+    if ( !out ) {
+        fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+        ret = -1;
+    } else {
+        i = 0;
+        while ( fp && fgets(line, sizeof(line), fp) ) {
+            if ( last_drop(drops, num_drops, line) >= 0 ) {
+                continue;
+            }
+            while ( i < added.num && strcmp(added.lines[i], line) < 0 ) {
+                fputs(added.lines[i++], out);
+            }
+            fputs(line, out);
+        }
+        while ( i < added.num ) {
+            fputs(added.lines[i++], out);
+        }
+        if ( fclose(out) != 0 || rename(tmp, indexpath) != 0 ) {
+            fprintf(stderr, "Unable to update %s: %s\n", indexpath, strerror(errno));
+            unlink(tmp);
             ret = -1;
+        } else {
+            unlink(journal);
         }
-#else
-        XML_SAVE_FILE(product->info.registry_path, product->doc);
-#endif
+    }
+    if ( fp ) {
+        fclose(fp);
     }
 
-    /* Go through all the allocated structs */
-    comp = product->components;
-    while ( comp ) {
-        product_option_t *opt, *nextopt;
-        product_file_t   *scr, *nextscr;
-
-        next = comp->next;
-        
-        opt = comp->options;
-        while ( opt ) {
-            product_file_t *file, *nextfile;
-            nextopt = opt->next;
+    for ( i = 0; i < num_drops; ++i ) {
+        free(drops[i].key);
+    }
+    free(drops);
+    for ( i = 0; i < records.num; ++i ) {
+        free(records.lines[i]);
+    }
+    free(records.lines);
+    free_index_lines(&added);
+    return ret;
+}
 
-            file = opt->files;
-            while ( file ) {
-                nextfile = file->next;
-                free(file->path);
-#ifdef __linux
-				free(file->se_context);
-#endif
-                free(file);
-                file = nextfile;
+/* Append journal lines for a product that was just saved or removed. A missing
+   index is built from all the manifests instead, which include this product now.
+ */
+static int update_path_index(index_lines_t *records)
+{
+    char indexpath[PATH_MAX], journal[PATH_MAX];
+    struct _loki_lock_t *lock;
+    struct stat st, jst;
+    FILE *fp;
+    int i, ret = 0;
+
+    get_path_index(indexpath, sizeof(indexpath));
+    get_path_journal(journal, sizeof(journal));
+    pthread_mutex_lock(&index_mutex);
+    lock = lock_manifest(indexpath, 1);
+    if ( lock == LOCK_TIMEDOUT ) {
+        pthread_mutex_unlock(&index_mutex);
+        fprintf(stderr, "Timed out waiting for a lock on %s, the index is out of date\n", indexpath);
+        return -1;
+    }
+    if ( stat(indexpath, &st) < 0 ) {
+        ret = rebuild_path_index(indexpath, journal);
+    } else if ( records->num > 0 ) {
+        fp = fopen(journal, "a");
+        if ( !fp ) {
+            fprintf(stderr, "Unable to write %s: %s\n", journal, strerror(errno));
+            ret = -1;
+        } else {
+            for ( i = 0; i < records->num; ++i ) {
+                fputs(records->lines[i], fp);
+            }
+            if ( fclose(fp) != 0 ) {
+                fprintf(stderr, "Unable to update %s: %s\n", journal, strerror(errno));
+                ret = -1;
             }
-
-            free(opt->name);
-			if ( opt->tag )
-				free(opt->tag);
-            free(opt);
-            opt = nextopt;
         }
-
-        scr = comp->scripts;
-        while ( scr ){
-            nextscr = scr->next;
-
-            free(scr->path);
-            free(scr);
-            scr = nextscr;
+        if ( stat(journal, &jst) == 0 && jst.st_size > JOURNAL_MIN + st.st_size / 16 ) {
+            ret = merge_path_journal(indexpath, journal);
         }
+    }
+    unlock_manifest(lock, 1);
+    pthread_mutex_unlock(&index_mutex);
+    return ret;
+}
 
-		var = comp->envvars;
-		while ( var ) {
-			nextvar = var->next;
-			free(var->name);
-			free(var->value);
-			free(var);
-			var = nextvar;
-		}
-        
-        free(comp->name);
-        free(comp->version);
-        free(comp->url);
-        free(comp);
-        comp = next;
+int loki_rebuild_path_index(void)
+{
+    char indexpath[PATH_MAX], journal[PATH_MAX];
+    struct _loki_lock_t *lock;
+    int ret;
+
+    get_path_index(indexpath, sizeof(indexpath));
+    get_path_journal(journal, sizeof(journal));
+    pthread_mutex_lock(&index_mutex);
+    lock = lock_manifest(indexpath, 1);
+    if ( lock == LOCK_TIMEDOUT ) {
+        fprintf(stderr, "Timed out waiting for a lock on %s\n", indexpath);
+        ret = -1;
+    } else {
+        ret = rebuild_path_index(indexpath, journal);
+        unlock_manifest(lock, 1);
     }
+    pthread_mutex_unlock(&index_mutex);
+    return ret;
+}
 
-	var = product->envvars;
-	while ( var ) {
-		nextvar = var->next;
-		free(var->name);
-		free(var->value);
-		free(var);
-		var = nextvar;
-	}
+/* Compare the line at 'line' (up to 'end') with the key, like strcmp */
+static int compare_index_key(const char *line, const char *end, const char *key, size_t keylen)
+{
+    size_t len = end - line;
+    int cmp = memcmp(line, key, len < keylen ? len : keylen);
 
-    free(product);
-    return ret;
+    if ( cmp == 0 && len < keylen ) {
+        cmp = -1;
+    }
+    return cmp;
 }
 
-/* Clean up a product from the registry, i.e. removes all support files and directories */
-int loki_removeproduct(product_t *product)
+/* Add the lines of the index for the key to 'owners' */
+static int read_index_owners(const char *indexpath, const char *key, size_t keylen,
+                             index_lines_t *owners)
 {
-    char buf[PATH_MAX];
-    product_file_t *file;
-    product_option_t *opt;
-    product_component_t *comp;
+    struct stat st;
+    const char *data, *ptr, *end;
+    size_t lo, hi, mid, len;
+    char *line;
+    int fd;
+
+    fd = open(indexpath, O_RDONLY|O_CLOEXEC);
+    if ( fd < 0 ) {
+        return -1;
+    }
+    if ( fstat(fd, &st) < 0 || st.st_size == 0 ) {
+        close(fd);
+        return 0;
+    }
+    data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED ) {
+        return -1;
+    }
 
-    /* Remove the remaining scripts for each component and options */
-    for ( comp = product->components; comp; comp = comp->next ) {
-        for ( file = comp->scripts; file; file = file->next ) {
-            snprintf(buf, sizeof(buf), "%s/.manifest/scripts/%s.sh",
-                     product->info.root, file->path);
-            unlink(buf);
+    /* Find the first line not sorting before the key */
+    lo = 0;
+    hi = st.st_size;
+    while ( lo < hi ) {
+        mid = lo + (hi - lo) / 2;
+        while ( mid > lo && data[mid-1] != '\n' ) {
+            --mid;
         }
-        
-        for ( opt = comp->options; opt; opt = opt->next ) {
-            for ( file = opt->files; file; file = file->next ) {
-                if( file->type == LOKI_FILE_SCRIPT ) {
-                    snprintf(buf, sizeof(buf), "%s/.manifest/scripts/%s.sh",
-                             product->info.root, file->path);
-                    unlink(buf);
-                }
-            }
+        end = memchr(data+mid, '\n', st.st_size-mid);
+        if ( !end ) {
+            end = data + st.st_size;
+        }
+        if ( compare_index_key(data+mid, end, key, keylen) < 0 ) {
+            lo = (end - data) + 1;
+        } else {
+            hi = mid;
         }
     }
 
-    /* Remove the XML file */
-    unlink(product->info.registry_path);
-
-    /* Remove the directories */
-    snprintf(buf, sizeof(buf), "%s/.manifest/scripts", product->info.root);
-    if(rmdir(buf)<0)
-        perror("Could not remove scripts directory");
+    /* All the owners of this path follow */
+    for ( ptr = data + lo; ptr < data + st.st_size; ptr = end + 1 ) {
+        end = memchr(ptr, '\n', (data + st.st_size) - ptr);
+        if ( !end ) {
+            end = data + st.st_size;
+        }
+        len = end - ptr;
+        if ( len <= keylen || memcmp(ptr, key, keylen) ) {
+            break;
+        }
+        line = (char *)malloc(len + 1);
+        memcpy(line, ptr, len);
+        line[len] = '\0';
+        add_index_line(owners, line);
+    }
+    munmap((void *)data, st.st_size);
+    return 0;
+}
 
-    snprintf(buf, sizeof(buf), "%s/.manifest", product->info.root);
-    if(rmdir(buf)<0)
-        perror("Could not remove .manifest directory");
-
-    /* We can't be removing the current directory, move somewhere else! */
-    chdir("/");
-
-    if(rmdir(product->info.root) < 0)
-        perror("Could not remove install directory");
-
-    /* Remove the symlink */
-    snprintf(buf, sizeof(buf), "%s/" LOKI_DIRNAME "/installed/%s/%s.xml", detect_home(), get_xml_base(), product->info.name);
-    unlink(buf);
-
-	/* Change the flag so we won't try to save the file */
-    product->changed = 0;
-    loki_closeproduct(product);
-
-    return 0;
+/* Replay the journal on the owners of the key found in the index */
+static void read_journal_owners(const char *journal, const char *key, size_t keylen,
+                                index_lines_t *owners)
+{
+    char line[PATH_MAX*2];
+    const char *path, *tab;
+    FILE *fp;
+    size_t len;
+
+    fp = fopen(journal, "r");
+    if ( !fp ) {
+        return;
+    }
+    while ( fgets(line, sizeof(line), fp) ) {
+        len = strlen(line);
+        if ( len == 0 || line[len-1] != '\n' ) {
+            break;
+        }
+        line[--len] = '\0';
+        if ( line[0] == '-' && line[1] == '\t' ) {
+            path = line + 2;
+            tab = strchr(path, '\t');
+            if ( tab && (tab == path ||
+                         ((size_t)(tab - path) == keylen-1 && !memcmp(path, key, keylen-1))) ) {
+                drop_owner_lines(owners, tab + 1, strlen(tab + 1));
+            }
+        } else if ( len > keylen && !memcmp(line, key, keylen) ) {
+            add_index_line(owners, strdup(line));
+        }
+    }
+    fclose(fp);
 }
 
-/* Get a pointer to the product info */
-
-product_info_t *loki_getinfo_product(product_t *product)
+/* Look up the owners of a path; the first owning product is copied to 'first'.
+   Only the owners with the given checksum are considered if 'md5' is set, and
+   the entries of the product named 'skip' are ignored.
+ */
+static int find_owners(const char *path, path_owner_cb cb, char *first, size_t firstlen,
+                       const char *md5, const char *skip)
 {
-    return &product->info;
-}
+    char indexpath[PATH_MAX], journal[PATH_MAX], key[PATH_MAX+1];
+    char product[256], component[256], option[256], sum[CHECKSUM_SIZE+1];
+    index_lines_t owners = { NULL, 0, 0 };
+    struct _loki_lock_t *lock;
+    size_t keylen;
+    char *line;
+    int i, ret, count = 0;
+
+    snprintf(key, sizeof(key), "%s", path);
+    loki_trim_slashes(key);
+    keylen = strlen(key);
+    if ( keylen+1 >= sizeof(key) ) {
+        return 0;
+    }
+    key[keylen++] = '\t';
+    key[keylen] = '\0';
 
-/* Enumerate the installed options */
+    get_path_index(indexpath, sizeof(indexpath));
+    get_path_journal(journal, sizeof(journal));
+    if ( access(indexpath, F_OK) < 0 && loki_rebuild_path_index() < 0 ) {
+        return -1;
+    }
+    /* The index and the journal have to be read together */
+    pthread_mutex_lock(&index_mutex);
+    lock = lock_manifest(indexpath, 0);
+    if ( lock == LOCK_TIMEDOUT ) {
+        pthread_mutex_unlock(&index_mutex);
+        fprintf(stderr, "Timed out waiting for a lock on %s\n", indexpath);
+        return -1;
+    }
+    ret = read_index_owners(indexpath, key, keylen, &owners);
+    if ( ret == 0 ) {
+        read_journal_owners(journal, key, keylen, &owners);
+    }
+    unlock_manifest(lock, 0);
+    pthread_mutex_unlock(&index_mutex);
+    if ( ret < 0 ) {
+        return -1;
+    }
 
-product_component_t *loki_getfirst_component(product_t *product)
-{
-    return product->components;
+    for ( i = 0; i < owners.num; ++i ) {
+        line = owners.lines[i];
+        /* Entries without a checksum match anything */
+        strcpy(sum, "-");
+        if ( sscanf(line + keylen, "%255[^\t]\t%255[^\t]\t%255[^\t]\t%32s",
+                    product, component, option, sum) >= 3 ) {
+            if ( (skip && !strcasecmp(product, skip)) ||
+                 (md5 && strcmp(sum, "-") && strcasecmp(sum, md5)) ) {
+                continue;
+            }
+            if ( count == 0 && first ) {
+                snprintf(first, firstlen, "%s", product);
+            }
+            if ( cb ) {
+                line[keylen-1] = '\0';
+                cb(line, product, component, option);
+            }
+            ++count;
+        }
+    }
+    free_index_lines(&owners);
+    return count;
 }
 
-product_component_t *loki_getnext_component(product_component_t *component)
+int loki_find_owners(const char *path, path_owner_cb cb)
 {
-    return component ? component->next : NULL;
+    return find_owners(path, cb, NULL, 0, NULL, NULL);
 }
 
-product_component_t *loki_getdefault_component(product_t *product)
+int loki_path_refcount(product_t *product, const char *path, const unsigned char *md5)
 {
-    return product->default_comp;
-}
+    char sum[CHECKSUM_SIZE+1];
+    product_file_t *file;
+    int count;
 
-product_component_t *loki_find_component(product_t *product, const char *name)
-{
-    product_component_t *ret = product->components;
-    while ( ret ) {
-        if ( !strcmp(ret->name, name) ) {
-            return ret;
+    if ( md5 ) {
+        format_md5(md5, sum);
+    }
+    if ( product ) {
+        loki_flush_hashes(product);
+    }
+    count = find_owners(path, NULL, NULL, 0, md5 ? sum : NULL,
+                        product ? product->info.name : NULL);
+    /* The product may have changed since it was last saved */
+    if ( count >= 0 && product ) {
+        const char *rel = loki_remove_root(product, path);
+
+        /* Any of the files registered with this path */
+        for ( file = lookup_path(product, rel); file; file = file->path_next ) {
+            if ( !strcmp(file->path, rel) &&
+                 (!md5 || file->type != LOKI_FILE_REGULAR || !memcmp(file->data.md5sum, md5, 16)) ) {
+                ++count;
+                break;
+            }
         }
-        ret = ret->next;
     }
-    return NULL;
+    return count;
 }
 
-const char *loki_getname_component(product_component_t *component)
+/* Asynchronous writes that are still pending, see loki_closeproduct_async() */
+struct _loki_close_handle_t
 {
-    return component->name;
-}
+    pthread_t thread;
+    int has_thread;
+    product_t *product;
+    char name[64];
+    int done, result;
+    loki_close_handle_t *next;
+};
 
-const char *loki_getversion_component(product_component_t *component)
-{
-    return component->version;
-}
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t pending_once = PTHREAD_ONCE_INIT;
+static pthread_key_t writer_key; /* Set in the threads of loki_closeproduct_async() */
+static loki_close_handle_t *pending_writes = NULL;
 
-/* Uninstallation messages displayed to the user when the component is removed */
-const char *loki_getmessage_component(product_component_t *comp)
+/* Block until no write is pending for the named product, or for any product if name is NULL */
+static void wait_pending_writes(const char *name)
 {
-	xmlNodePtr node;
+    loki_close_handle_t *handle;
 
-	/* Look for a <message> tag */
-	for ( node = XML_CHILDREN(comp->node); node; node = node->next ) {
-		if ( node->name && !strcmp((char *)node->name, "message") ) {
-			return get_xml_string(comp->product, node);
-		}
-	}
-	return NULL;
+    pthread_mutex_lock(&pending_lock);
+    /* A writer thread would be waiting for itself, or for another one waiting for it */
+    if ( pending_writes && pthread_getspecific(writer_key) ) {
+        pthread_mutex_unlock(&pending_lock);
+        return;
+    }
+    for ( handle = pending_writes; handle; ) {
+        if ( !handle->done && (!name || !strcasecmp(handle->name, name)) ) {
+            pthread_cond_wait(&pending_cond, &pending_lock);
+            handle = pending_writes; /* The list may have changed */
+        } else {
+            handle = handle->next;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
 }
 
-void loki_setmessage_component(product_component_t *comp, const char *msg)
+static void flush_pending_writes(void)
 {
-	xmlNodePtr node;
-
-	comp->product->changed = 1;
-	/* Look for a <message> tag */
-	for ( node = XML_CHILDREN(comp->node); node; node = node->next ) {
-		if ( node->name && !strcmp((char *)node->name, "message") ) {
-			/* Remove the existing node */
-			xmlUnlinkNode(node);
-			xmlFreeNode(node);
-			break;
-		}
-	}
-
-	if ( msg ) {
-		xmlNewChild(comp->node, NULL, BAD_CAST "message", BAD_CAST substitute_xml_string(msg));
-	}
+    wait_pending_writes(NULL);
 }
 
-size_t loki_getsize_component(product_component_t *component)
+static void init_pending_writes(void)
 {
-    size_t size = 0;
-    product_option_t *option;
-
-    for ( option = loki_getfirst_option(component);
-          option;
-          option = loki_getnext_option(option) ) {
-        size += loki_getsize_option(option);
-    }
-    return size;
+    pthread_key_create(&writer_key, NULL);
+    atexit(flush_pending_writes);
 }
 
-int loki_isdefault_component(product_component_t *comp)
+/* Open a product by name*/
+
+product_t *loki_openproduct(const char *name)
 {
-    return comp->is_default;
+    return loki_openproduct_flags(name, 0);
 }
 
-void loki_setdefault_component(product_component_t *comp)
+/* Build the component structure for a <component> node and add it to the product */
+static product_component_t *parse_component(product_t *prod, xmlNodePtr node)
 {
-    product_t *prod = comp->product;
-    if ( prod->default_comp ) {
-        xmlSetProp(prod->default_comp->node, BAD_CAST "default", NULL);
-        prod->default_comp->is_default = 0;
+    xmlNodePtr optnode;
+    char *str;
+    product_component_t *comp = (product_component_t *) malloc(sizeof(product_component_t));
+
+    comp->node = node;
+    comp->product = prod;
+    comp->name = (char *)xmlGetProp(node, BAD_CAST "name");
+    comp->version = (char *)xmlGetProp(node, BAD_CAST "version");
+    comp->url = (char *)xmlGetProp(node, BAD_CAST "update_url");
+    str = (char *)xmlGetProp(node, BAD_CAST "default");
+    comp->is_default = (str && *str=='y');
+	xmlFree(str);
+    if ( comp->is_default ) {
+        prod->default_comp = comp;
     }
-    xmlSetProp(comp->node, BAD_CAST "default", BAD_CAST "yes");
-    prod->default_comp = comp;
-    prod->changed = 1;
-}
+    comp->options = NULL;
+    comp->scripts = NULL;
+	comp->envvars = NULL;
+    comp->size = 0;
+    comp->unsized = 0;
+    comp->next = prod->components;
+    prod->components = comp;
+
+    for ( optnode = XML_CHILDREN(node); optnode; optnode = optnode->next ) {
+        if ( !strcmp((char *)optnode->name, "option") ) {
+            xmlNodePtr filenode;
+            product_file_t **link;
+            product_option_t *opt = (product_option_t *)malloc(sizeof(product_option_t));
+
+            opt->node = optnode;
+            opt->component = comp;
+            opt->name = (char *)xmlGetProp(optnode, BAD_CAST "name");
+			opt->tag = (char *)xmlGetProp(optnode, BAD_CAST "tag");
+            opt->files = NULL;
+            opt->size = 0;
+            opt->unsized = 0;
+            opt->next = comp->options;
+            comp->options = opt;
+            link = &opt->files;
+
+            for( filenode = XML_CHILDREN(optnode); filenode; filenode = filenode->next ) {
+                file_type_t t;
+                product_file_t *file;
+				const char *cstr;
+
+				if ( !XML_CHILDREN(filenode) )
+					continue; /* Skip nodes with no children - likely text nodes */
+
+				file = (product_file_t *) malloc(sizeof(product_file_t));
+                file->hash = NULL;
+                memset(file->data.md5sum, 0, 16);
+                file->size = 0;
+                file->unsized = 0;
+                file->mtime = 0;
+                if ( !strcmp((char *)filenode->name, "file") ) {
+                    char *md5;
+					md5 = (char *)xmlGetProp(filenode, BAD_CAST "md5");
+                    t = LOKI_FILE_REGULAR;
+                    if ( md5 ) {
+                        memcpy(file->data.md5sum, get_md5_bin(md5), 16);
+						xmlFree(md5);
+					}
+                    str = (char *)xmlGetProp(filenode, BAD_CAST "size");
+                    if ( str ) {
+                        file->size = (size_t)strtoul(str, NULL, 10);
+                        opt->size += file->size;
+                        comp->size += file->size;
+                        xmlFree(str);
+                    } else {
+                        file->unsized = 1;
+                        opt->unsized ++;
+                        comp->unsized ++;
+                    }
+                    str = (char *)xmlGetProp(filenode, BAD_CAST "mtime");
+                    if ( str ) {
+                        file->mtime = (time_t)strtol(str, NULL, 10);
+                        xmlFree(str);
+                    }
+                } else if ( !strcmp((char *)filenode->name, "directory") ) {
+                    t = LOKI_FILE_DIRECTORY;
+                } else if ( !strcmp((char *)filenode->name, "symlink") ) {
+                    t = LOKI_FILE_SYMLINK;
+                } else if ( !strcmp((char *)filenode->name, "fifo") ) {
+                    t = LOKI_FILE_FIFO;
+                } else if ( !strcmp((char *)filenode->name, "device") ) {
+                    t = LOKI_FILE_DEVICE;
+                } else if ( !strcmp((char *)filenode->name, "rpm") ) {
+                    t = LOKI_FILE_RPM;
+                } else if ( !strcmp((char *)filenode->name, "script") ) {
+                    t = LOKI_FILE_SCRIPT;
+                    str = (char *)xmlGetProp(filenode, BAD_CAST "type");
+                    if ( str ) {
+                        if ( !strcmp(str, script_types[LOKI_SCRIPT_PREUNINSTALL]) ) {
+                            file->data.scr_type = LOKI_SCRIPT_PREUNINSTALL;
+                        } else if ( !strcmp(str, script_types[LOKI_SCRIPT_POSTUNINSTALL]) ) {
+                            file->data.scr_type = LOKI_SCRIPT_POSTUNINSTALL;
+                        }
+						xmlFree(str);
+                    }
+                } else {
+                    t = LOKI_FILE_NONE;
+                }
+                file->node = filenode;
+                file->option = opt;
+                file->type = t;
+                str = (char *)xmlGetProp(filenode, BAD_CAST "patched");
+                if ( str && *str=='y' ) {
+                    file->patched = 1;
+                } else {
+                    file->patched = 0;
+                }
+				xmlFree(str);
+                str = (char *)xmlGetProp(filenode, BAD_CAST "mutable");
+                if ( str && *str=='y' ) {
+                    file->mutable = 1;
+                } else {
+                    file->mutable = 0;
+                }
+				xmlFree(str);
+                str = (char *)xmlGetProp(filenode, BAD_CAST "desktop");
+                if ( str ) {
+					file->desktop = strdup(str);
+					xmlFree(str);
+                } else {
+					file->desktop = NULL;
+				}
+                str = (char *)xmlGetProp(filenode, BAD_CAST "mode");
+                if ( str ) {
+                    sscanf(str,"%o", &file->mode);
+                } else {
+                    file->mode = 0644;
+                }
+				xmlFree(str);
+#ifdef __linux
+				str = (char *)xmlGetProp(filenode, BAD_CAST "secontext");
+				if ( str ) {
+					file->se_context = strdup(str);
+				} else {
+					file->se_context = NULL;
+				}
+#endif
+                cstr = get_xml_string(prod, filenode);
+                file->path = strdup(cstr); /* The expansion is done in loki_getname_file() */
+                map_path(prod, file);
 
-product_component_t *loki_create_component(product_t *product, const char *name, const char *version)
-{
-    xmlNodePtr node = xmlNewChild(XML_ROOT(product->doc), NULL, BAD_CAST "component", NULL);
-    if ( node ) {
-        product_component_t *ret = (product_component_t *)malloc(sizeof(product_component_t));
-        ret->node = node;
-        ret->product = product;
-        ret->name = strdup(name);
-        ret->version = strdup(version);
-        ret->url = NULL;
-        ret->is_default = (product->default_comp == NULL);
-        product->changed = 1;
-        xmlSetProp(node, BAD_CAST "name", BAD_CAST name);
-        xmlSetProp(node, BAD_CAST "version", BAD_CAST version);
-        if(ret->is_default) {
-            xmlSetProp(node, BAD_CAST "default", BAD_CAST "yes");
-            product->default_comp = ret;
-        }
-        ret->scripts = NULL;
-        ret->options = NULL;
-		ret->envvars = NULL;
-        ret->next = product->components;
-        product->components = ret;
-        return ret;
+                file->next = NULL;
+                *link = file;
+                link = &file->next;
+            }
+        } else if ( !strcmp((char *)optnode->name, "script") ) {
+            product_file_t *file = (product_file_t *) malloc(sizeof(product_file_t));
+            file->hash = NULL;
+            file->node = optnode;
+            file->type = LOKI_FILE_SCRIPT;
+			file->desktop = NULL;
+
+            str = (char *)xmlGetProp(optnode, BAD_CAST "type");
+            if ( str ) {
+                if ( !strcmp(str, script_types[LOKI_SCRIPT_PREUNINSTALL]) ) {
+                    file->data.scr_type = LOKI_SCRIPT_PREUNINSTALL;
+                } else if ( !strcmp(str, script_types[LOKI_SCRIPT_POSTUNINSTALL]) ) {
+                    file->data.scr_type = LOKI_SCRIPT_POSTUNINSTALL;
+                }
+				xmlFree(str);
+            }
+            file->path = strdup(get_xml_string(prod, optnode));
+            file->next = comp->scripts;                    
+            comp->scripts = file;
+        } else if ( !strcmp((char *)optnode->name, "environment") ) {
+			product_envvar_t *var = malloc(sizeof(product_envvar_t));
+			
+			var->node = node;
+			var->name = (char *)xmlGetProp(node, BAD_CAST "var");
+			var->value = (char *)xmlGetProp(node, BAD_CAST "value");
+			var->next = comp->envvars;
+			comp->envvars = var;
+		}
     }
-    return NULL;
+    return comp;
 }
 
-void loki_remove_component(product_component_t *comp)
+product_t *loki_openproduct_flags(const char *name, int flags)
 {
-    product_option_t *opt, *nextopt;
-    product_file_t   *scr, *nextscr;
-	product_envvar_t *var, *nextvar;
-    product_component_t *c, *prev = NULL;
-    char script[PATH_MAX];
+    char buf[PATH_MAX];
+    int major, minor;
+    char *str;
+    const char *path = NULL;
+    xmlDocPtr doc = NULL;
+    xmlNodePtr node;
+    product_t *prod;
+    struct _loki_lock_t *lock;
 
-    xmlUnlinkNode(comp->node);
-    xmlFreeNode(comp->node);
-    free(comp->name);
-    free(comp->version);
-    free(comp->url);
+	LIBXML_TEST_VERSION;
 
-    /* Free all options */
-        
-    opt = comp->options;
-    while ( opt ) {
-        product_file_t *file, *nextfile;
-        nextopt = opt->next;
+    /* Readers must never see a manifest that is still being written */
+    if ( !(flags & OPEN_SNAPSHOT) ) {
+        wait_pending_writes(strchr(name, '/') ? NULL : name);
+    }
+
+    if ( strchr(name, '/') != NULL ) { /* Absolute path to a manifest file */
+        path = name;
+    } else {
+        /* Look for a matching case-insensitive file */
+        static glob_t xmls;
         
-        file = opt->files;
-        while ( file ) {
-            nextfile = file->next;
-            if ( file->type == LOKI_FILE_SCRIPT ) {
-                snprintf(script, sizeof(script),"%s/.manifest/scripts/%s.sh", 
-                         comp->product->info.root, file->path);
-                unlink(script);
+        snprintf(buf, sizeof(buf), "%s/" LOKI_DIRNAME "/installed/%s/*.xml", detect_home(), get_xml_base());
+        if ( glob(buf, GLOB_ERR, NULL, &xmls) != 0 ) {
+            return NULL;
+        } else {
+            if ( xmls.gl_pathc == 0 ) {
+                return NULL;
+            } else {
+                int i;
+                for ( i = 0; i < xmls.gl_pathc; ++i ) {
+                    if ( !strcasecmp(name, get_productname(xmls.gl_pathv[i])) ) {
+                        /* The .xml extension was removed by get_productname() */
+                        snprintf(buf, sizeof(buf), "%s.xml", xmls.gl_pathv[i]);
+                        path = buf;
+                        break;
+                    }
+                }
             }
-            free(file->path);
-            free(file);
-            file = nextfile;
         }
-        
-        free(opt->name);
-		if ( opt->tag )
-			free(opt->tag);
-        free(opt);
-        opt = nextopt;
-    }
-    
-    /* Free all scripts */
-    scr = comp->scripts;
-    while ( scr ){
-        nextscr = scr->next;
-        
-        snprintf(script, sizeof(script),"%s/.manifest/scripts/%s.sh", comp->product->info.root,
-                 scr->path);
-        unlink(script);
-        free(scr->path);
-        free(scr);
-        scr = nextscr;
+    }
+    if ( !path )
+        return NULL;
+
+    /* Writers get exclusive access to the manifest, readers share it */
+    if ( flags & OPEN_SNAPSHOT ) {
+        flags |= LOKI_OPEN_READONLY;
+        lock = NULL;
+    } else {
+        lock = lock_manifest(path, !(flags & LOKI_OPEN_READONLY));
+    }
+    if ( lock == LOCK_TIMEDOUT ) {
+        fprintf(stderr, "Timed out waiting for a lock on %s\n", path);
+        return NULL;
+    } else if ( lock == LOCK_BUSY ) {
+        fprintf(stderr, "%s is already opened for writing\n", path);
+        return NULL;
+    }
+    doc = xmlParseFile(path);
+    if ( !doc ) {
+        unlock_manifest(lock, !(flags & LOKI_OPEN_READONLY));
+        return NULL;
+    }
+    /* libxml reads compressed files transparently, keep them that way */
+    if ( is_compressed(path) ) {
+        xmlSetDocCompressMode(doc, DEFAULT_COMPRESSION);
+    }
+    prod = (product_t *)malloc(sizeof(product_t));
+    prod->doc = doc;
+    prod->changed = 0;
+    prod->lock = lock;
+    prod->readonly = (flags & LOKI_OPEN_READONLY) != 0;
+    prod->rootfd = -1;
+    prod->hasher = NULL;
+    prod->hashes = prod->last_hash = NULL;
+    prod->chunk_min = 0;
+    prod->paths = NULL;
+    prod->paths_size = prod->num_paths = 0;
+
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "name");
+    strncpy(prod->info.name, str, sizeof(prod->info.name));
+	xmlFree(str);
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "desc");
+    if ( str ) {
+        strncpy(prod->info.description, str, sizeof(prod->info.description));
+		xmlFree(str);
+    } else {
+        *prod->info.description = '\0';
+    }
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "root");
+    strncpy(prod->info.root, str, sizeof(prod->info.root));
+	xmlFree(str);
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "prefix");
+	if ( str ) {
+		strncpy(prod->info.prefix, str, sizeof(prod->info.prefix));
+		xmlFree(str);
+	} else {
+		strcpy(prod->info.prefix, ".");
+	}
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "update_url");
+    strncpy(prod->info.url, str, sizeof(prod->info.url));
+	xmlFree(str);
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "chunk_min");
+    if ( str ) {
+        prod->chunk_min = (off_t)strtoll(str, NULL, 10);
+        xmlFree(str);
+    }
+    if ( *name == '/' ) { /* Absolute path to a manifest.ini file */
+        strncpy(prod->info.registry_path, name,
+                sizeof(prod->info.registry_path));
+    } else {
+        snprintf(prod->info.registry_path, sizeof(prod->info.registry_path),
+                 "%s/.manifest/%s.xml", prod->info.root, prod->info.name);
+    }
+
+    /* Check for the xmlversion attribute for backwards compatibility */
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "xmlversion");
+    sscanf(str, "%d.%d", &major, &minor);
+    if ( (major > SETUPDB_VERSION_MAJOR) || 
+         ((major == SETUPDB_VERSION_MAJOR) && (minor > SETUPDB_VERSION_MINOR)) ) {
+        fprintf(stderr, "Warning: This XML file was generated with a later version of setupdb (%d.%d).\n"
+                "Problems may occur.\n", major, minor);
+    }
+	xmlFree(str);
+
+    prod->components = prod->default_comp = NULL;
+	prod->envvars = NULL;
+
+    str = (char *)xmlGetProp(XML_ROOT(doc), BAD_CAST "generation");
+    prod->generation = str ? strtoul(str, NULL, 10) : 0;
+	xmlFree(str);
+	prod->changes = prod->last_change = NULL;
+	prod->num_changes = prod->changes_lost = 0;
+
+    /* Parse the XML tags and build a tree. Water every day so that it grows steadily. */
+    
+    for ( node = XML_CHILDREN(XML_ROOT(doc)); node; node = node->next ) {
+        if ( !strcmp((char *)node->name, "component") ) {
+            parse_component(prod, node);
+        } else if ( !strcmp((char *)node->name, "environment") ) {
+			product_envvar_t *var = malloc(sizeof(product_envvar_t));
+
+			var->node = node;
+			var->name = (char *)xmlGetProp(node, BAD_CAST "var");
+			var->value = (char *)xmlGetProp(node, BAD_CAST "value");
+			var->next = prod->envvars;
+			prod->envvars = var;
+		}
+    }
+
+    return prod;
+}
+
+char *loki_trim_slashes(char *str)
+{
+	char *ptr = str+strlen(str);
+	while ( ptr > str ) {
+		ptr--;
+		if ( *ptr != '/' ) {
+			*(ptr+1) = '\0';
+			break;
+		}
+	}
+	return str;
+}
+
+/* Create a new product entry */
+
+product_t *loki_create_product(const char *name, const char *root, const char *desc, const char *url)
+{
+    char homefile[PATH_MAX], manifest[PATH_MAX], myroot[PATH_MAX];
+    xmlDocPtr doc;
+    product_t *prod;
+    struct _loki_lock_t *lock;
+
+	/* Create hierarchy if it doesn't exist already */
+	snprintf(homefile, sizeof(homefile), "%s/" LOKI_DIRNAME, detect_home());
+	mkdir(homefile, 0700);
+
+	strncat(homefile, "/installed", sizeof(homefile)-strlen(homefile)-1);
+	mkdir(homefile, 0700);
+
+	strncat(homefile, "/", sizeof(homefile)-strlen(homefile)-1);
+	strncat(homefile, get_xml_base(), sizeof(homefile)-strlen(homefile)-1);
+	mkdir(homefile, 0700);
+
+	/* Clean up the root - it can't have a trailing slash */
+	strncpy(myroot, root, sizeof(myroot));
+	loki_trim_slashes(myroot);
+
+    snprintf(manifest, sizeof(manifest), "%s/.manifest", myroot);
+    mkdir(manifest, 0755);
+
+    /* Create a new XML tree from scratch; we'll have to dump it to disk later */
+    doc = xmlNewDoc(BAD_CAST "1.0");
+
+    if ( !doc ) {
+        return NULL;
+    }
+    xmlSetDocCompressMode(doc, get_xml_compression());
+
+	strncat(homefile, "/", sizeof(homefile)-strlen(homefile)-1);
+	strncat(homefile, name, sizeof(homefile)-strlen(homefile)-1);
+	strncat(homefile, ".xml", sizeof(homefile)-strlen(homefile)-1);
+
+	strncat(manifest, "/", sizeof(manifest)-strlen(manifest)-1);
+	strncat(manifest, name, sizeof(manifest)-strlen(manifest)-1);
+	strncat(manifest, ".xml", sizeof(manifest)-strlen(manifest)-1);
+
+    lock = lock_manifest(manifest, 1);
+    if ( lock == LOCK_TIMEDOUT || lock == LOCK_BUSY ) {
+        fprintf(stderr, (lock == LOCK_BUSY) ? "%s is already opened for writing\n" :
+                "Timed out waiting for a lock on %s\n", manifest);
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+
+    /* Symlink the file in the 'installed' per-user directory */
+    unlink(homefile);
+    if ( symlink(manifest, homefile) < 0 )
+        fprintf(stderr, "Could not create symlink : %s\n", homefile);
+
+	/* Create the scripts subdirectory */
+	snprintf(manifest, sizeof(manifest), "%s/.manifest/scripts", root);
+	mkdir(manifest, 0755);
+
+    prod = (product_t *)malloc(sizeof(product_t));
+    prod->doc = doc;
+    prod->changed = LOKI_DIRTY_PRODUCT;
+    prod->lock = lock;
+    prod->readonly = 0;
+    prod->rootfd = -1;
+    prod->hasher = NULL;
+    prod->hashes = prod->last_hash = NULL;
+    prod->chunk_min = 0;
+    prod->paths = NULL;
+    prod->paths_size = prod->num_paths = 0;
+    prod->components = prod->default_comp = NULL;
+	prod->envvars = NULL;
+	prod->generation = 0;
+	prod->changes = prod->last_change = NULL;
+	prod->num_changes = prod->changes_lost = 0;
+
+    xmlDocSetRootElement(doc, xmlNewDocNode(doc, NULL, BAD_CAST "product", NULL));
+
+    strncpy(prod->info.name, name, sizeof(prod->info.name));
+    xmlSetProp(XML_ROOT(doc), BAD_CAST "name", BAD_CAST name);
+    if ( desc ) {
+        strncpy(prod->info.description, desc, sizeof(prod->info.description));
+        xmlSetProp(XML_ROOT(doc), BAD_CAST "desc", BAD_CAST desc);
+    } else {
+        *prod->info.description = '\0';
+    }
+    snprintf(homefile, sizeof(homefile), "%d.%d", SETUPDB_VERSION_MAJOR, SETUPDB_VERSION_MINOR);
+    xmlSetProp(XML_ROOT(doc), BAD_CAST "xmlversion", BAD_CAST homefile);
+    strncpy(prod->info.root, myroot, sizeof(prod->info.root));
+    xmlSetProp(XML_ROOT(doc), BAD_CAST "root", BAD_CAST myroot);
+    strncpy(prod->info.url, url, sizeof(prod->info.url));
+    strcpy(prod->info.prefix, ".");
+    xmlSetProp(XML_ROOT(doc), BAD_CAST "update_url", BAD_CAST url);
+    snprintf(prod->info.registry_path, sizeof(prod->info.registry_path), "%s/.manifest/%s.xml",
+             myroot, name);
+
+    return prod;
+}
+
+/* Set the install path of a product */
+
+void loki_setroot_product(product_t *product, const char *root)
+{
+    if ( !strcmp(product->info.root, root) ) {
+        return;
+    }
+    strncpy(product->info.root, root, sizeof(product->info.root));
+    xmlSetProp(XML_ROOT(product->doc), BAD_CAST "root", BAD_CAST root);
+    loki_flush_hashes(product);
+    if ( product->rootfd >= 0 ) {
+        close(product->rootfd);
+        product->rootfd = -1;
+    }
+    product->changed |= LOKI_DIRTY_PRODUCT;
+}
+
+/* Set a path prefix for the installation media for the product */
+void loki_setprefix_product(product_t *product, const char *prefix)
+{
+    if ( !strcmp(product->info.prefix, prefix) ) {
+        return;
+    }
+    strncpy(product->info.prefix, prefix, sizeof(product->info.prefix));
+    xmlSetProp(XML_ROOT(product->doc), BAD_CAST "prefix", BAD_CAST prefix);
+    product->changed |= LOKI_DIRTY_PRODUCT;
+}
+
+/* Set the gzip compression level of the XML file, 0 to store it uncompressed */
+void loki_setcompression_product(product_t *product, int level)
+{
+    if ( level != loki_getcompression_product(product) ) {
+        xmlSetDocCompressMode(product->doc, level);
+        product->changed |= LOKI_DIRTY_PRODUCT;
+    }
+}
+
+int loki_getcompression_product(product_t *product)
+{
+    int level = xmlGetDocCompressMode(product->doc);
+    return level > 0 ? level : 0;
+}
+
+int loki_getdirty_product(product_t *product)
+{
+    return product->changed;
+}
+
+void loki_setchunking_product(product_t *product, off_t min_size)
+{
+    char buf[32];
+
+    if ( min_size < 0 ) {
+        min_size = 0;
+    }
+    if ( min_size == product->chunk_min ) {
+        return;
+    }
+    product->chunk_min = min_size;
+    if ( min_size ) {
+        snprintf(buf, sizeof(buf), "%lld", (long long)min_size);
+        xmlSetProp(XML_ROOT(product->doc), BAD_CAST "chunk_min", BAD_CAST buf);
+    } else {
+        xmlUnsetProp(XML_ROOT(product->doc), BAD_CAST "chunk_min");
+    }
+    product->changed |= LOKI_DIRTY_PRODUCT;
+}
+
+off_t loki_getchunking_product(product_t *product)
+{
+    return product->chunk_min;
+}
+
+/* Set the update URL of a product */
+
+void loki_setupdateurl_product(product_t *product, const char *url)
+{
+    if ( !strcmp(product->info.url, url) ) {
+        return;
+    }
+    strncpy(product->info.url, url, sizeof(product->info.url));
+    xmlSetProp(XML_ROOT(product->doc), BAD_CAST "update_url", BAD_CAST url);
+    product->changed |= LOKI_DIRTY_PRODUCT;
+}
+
+/* Write the XML tree back to the registry file */
+static int save_product(product_t *product)
+{
+    int ret = 0;
+#if 1
+    char tmp[PATH_MAX+16];
+    index_lines_t records = { NULL, 0, 0 };
+
+    /* Scripts and environment variables are not in the index */
+    if ( product->changed & (LOKI_DIRTY_PRODUCT|LOKI_DIRTY_COMPONENTS|LOKI_DIRTY_FILES) ) {
+        collect_index_changes(product, &records);
+    }
+    commit_changes(product);
+    /* This isn't harmful as long as it's not a world writeable directory */
+    snprintf(tmp, sizeof(tmp), "%s.%05d", product->info.registry_path, (int)getpid());
+    /* Write XML file to disk if it has changed */
+    XML_SAVE_FILE(tmp, product->doc);
+
+    if(rename(tmp, product->info.registry_path) != 0)
+    {
+        /* too bad but we can't do much about it */
+        fprintf(stderr, "Unable to overwrite %s: %s.\nRegistry saved as %s.\n",
+                product->info.registry_path, strerror(errno), tmp);
+        ret = -1;
+    } else if ( product->changed & (LOKI_DIRTY_PRODUCT|LOKI_DIRTY_COMPONENTS|LOKI_DIRTY_FILES) ) {
+        update_path_index(&records);
+    }
+    free_index_lines(&records);
+#else
+    XML_SAVE_FILE(product->info.registry_path, product->doc);
+#endif
+    return ret;
+}
+
+/* Go through all the allocated structs */
+static void free_product(product_t *product)
+{
+    product_component_t *comp, *next;
+	product_envvar_t *var, *nextvar;
+
+    comp = product->components;
+    while ( comp ) {
+        product_option_t *opt, *nextopt;
+        product_file_t   *scr, *nextscr;
+
+        next = comp->next;
+        
+        opt = comp->options;
+        while ( opt ) {
+            product_file_t *file, *nextfile;
+            nextopt = opt->next;
+
+            file = opt->files;
+            while ( file ) {
+                nextfile = file->next;
+                free(file->path);
+#ifdef __linux
+				free(file->se_context);
+#endif
+                free(file);
+                file = nextfile;
+            }
+
+            free(opt->name);
+			if ( opt->tag )
+				free(opt->tag);
+            free(opt);
+            opt = nextopt;
+        }
+
+        scr = comp->scripts;
+        while ( scr ){
+            nextscr = scr->next;
+
+            free(scr->path);
+            free(scr);
+            scr = nextscr;
+        }
+
+		var = comp->envvars;
+		while ( var ) {
+			nextvar = var->next;
+			free(var->name);
+			free(var->value);
+			free(var);
+			var = nextvar;
+		}
+        
+        free(comp->name);
+        free(comp->version);
+        free(comp->url);
+        free(comp);
+        comp = next;
+    }
+
+	var = product->envvars;
+	while ( var ) {
+		nextvar = var->next;
+		free(var->name);
+		free(var->value);
+		free(var);
+		var = nextvar;
+	}
+
+	free_changes(product);
+	free_hashes(product);
+	free(product->paths);
+	if ( product->rootfd >= 0 ) {
+		close(product->rootfd);
+	}
+	unlock_manifest(product->lock, !product->readonly);
+    free(product);
+}
+
+static void *close_thread(void *data)
+{
+    loki_close_handle_t *handle = (loki_close_handle_t *)data;
+    int ret;
+
+    pthread_setspecific(writer_key, handle);
+    ret = save_product(handle->product);
+
+    free_product(handle->product);
+    pthread_mutex_lock(&pending_lock);
+    handle->product = NULL;
+    handle->result = ret;
+    handle->done = 1;
+    pthread_cond_broadcast(&pending_cond);
+    pthread_mutex_unlock(&pending_lock);
+    return NULL;
+}
+
+/* Close a product entry and free all allocated memory.
+   Also writes back to the database all changes that may have been made.
+ */
+
+int loki_closeproduct(product_t *product)
+{
+    int ret = 0;
+
+    loki_flush_hashes(product);
+    if ( product->changed ) {
+        if ( product->readonly ) {
+            fprintf(stderr, "%s was opened read-only, changes were not saved.\n",
+                    product->info.registry_path);
+            ret = -1;
+        } else {
+            /* Don't let an older asynchronous write overwrite this one */
+            wait_pending_writes(product->info.name);
+            ret = save_product(product);
+        }
+    }
+    free_product(product);
+    return ret;
+}
+
+loki_close_handle_t *loki_closeproduct_async(product_t *product)
+{
+    loki_close_handle_t *handle = (loki_close_handle_t *)malloc(sizeof(loki_close_handle_t));
+
+    if ( !handle ) {
+        return NULL;
+    }
+    pthread_once(&pending_once, init_pending_writes);
+    loki_flush_hashes(product);
+    wait_pending_writes(product->info.name);
+
+    strncpy(handle->name, product->info.name, sizeof(handle->name));
+    handle->product = product;
+    handle->has_thread = 0;
+    handle->done = 0;
+    handle->result = 0;
+
+    pthread_mutex_lock(&pending_lock);
+    handle->next = pending_writes;
+    pending_writes = handle;
+    pthread_mutex_unlock(&pending_lock);
+
+    if ( product->changed && product->readonly ) {
+        fprintf(stderr, "%s was opened read-only, changes were not saved.\n",
+                product->info.registry_path);
+        handle->result = -1;
+    } else if ( product->changed ) {
+        xmlInitParser();
+        if ( pthread_create(&handle->thread, NULL, close_thread, handle) == 0 ) {
+            handle->has_thread = 1;
+            return handle;
+        }
+        /* Couldn't start the thread, do it the old way */
+        handle->result = save_product(product);
+    }
+    free_product(product);
+    pthread_mutex_lock(&pending_lock);
+    handle->product = NULL;
+    handle->done = 1;
+    pthread_mutex_unlock(&pending_lock);
+    return handle;
+}
+
+int loki_wait_close(loki_close_handle_t *handle)
+{
+    loki_close_handle_t *h, *prev = NULL;
+    int ret;
+
+    if ( !handle ) {
+        return -1;
+    }
+    if ( handle->has_thread ) {
+        pthread_join(handle->thread, NULL);
+    }
+    pthread_mutex_lock(&pending_lock);
+    for ( h = pending_writes; h; prev = h, h = h->next ) {
+        if ( h == handle ) {
+            if ( prev ) {
+                prev->next = h->next;
+            } else {
+                pending_writes = h->next;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+    ret = handle->result;
+    free(handle);
+    return ret;
+}
+
+/* Clean up a product from the registry, i.e. removes all support files and directories */
+int loki_removeproduct(product_t *product)
+{
+    char buf[PATH_MAX];
+    index_lines_t records = { NULL, 0, 0 };
+    product_file_t *file;
+    product_option_t *opt;
+    product_component_t *comp;
+
+    if ( product->readonly ) {
+        fprintf(stderr, "%s was opened read-only, it can't be removed.\n",
+                product->info.registry_path);
+        loki_closeproduct(product);
+        return -1;
+    }
+
+    /* Remove the remaining scripts for each component and options */
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( file = comp->scripts; file; file = file->next ) {
+            snprintf(buf, sizeof(buf), "%s/.manifest/scripts/%s.sh",
+                     product->info.root, file->path);
+            unlink(buf);
+        }
+        
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if( file->type == LOKI_FILE_SCRIPT ) {
+                    snprintf(buf, sizeof(buf), "%s/.manifest/scripts/%s.sh",
+                             product->info.root, file->path);
+                    unlink(buf);
+                }
+            }
+        }
+    }
+
+    /* Remove the XML file and its lock, which we hold: whoever is waiting for
+       it notices and locks a new one instead */
+    if ( get_lock_path(product->info.registry_path, buf, sizeof(buf)) == 0 ) {
+        unlink(buf);
+    }
+    unlink(product->info.registry_path);
+
+    /* Remove the directories */
+    snprintf(buf, sizeof(buf), "%s/.manifest/scripts", product->info.root);
+    if(rmdir(buf)<0)
+        perror("Could not remove scripts directory");
+
+    snprintf(buf, sizeof(buf), "%s/.manifest", product->info.root);
+    if(rmdir(buf)<0)
+        perror("Could not remove .manifest directory");
+
+    /* We can't be removing the current directory, move somewhere else! */
+    chdir("/");
+
+    if(rmdir(product->info.root) < 0)
+        perror("Could not remove install directory");
+
+    /* Remove the symlink */
+    snprintf(buf, sizeof(buf), "%s/" LOKI_DIRNAME "/installed/%s/%s.xml", detect_home(), get_xml_base(), product->info.name);
+    unlink(buf);
+    snprintf(buf, sizeof(buf), "-\t\t%s\n", product->info.name);
+    add_index_line(&records, strdup(buf));
+    update_path_index(&records);
+    free_index_lines(&records);
+
+	/* Change the flag so we won't try to save the file */
+    product->changed = 0;
+    loki_closeproduct(product);
+
+    return 0;
+}
+
+/* Get a pointer to the product info */
+
+product_info_t *loki_getinfo_product(product_t *product)
+{
+    return &product->info;
+}
+
+unsigned long loki_get_generation(product_t *product)
+{
+    return product->generation;
+}
+
+/* Report the logged changes made after a given generation */
+int loki_changes_since(product_t *product, unsigned long generation, product_change_cb cb,
+                       void *data)
+{
+    char buf[PATH_MAX];
+    char *str, *op, *path;
+    xmlNodePtr log, node;
+    unsigned long gen;
+    int i, count = 0;
+
+    if ( generation >= product->generation ) {
+        return 0; /* Nothing new */
+    }
+    log = find_changes_node(product);
+    if ( !log ) {
+        return -1;
+    }
+    str = (char *)xmlGetProp(log, BAD_CAST "first");
+    if ( !str ) {
+        return -1;
+    }
+    gen = strtoul(str, NULL, 10);
+    xmlFree(str);
+    if ( generation+1 < gen ) {
+        return -1; /* Some of the changes are no longer in the log */
+    }
+
+    for ( node = XML_CHILDREN(log); node; node = node->next ) {
+        if ( node->type != XML_ELEMENT_NODE || strcmp((char *)node->name, "change") )
+            continue;
+        str = (char *)xmlGetProp(node, BAD_CAST "generation");
+        gen = str ? strtoul(str, NULL, 10) : 0;
+        xmlFree(str);
+        if ( gen <= generation )
+            continue;
+        op = (char *)xmlGetProp(node, BAD_CAST "op");
+        path = (char *)xmlGetProp(node, BAD_CAST "path");
+        if ( op && path ) {
+            for ( i = LOKI_CHANGE_ADD; i <= LOKI_CHANGE_REMOVE; ++i ) {
+                if ( !strcmp(op, change_types[i]) ) {
+                    cb(gen, (change_type_t)i, expand_path(product, path, buf, sizeof(buf)), data);
+                    count ++;
+                    break;
+                }
+            }
+        }
+        xmlFree(op);
+        xmlFree(path);
+    }
+    return count;
+}
+
+/* Enumerate the installed options */
+
+product_component_t *loki_getfirst_component(product_t *product)
+{
+    return product->components;
+}
+
+product_component_t *loki_getnext_component(product_component_t *component)
+{
+    return component ? component->next : NULL;
+}
+
+product_component_t *loki_getdefault_component(product_t *product)
+{
+    return product->default_comp;
+}
+
+product_component_t *loki_find_component(product_t *product, const char *name)
+{
+    product_component_t *ret = product->components;
+    while ( ret ) {
+        if ( !strcmp(ret->name, name) ) {
+            return ret;
+        }
+        ret = ret->next;
+    }
+    return NULL;
+}
+
+const char *loki_getname_component(product_component_t *component)
+{
+    return component->name;
+}
+
+const char *loki_getversion_component(product_component_t *component)
+{
+    return component->version;
+}
+
+/* Uninstallation messages displayed to the user when the component is removed */
+const char *loki_getmessage_component(product_component_t *comp)
+{
+	xmlNodePtr node;
+
+	/* Look for a <message> tag */
+	for ( node = XML_CHILDREN(comp->node); node; node = node->next ) {
+		if ( node->name && !strcmp((char *)node->name, "message") ) {
+			return get_xml_string(comp->product, node);
+		}
+	}
+	return NULL;
+}
+
+void loki_setmessage_component(product_component_t *comp, const char *msg)
+{
+	xmlNodePtr node;
+	const char *old = loki_getmessage_component(comp);
+
+	if ( old ? (msg && !strcmp(old, msg)) : !msg ) {
+		return;
+	}
+	comp->product->changed |= LOKI_DIRTY_COMPONENTS;
+	/* Look for a <message> tag */
+	for ( node = XML_CHILDREN(comp->node); node; node = node->next ) {
+		if ( node->name && !strcmp((char *)node->name, "message") ) {
+			/* Remove the existing node */
+			xmlUnlinkNode(node);
+			xmlFreeNode(node);
+			break;
+		}
+	}
+
+	if ( msg ) {
+		xmlNewChild(comp->node, NULL, BAD_CAST "message", BAD_CAST substitute_xml_string(msg));
+	}
+}
+
+size_t loki_getsize_component(product_component_t *component)
+{
+    product_option_t *option;
+
+    if ( component->unsized ) {
+        for ( option = component->options; option; option = option->next ) {
+            fill_sizes(option);
+        }
+    }
+    return component->size;
+}
+
+int loki_isdefault_component(product_component_t *comp)
+{
+    return comp->is_default;
+}
+
+void loki_setdefault_component(product_component_t *comp)
+{
+    product_t *prod = comp->product;
+    if ( prod->default_comp == comp ) {
+        return;
+    }
+    if ( prod->default_comp ) {
+        xmlSetProp(prod->default_comp->node, BAD_CAST "default", NULL);
+        prod->default_comp->is_default = 0;
+    }
+    xmlSetProp(comp->node, BAD_CAST "default", BAD_CAST "yes");
+    prod->default_comp = comp;
+    prod->changed |= LOKI_DIRTY_COMPONENTS;
+}
+
+product_component_t *loki_create_component(product_t *product, const char *name, const char *version)
+{
+    xmlNodePtr node = xmlNewChild(XML_ROOT(product->doc), NULL, BAD_CAST "component", NULL);
+    if ( node ) {
+        product_component_t *ret = (product_component_t *)malloc(sizeof(product_component_t));
+        ret->node = node;
+        ret->product = product;
+        ret->name = strdup(name);
+        ret->version = strdup(version);
+        ret->url = NULL;
+        ret->is_default = (product->default_comp == NULL);
+        product->changed |= LOKI_DIRTY_COMPONENTS;
+        xmlSetProp(node, BAD_CAST "name", BAD_CAST name);
+        xmlSetProp(node, BAD_CAST "version", BAD_CAST version);
+        if(ret->is_default) {
+            xmlSetProp(node, BAD_CAST "default", BAD_CAST "yes");
+            product->default_comp = ret;
+        }
+        ret->scripts = NULL;
+        ret->options = NULL;
+		ret->envvars = NULL;
+        ret->size = 0;
+        ret->unsized = 0;
+        ret->next = product->components;
+        product->components = ret;
+        return ret;
+    }
+    return NULL;
+}
+
+void loki_remove_component(product_component_t *comp)
+{
+    product_option_t *opt, *nextopt;
+    product_file_t   *scr, *nextscr;
+	product_envvar_t *var, *nextvar;
+    product_component_t *c, *prev = NULL;
+    char script[PATH_MAX];
+
+    /* Free all options, the files first as their nodes go with the component's */
+        
+    opt = comp->options;
+    while ( opt ) {
+        product_file_t *file, *nextfile;
+        nextopt = opt->next;
+        
+        file = opt->files;
+        while ( file ) {
+            nextfile = file->next;
+            if ( file->type == LOKI_FILE_SCRIPT ) {
+                snprintf(script, sizeof(script),"%s/.manifest/scripts/%s.sh", 
+                         comp->product->info.root, file->path);
+                unlink(script);
+            } else if ( file->type != LOKI_FILE_RPM ) {
+                record_change(comp->product, LOKI_CHANGE_REMOVE, file->path);
+            }
+            delete_file(file);
+            file = nextfile;
+        }
+        
+        free(opt->name);
+		if ( opt->tag )
+			free(opt->tag);
+        free(opt);
+        opt = nextopt;
+    }
+    xmlUnlinkNode(comp->node);
+    xmlFreeNode(comp->node);
+    free(comp->name);
+    free(comp->version);
+    free(comp->url);
+    
+    /* Free all scripts */
+    scr = comp->scripts;
+    while ( scr ){
+        nextscr = scr->next;
+        
+        snprintf(script, sizeof(script),"%s/.manifest/scripts/%s.sh", comp->product->info.root,
+                 scr->path);
+        unlink(script);
+        free(scr->path);
+        free(scr);
+        scr = nextscr;
     }
 
 	/* Environment variables */
@@ -1097,673 +3191,2689 @@ void loki_remove_component(product_component_t *comp)
 		var = nextvar;
 	}
 
-    /* Remove this component from the linked list */
-    for ( c = comp->product->components; c; c = c->next) {
-        if ( c == comp ) {
-            if ( prev ) {
-                prev->next = comp->next;
-            } else {
-                comp->product->components = comp->next;
+    /* Remove this component from the linked list */
+    for ( c = comp->product->components; c; c = c->next) {
+        if ( c == comp ) {
+            if ( prev ) {
+                prev->next = comp->next;
+            } else {
+                comp->product->components = comp->next;
+            }
+        }
+        prev = c;
+    }
+    
+    comp->product->changed |= LOKI_DIRTY_COMPONENTS;
+    free(comp);
+}
+
+/* Set a specific URL for updates to that component */
+void loki_seturl_component(product_component_t *comp, const char *url)
+{
+    xmlSetProp(comp->node, BAD_CAST "update_url", BAD_CAST url);
+    free(comp->url);
+    if ( url ) {
+        comp->url = strdup(url);
+    } else {
+        comp->url = NULL;
+    }
+}
+
+void loki_setversion_component(product_component_t *comp, const char *version)
+{
+    if ( comp->version && !strcmp(comp->version, version) ) {
+        return;
+    }
+    xmlSetProp(comp->node, BAD_CAST "version", BAD_CAST version);
+    free(comp->version);
+    comp->version = strdup(version);
+    comp->product->changed |= LOKI_DIRTY_COMPONENTS;
+}
+
+/* Get the URL for updates for a component; defaults to the product's URL if not defined */
+const char *loki_geturl_component(product_component_t *comp)
+{
+    return comp->url ? comp->url : comp->product->info.url;
+}
+
+/* Enumerate options from components */
+
+product_option_t *loki_getfirst_option(product_component_t *component)
+{
+    return component->options;
+}
+
+product_option_t *loki_getnext_option(product_option_t *opt)
+{
+    return opt ? opt->next : NULL;
+}
+
+product_option_t *loki_find_option(product_component_t *comp, const char *name)
+{
+    product_option_t *ret = comp->options;
+    while ( ret ) {
+        if ( !strcmp(ret->name, name) ) {
+            return ret;
+        }
+        ret = ret->next;
+    }
+    return NULL;
+}
+
+const char *loki_getname_option(product_option_t *opt)
+{
+    return opt->name;
+}
+
+const char *loki_gettag_option(product_option_t *opt)
+{
+    return opt->tag;
+}
+
+size_t loki_getsize_option(product_option_t *opt)
+{
+    fill_sizes(opt);
+    return opt->size;
+}
+
+size_t loki_getsize_file(product_file_t *file)
+{
+    if ( file->type == LOKI_FILE_REGULAR && file->unsized ) {
+        fill_sizes(file->option);
+    }
+    return file->size;
+}
+
+int loki_getfingerprint_file(product_file_t *file, char fingerprint[])
+{
+    char *str;
+
+    if ( file->hash ) {
+        loki_flush_hashes(file->option->component->product);
+    }
+    str = (file->type == LOKI_FILE_REGULAR) ? (char *)xmlGetProp(file->node, BAD_CAST "fingerprint") : NULL;
+    if ( ! str ) {
+        return -1;
+    }
+    strncpy(fingerprint, str, CHECKSUM_SIZE);
+    fingerprint[CHECKSUM_SIZE] = '\0';
+    xmlFree(str);
+    return 0;
+}
+
+typedef struct {
+    product_file_t *file;
+    int ok;
+    size_t size;
+} size_item_t;
+
+static void stat_item(void *item, void *data)
+{
+    size_item_t *it = (size_item_t *)item;
+    product_t *product = (product_t *)data;
+    char buf[PATH_MAX];
+    const char *path;
+    struct stat st;
+    int dirfd;
+
+    path = at_path(product, it->file->path, &dirfd, buf, sizeof(buf));
+    it->ok = (fstatat(dirfd, path, &st, 0) == 0);
+    it->size = it->ok ? st.st_size : 0;
+}
+
+int loki_recompute_sizes(product_t *product, int nthreads)
+{
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file;
+    size_item_t *items;
+    int i, count = 0, changed = 0;
+
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type == LOKI_FILE_REGULAR ) {
+                    ++count;
+                }
+            }
+        }
+    }
+    items = (size_item_t *)malloc((count+1) * sizeof(size_item_t));
+    count = 0;
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type == LOKI_FILE_REGULAR ) {
+                    items[count++].file = file;
+                }
+            }
+        }
+    }
+
+    get_rootfd(product);
+    parallel_run(items, count, sizeof(size_item_t), nthreads, stat_item, product);
+
+    /* The XML tree is only touched from this thread */
+    for ( i = 0; i < count; ++i ) {
+        file = items[i].file;
+        if ( items[i].ok && (file->unsized || file->size != items[i].size) ) {
+            set_file_size(file, items[i].size);
+            ++changed;
+        }
+    }
+    free(items);
+    if ( changed ) {
+        product->changed |= LOKI_DIRTY_FILES;
+    }
+    return changed;
+}
+
+product_option_t *loki_create_option(product_component_t *component, const char *name, const char *tag)
+{
+    xmlNodePtr node = xmlNewChild(component->node, NULL, BAD_CAST "option", NULL);
+    if ( node ) {
+        product_option_t *ret = (product_option_t *)malloc(sizeof(product_option_t));
+        ret->node = node;
+        ret->component = component;
+        ret->name = strdup(name);
+		ret->tag = tag ? strdup(tag) : NULL;
+        ret->next = component->options;
+        ret->files = NULL;
+        ret->size = 0;
+        ret->unsized = 0;
+        component->options = ret;
+        component->product->changed |= LOKI_DIRTY_COMPONENTS;
+        xmlSetProp(node, BAD_CAST "name", BAD_CAST name);
+		if ( tag ) {
+			xmlSetProp(node, BAD_CAST "tag", BAD_CAST tag);
+		}
+        return ret;
+    }
+    return NULL;
+}
+
+void loki_remove_option(product_option_t *opt)
+{
+    product_file_t *file, *nextfile;
+    product_option_t *c, *prev = NULL;
+    char script[PATH_MAX];
+
+    file = opt->files;
+    while ( file ) {
+        nextfile = file->next;
+        if ( file->type == LOKI_FILE_SCRIPT ) {
+            snprintf(script, sizeof(script),"%s/.manifest/scripts/%s.sh", 
+                     opt->component->product->info.root, file->path);
+            unlink(script);
+        } else if ( file->type != LOKI_FILE_RPM ) {
+            record_change(opt->component->product, LOKI_CHANGE_REMOVE, file->path);
+        }
+        delete_file(file);
+        file = nextfile;
+    }
+
+    xmlUnlinkNode(opt->node);
+    xmlFreeNode(opt->node);
+    free(opt->name);
+	if ( opt->tag )
+		free(opt->tag);
+
+    /* Remove this option from the linked list */
+    for ( c = opt->component->options; c; c = c->next) {
+        if ( c == opt ) {
+            if ( prev ) {
+                prev->next = opt->next;
+            } else {
+                opt->component->options = opt->next;
+            }
+        }
+        prev = c;
+    }
+
+    opt->component->product->changed |= LOKI_DIRTY_COMPONENTS;
+    free(opt);
+}
+
+/* Enumerate files from options */
+
+product_file_t *loki_getfirst_file(product_option_t *opt)
+{
+    return opt->files;
+}
+
+product_file_t *loki_getnext_file(product_file_t *file)
+{
+    return file ? file->next : NULL;
+}
+
+static product_file_t *find_file_by_name(product_option_t *opt, const char *path)
+{
+    product_file_t *file = opt->files;
+    while ( file ) {
+        if ( !strcmp(path, file->path) ) {
+            return file;
+        }
+        file = file->next;
+    }
+    return NULL;
+}
+
+/* Get informations from a file */
+file_type_t loki_gettype_file(product_file_t *file)
+{
+    return file->type;
+}
+
+/* This returns the expanded full path of the file if applicable */
+const char *loki_getpath_file(product_file_t *file)
+{
+    if ( file->type == LOKI_FILE_RPM || file->type == LOKI_FILE_SCRIPT ) {
+        return file->path;
+    } else {
+        static char buf[PATH_MAX]; /* FIXME: Evil static buffer */
+        expand_path(file->option->component->product, file->path, buf, sizeof(buf));
+        return buf;
+    }
+}
+
+unsigned int loki_getmode_file(product_file_t *file)
+{
+    return file->mode;
+}
+
+/* Set the UNIX mode for the file */
+void loki_setmode_file(product_file_t *file, unsigned int mode)
+{
+    char buf[20];
+    if ( file->mode == mode ) {
+        return;
+    }
+    file->mode = mode;
+    snprintf(buf, sizeof(buf), "%04o", mode);
+    xmlSetProp(file->node, BAD_CAST "mode", BAD_CAST buf);
+    file->option->component->product->changed |= LOKI_DIRTY_FILES;
+    record_change(file->option->component->product, LOKI_CHANGE_UPDATE, file->path);
+}
+
+const char *loki_get_secontext_file(product_file_t *file)
+{
+#ifdef __linux
+	return file->se_context;
+#else
+	return NULL;
+#endif
+}
+
+void loki_set_secontext_file(product_file_t *file, const char *context)
+{
+#ifdef __linux
+	if ( file->se_context && !strcmp(file->se_context, context) ) {
+		return;
+	}
+	free(file->se_context);
+	file->se_context = strdup(context);
+    xmlSetProp(file->node, BAD_CAST "secontext", BAD_CAST context);
+    file->option->component->product->changed |= LOKI_DIRTY_FILES;
+    record_change(file->option->component->product, LOKI_CHANGE_UPDATE, file->path);
+#endif
+}
+
+/* Get / set the 'patched' attribute of a flag, i.e. it should not be removed unless
+   the whole application is removed */
+int loki_getpatched_file(product_file_t *file)
+{
+    return file->patched;
+}
+
+void loki_setpatched_file(product_file_t *file, int flag)
+{
+    if ( !file->patched == !flag ) {
+        return;
+    }
+    file->patched = flag;
+    xmlSetProp(file->node, BAD_CAST "patched", flag ? BAD_CAST "yes" : BAD_CAST "no");
+    file->option->component->product->changed |= LOKI_DIRTY_FILES;
+    record_change(file->option->component->product, LOKI_CHANGE_UPDATE, file->path);
+}
+
+int loki_getmutable_file(product_file_t *file)
+{
+	return file->mutable;
+}
+
+void loki_setmutable_file(product_file_t *file, int flag)
+{
+    if ( !file->mutable == !flag ) {
+        return;
+    }
+    file->mutable = flag;
+    xmlSetProp(file->node, BAD_CAST "mutable", flag ? BAD_CAST "yes" : BAD_CAST "no");
+    file->option->component->product->changed |= LOKI_DIRTY_FILES;
+    record_change(file->option->component->product, LOKI_CHANGE_UPDATE, file->path);
+}
+
+product_option_t *loki_getoption_file(product_file_t *file)
+{
+    return file->option;
+}
+
+product_component_t *loki_getcomponent_file(product_file_t *file)
+{
+    return file->option->component;
+}
+
+product_t *loki_getproduct_file(product_file_t *file)
+{
+    return file->option->component->product;
+}
+
+unsigned char *loki_getmd5_file(product_file_t *file)
+{
+    if ( file->hash ) {
+        loki_flush_hashes(file->option->component->product);
+    }
+    return file->type==LOKI_FILE_REGULAR ? file->data.md5sum : NULL;
+}
+
+/* Enumerate all files of an option through a callback function */
+int loki_enumerate_files(product_option_t *opt, product_file_cb cb)
+{
+    char buf[PATH_MAX];
+    int count = 0;
+    product_file_t *file = opt->files;
+
+    while ( file ) {
+        if ( file->type == LOKI_FILE_RPM || file->type == LOKI_FILE_SCRIPT ) {
+            strncpy(buf, file->path, sizeof(buf));
+        } else {
+            expand_path(opt->component->product, file->path, buf, sizeof(buf));
+        }
+        cb(buf, file->type, opt->component, opt);
+        count ++;
+        file = file->next;
+    }
+    return count;
+}
+
+product_file_t *loki_findpath(const char *path, product_t *product)
+{
+    if ( product ) {
+        return lookup_path(product, loki_remove_root(product, path));
+    } else if ( *path == '/' ) {
+        char owner[256];
+        product_file_t *file = NULL;
+
+        /* The caller closes the product through loki_getproduct_file() */
+        if ( find_owners(path, NULL, owner, sizeof(owner), NULL, NULL) > 0 ) {
+            product = loki_openproduct_flags(owner, LOKI_OPEN_READONLY);
+            if ( product ) {
+                file = loki_findpath(path, product);
+                if ( !file ) {
+                    loki_closeproduct(product);
+                }
+            }
+        }
+        return file;
+    }
+    return NULL;
+}
+
+/* Register a file that was already lstat'ed. The file is appended at '*link' if
+   it is not NULL, which saves walking the list of files of the option. */
+static product_file_t *registerfile_stat(product_option_t *option, const char *path, const char *md5,
+                                         const struct stat *sb, product_file_t ***link)
+{
+    struct stat st = *sb;
+    char dev[10];
+    char full[PATH_MAX];
+#ifdef __linux
+    char secontext[256] = "";
+#endif
+    const char *atpath;
+    int dirfd, fd = -1;
+    product_file_t *file;
+
+    atpath = at_path(option->component->product, path, &dirfd, full, sizeof(full));
+    file = (product_file_t *)malloc(sizeof(product_file_t));
+    file->path = strdup(path);
+    file->hash = NULL;
+#ifdef __linux
+	file->se_context = NULL;
+#endif
+	file->desktop = NULL;
+    file->size = 0;
+    file->unsized = 0;
+    file->mtime = 0;
+    memset(file->data.md5sum, 0, 16);
+    if ( S_ISREG(st.st_mode) ) {
+        file->type = LOKI_FILE_REGULAR;
+        if ( md5 ) {
+            file->node = xmlNewChild(option->node, NULL, BAD_CAST "file", BAD_CAST substitute_xml_string(path));
+            xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5);
+            memcpy(file->data.md5sum, get_md5_bin(md5), 16);
+        } else if ( option->component->product->hasher ) {
+            /* The checksum is set by loki_flush_hashes() */
+            file->node = xmlNewChild(option->node, NULL, BAD_CAST "file", BAD_CAST substitute_xml_string(path));
+        } else {
+            char md5sum[33], fingerprint[33] = "", *chunks = NULL;
+            int failed = 1;
+            /* The context and the contents come from the same descriptor */
+            fd = openat(dirfd, atpath, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+            if ( fd >= 0 ) {
+#ifdef __linux
+                get_secontext(fd, NULL, secontext, sizeof(secontext));
+#endif
+                compute_fingerprint(fd, st.st_size, fingerprint);
+                if ( wants_chunks(option->component->product, st.st_size) ) {
+                    failed = md5_compute_chunked(fd, st.st_size, md5sum, &chunks) < 0;
+                } else {
+                    failed = md5_compute_fd_size(fd, st.st_size, md5sum, 1) < 0;
+                }
+            }
+            file->node = xmlNewChild(option->node, NULL, BAD_CAST "file", BAD_CAST substitute_xml_string(path));
+            /* No checksum is better than a wrong one */
+            if ( failed ) {
+                perror(path);
+            } else {
+                xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5sum);
+                memcpy(file->data.md5sum, get_md5_bin(md5sum), 16);
+                set_file_fingerprint(file, fingerprint);
+                set_file_chunks(file, chunks);
+                free(chunks);
+            }
+        }
+    } else if ( S_ISDIR(st.st_mode) ) {
+        file->type = LOKI_FILE_DIRECTORY;
+        file->node = xmlNewChild(option->node, NULL, BAD_CAST "directory", BAD_CAST substitute_xml_string(path));
+    } else if ( S_ISLNK(st.st_mode) ) {
+        char buf[PATH_MAX];
+        int count;
+
+        file->type = LOKI_FILE_SYMLINK;
+        file->node = xmlNewChild(option->node, NULL, BAD_CAST "symlink", BAD_CAST substitute_xml_string(path));
+        count = readlinkat(dirfd, atpath, buf, sizeof(buf)-1);
+        if ( count < 0 ) {
+            fprintf(stderr, "readlink: Could not find symbolic link %s\n", path);
+        } else {
+            buf[count] = '\0';
+            xmlSetProp(file->node, BAD_CAST "dest", BAD_CAST buf);
+        }
+    } else if ( S_ISFIFO(st.st_mode) ) {
+        file->type = LOKI_FILE_FIFO;
+        file->node = xmlNewChild(option->node, NULL, BAD_CAST "fifo", BAD_CAST substitute_xml_string(path));
+    } else if ( S_ISBLK(st.st_mode) ) {
+        file->type = LOKI_FILE_DEVICE;
+        file->node = xmlNewChild(option->node, NULL, BAD_CAST "device", BAD_CAST substitute_xml_string(path));
+        xmlSetProp(file->node, BAD_CAST "type", BAD_CAST "block");
+        /* Get the major/minor device number info */
+        snprintf(dev,sizeof(dev),"%d", major(st.st_rdev));
+        xmlSetProp(file->node, BAD_CAST "major", BAD_CAST dev);
+        snprintf(dev,sizeof(dev),"%d", minor(st.st_rdev));
+        xmlSetProp(file->node, BAD_CAST "minor", BAD_CAST dev);
+    } else if ( S_ISCHR(st.st_mode) ) {
+        file->type = LOKI_FILE_DEVICE;
+        file->node = xmlNewChild(option->node, NULL, BAD_CAST "device", BAD_CAST substitute_xml_string(path));
+        xmlSetProp(file->node, BAD_CAST "type", BAD_CAST "char");
+        /* Get the major/minor device number info */
+        snprintf(dev,sizeof(dev),"%d", major(st.st_rdev));
+        xmlSetProp(file->node, BAD_CAST "major", BAD_CAST dev);
+        snprintf(dev,sizeof(dev),"%d", minor(st.st_rdev));
+        xmlSetProp(file->node, BAD_CAST "minor", BAD_CAST dev);
+    } else {
+        /* TODO: Warning? */
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+    file->patched = 0;
+    file->mutable = 0;
+#ifdef __linux
+    if ( fd < 0 ) {
+        get_secontext(-1, expand_path(option->component->product, path, full, sizeof(full)),
+                      secontext, sizeof(secontext));
+    }
+    if ( *secontext ) {
+        file->se_context = strdup(secontext);
+        xmlSetProp(file->node, BAD_CAST "secontext", BAD_CAST secontext);
+    }
+#endif
+	/* Get the actual mode from the file */
+    file->mode = (st.st_mode & 07777);
+	snprintf(dev, sizeof(dev), "%04o", file->mode);
+    xmlSetProp(file->node, BAD_CAST "mode", BAD_CAST dev);
+    file->option = option;
+    if ( link ) {
+        file->next = NULL;
+        **link = file;
+        *link = &file->next;
+    } else {
+        insert_end_file(file, &option->files);
+    }
+    map_path(option->component->product, file);
+    if ( file->type == LOKI_FILE_REGULAR ) {
+        set_file_size(file, st.st_size);
+        set_file_mtime(file, st.st_mtime);
+        if ( !md5 && option->component->product->hasher ) {
+            defer_hash(option->component->product, file, 0, st.st_size);
+        }
+    }
+
+    option->component->product->changed |= LOKI_DIRTY_FILES;
+    record_change(option->component->product, LOKI_CHANGE_ADD, path);
+    return file;
+}
+
+static product_file_t *registerfile_new(product_option_t *option, const char *path, const char *md5)
+{
+    struct stat st;
+    char full[PATH_MAX];
+    const char *atpath;
+    int dirfd;
+
+    atpath = at_path(option->component->product, path, &dirfd, full, sizeof(full));
+    if ( fstatat(dirfd, atpath, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+        return NULL;
+    }
+    return registerfile_stat(option, path, md5, &st, NULL);
+}
+
+static product_file_t *registerfile_update(product_option_t *option, product_file_t *file,
+                                           const char *md5)
+{
+    char buf[PATH_MAX], full[PATH_MAX];
+    const char *atpath;
+    char *dest;
+    int count, dirfd, fd, modified = 0;
+    unsigned char *md5bin;
+    struct stat st;
+
+    atpath = at_path(option->component->product, file->path, &dirfd, full, sizeof(full));
+    switch(file->type) {
+    case LOKI_FILE_REGULAR:
+        if ( !md5 && option->component->product->hasher ) {
+            if ( fstatat(dirfd, atpath, &st, 0) == 0 ) {
+                modified = set_file_size(file, st.st_size) | set_file_mtime(file, st.st_mtime);
+            } else {
+                st.st_size = -1;
+            }
+            /* A different checksum is noted when the hashes are flushed */
+            defer_hash(option->component->product, file, 1, st.st_size);
+            break;
+        }
+        /* Stat and hash through the same descriptor */
+        fd = openat(dirfd, atpath, O_RDONLY|O_CLOEXEC);
+        if ( fd >= 0 && fstat(fd, &st) == 0 ) {
+            modified = set_file_size(file, st.st_size) | set_file_mtime(file, st.st_mtime);
+        } else {
+            st.st_size = -1;
+        }
+        /* Compare MD5 checksums; if different then the 'patched' attribute is set automatically */
+        if ( md5 ) {
+            if ( fd >= 0 ) {
+                close(fd);
+            }
+            md5bin = get_md5_bin(md5);
+            if ( memcmp(file->data.md5sum, md5bin, 16) ) {
+                xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5);
+                /* What was computed from the old contents is stale */
+                set_file_fingerprint(file, "");
+                set_file_chunks(file, NULL);
+                loki_setpatched_file(file, 1);
+                modified = 1;
+            }
+            memcpy(file->data.md5sum, md5bin, 16);
+        } else {
+            char md5sum[33], fingerprint[33] = "", *chunks = NULL;
+            int failed;
+            if ( fd >= 0 ) {
+                compute_fingerprint(fd, st.st_size, fingerprint);
+            }
+            if ( fd >= 0 && wants_chunks(option->component->product, st.st_size) ) {
+                failed = md5_compute_chunked(fd, st.st_size, md5sum, &chunks) < 0;
+            } else {
+                failed = fd < 0 || md5_compute_fd_size(fd, st.st_size, md5sum, 1) < 0;
+            }
+            /* What was recorded is kept if the file couldn't be read */
+            if ( failed ) {
+                perror(file->path);
+                break;
+            }
+            modified |= set_file_fingerprint(file, fingerprint);
+            modified |= set_file_chunks(file, chunks);
+            free(chunks);
+            md5bin = get_md5_bin(md5sum);
+            if ( memcmp(file->data.md5sum, md5bin, 16) ) {
+                xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5sum);
+                loki_setpatched_file(file, 1);
+                modified = 1;
+            }
+            memcpy(file->data.md5sum, md5bin, 16);
+        }
+        break;
+    case LOKI_FILE_SYMLINK:
+        count = readlinkat(dirfd, atpath, buf, sizeof(buf)-1);
+        if ( count < 0 ) {
+            fprintf(stderr, "Couldn't read link: %s\n", file->path);
+        }
+        if ( count >= 0 ) {
+            buf[count] = '\0';
+            dest = (char *)xmlGetProp(file->node, BAD_CAST "dest");
+            if ( !dest || strcmp(dest, buf) ) {
+                xmlSetProp(file->node, BAD_CAST "dest", BAD_CAST buf);
+                modified = 1;
+            }
+            xmlFree(dest);
+        }   
+        break;
+
+    case LOKI_FILE_DIRECTORY:
+    case LOKI_FILE_DEVICE:
+    case LOKI_FILE_SOCKET:
+    case LOKI_FILE_FIFO:
+    case LOKI_FILE_RPM:
+    case LOKI_FILE_SCRIPT:
+    case LOKI_FILE_NONE:
+        /* We don't need to update the MD5 checksums of these elements */
+        break;
+    }
+    if ( modified ) {
+        option->component->product->changed |= LOKI_DIRTY_FILES;
+        record_change(option->component->product, LOKI_CHANGE_UPDATE, file->path);
+    }
+    return file;
+}
+
+/* Register a file, returns 0 if OK */
+product_file_t *loki_register_file(product_option_t *option, const char *path, const char *md5)
+{
+    const char *nrpath = loki_remove_root(option->component->product, path);
+    product_file_t *file;
+
+	if ( ! *nrpath )  /* Trying to register the root path */
+		return NULL;
+
+    /* Check if this file is already registered for this option */
+    file = find_file_by_name(option, nrpath);
+    if ( file ) {
+        return registerfile_update(option, file, md5);
+    } else {
+        file = loki_findpath(path, option->component->product);
+        if ( file ) {
+            loki_unregister_file(file);
+        }
+        return registerfile_new(option, nrpath, md5);
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t written;
+
+    while ( len > 0 ) {
+        written = write(fd, buf, len);
+        if ( written < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* Copy the rest of a file descriptor to 'dst', feeding the bytes to the checksum. When
+   the kernel can copy the data itself, the checksum reads it back from the page cache. */
+static int copy_hash_fd(void *source, int dst, MD5_CONTEXT *ctx)
+{
+    int src = *(int *)source;
+    char buf[65536];
+    ssize_t count, done, got;
+#ifdef HAVE_COPY_FILE_RANGE
+    struct stat st;
+    off_t offset;
+
+    if ( fstat(src, &st) == 0 && S_ISREG(st.st_mode) ) {
+        offset = lseek(src, 0, SEEK_CUR);
+        /* Any error makes us fall back to read/write, which will report real ones */
+        while ( offset >= 0 &&
+                (count = copy_file_range(src, NULL, dst, NULL, 16*sizeof(buf), 0)) > 0 ) {
+            for ( done = 0; done < count; done += got ) {
+                got = pread(src, buf, ((size_t)(count - done) < sizeof(buf)) ? (size_t)(count - done) : sizeof(buf),
+                            offset + done);
+                if ( got <= 0 ) {
+                    return -1;
+                }
+                md5_write(ctx, (unsigned char *)buf, got);
+            }
+            offset += count;
+        }
+    }
+#endif
+    while ( (count = read(src, buf, sizeof(buf))) != 0 ) {
+        if ( count < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        md5_write(ctx, (unsigned char *)buf, count);
+        if ( write_all(dst, buf, count) < 0 ) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Same for the data of the current member of an archive */
+static int copy_hash_tar(void *source, int dst, MD5_CONTEXT *ctx)
+{
+    char buf[65536];
+    ssize_t count;
+
+    while ( (count = tar_read((tar_reader_t *)source, buf, sizeof(buf))) > 0 ) {
+        md5_write(ctx, (unsigned char *)buf, count);
+        if ( write_all(dst, buf, count) < 0 ) {
+            return -1;
+        }
+    }
+    return (int)count;
+}
+
+/* Register a file that was just put in place, with what we already know about it */
+static product_file_t *register_installed(product_option_t *option, const char *path,
+                                          const char *md5, const struct stat *st)
+{
+    product_file_t *file;
+
+    file = find_file_by_name(option, path);
+    if ( file && file->type == stat_type(st->st_mode) ) {
+        file = registerfile_update(option, file, md5);
+        if ( file->mode != (st->st_mode & 07777) ) {
+            loki_setmode_file(file, st->st_mode & 07777);
+        }
+        return file;
+    }
+    if ( ! file ) {
+        file = loki_findpath(path, option->component->product);
+    }
+    if ( file ) {
+        loki_unregister_file(file);
+    }
+    return registerfile_stat(option, path, md5, st, NULL);
+}
+
+/* Write a file at 'atpath' relative to 'dirfd', and register it as 'path' */
+static product_file_t *install_stream(product_option_t *option, const char *path,
+                                      int dirfd, const char *atpath,
+                                      int mode, time_t mtime, int flags,
+                                      int (*copy)(void *, int, MD5_CONTEXT *), void *source)
+{
+    product_t *product = option->component->product;
+    char tmp[PATH_MAX], md5sum[CHECKSUM_SIZE+1];
+    char fingerprint[CHECKSUM_SIZE+1], *chunks;
+    product_file_t *file;
+    unsigned char magic[2];
+    MD5_CONTEXT ctx;
+    struct stat st;
+    int out;
+
+    snprintf(tmp, sizeof(tmp), "%s.loki-%d", atpath, (int)getpid());
+    out = openat(dirfd, tmp, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if ( out < 0 ) {
+        perror(path);
+        return NULL;
+    }
+    md5_init(&ctx);
+    if ( copy(source, out, &ctx) < 0 || fchmod(out, mode) < 0 ||
+         ((flags & LOKI_INSTALL_SYNC) && fsync(out) < 0) ) {
+        perror(path);
+        close(out);
+        unlinkat(dirfd, tmp, 0);
+        return NULL;
+    }
+    md5_final(&ctx);
+    format_md5(ctx.buf, md5sum);
+    /* Checksums are on the uncompressed contents, so those have to be read again */
+    if ( pread(out, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b ) {
+        lseek(out, 0, SEEK_SET);
+        md5_compute_fd(dup(out), md5sum, 1);
+    }
+    if ( mtime ) {
+        struct timespec times[2];
+
+        times[0].tv_sec = times[1].tv_sec = mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        futimens(out, times);
+    }
+    fstat(out, &st);
+    /* The contents are still in the cache */
+    compute_fingerprint(out, st.st_size, fingerprint);
+    chunks = wants_chunks(product, st.st_size) ? compute_chunks(out, st.st_size, 0) : NULL;
+    close(out);
+
+    if ( flags & LOKI_INSTALL_NOCLOBBER ) {
+        /* link() fails if the destination exists, where rename() would replace it */
+        if ( linkat(dirfd, tmp, dirfd, atpath, 0) < 0 ) {
+            perror(path);
+            unlinkat(dirfd, tmp, 0);
+            free(chunks);
+            return NULL;
+        }
+        unlinkat(dirfd, tmp, 0);
+    } else if ( renameat(dirfd, tmp, dirfd, atpath) < 0 ) {
+        perror(path);
+        unlinkat(dirfd, tmp, 0);
+        free(chunks);
+        return NULL;
+    }
+    file = register_installed(option, path, md5sum, &st);
+    if ( file && (set_file_fingerprint(file, fingerprint) | set_file_chunks(file, chunks)) ) {
+        product->changed |= LOKI_DIRTY_FILES;
+    }
+    free(chunks);
+    return file;
+}
+
+product_file_t *loki_install_file_fd(product_option_t *option, int fd, const char *dest,
+                                     int mode, int flags)
+{
+    const char *path = loki_remove_root(option->component->product, dest);
+    char full[PATH_MAX];
+    const char *atpath;
+    struct stat st;
+    int dirfd;
+
+	if ( ! *path )  /* Trying to install over the root path */
+		return NULL;
+
+    if ( mode < 0 ) {
+        mode = (fstat(fd, &st) == 0) ? (st.st_mode & 07777) : 0644;
+    }
+    atpath = at_path(option->component->product, path, &dirfd, full, sizeof(full));
+    return install_stream(option, path, dirfd, atpath, mode, 0, flags, copy_hash_fd, &fd);
+}
+
+product_file_t *loki_install_file(product_option_t *option, const char *src, const char *dest,
+                                  int mode, int flags)
+{
+    product_file_t *file;
+    int fd;
+
+    fd = open(src, O_RDONLY|O_CLOEXEC);
+    if ( fd < 0 ) {
+        perror(src);
+        return NULL;
+    }
+    file = loki_install_file_fd(option, fd, dest, mode, flags);
+    close(fd);
+    return file;
+}
+
+/* Clean up the name of an archive member: leading slashes and "." components
+   are dropped, and names going up with ".." are refused. */
+static int member_path(const char *name, char *buf, size_t len)
+{
+    const char *end;
+    size_t n, used = 0;
+
+    for ( ; *name; name = end ) {
+        while ( *name == '/' ) {
+            ++name;
+        }
+        end = strchr(name, '/');
+        if ( !end ) {
+            end = name + strlen(name);
+        }
+        n = end - name;
+        if ( n == 0 || (n == 1 && *name == '.') ) {
+            continue;
+        }
+        if ( n == 2 && !strncmp(name, "..", 2) ) {
+            return -1;
+        }
+        if ( used + n + 2 > len ) {
+            return -1;
+        }
+        if ( used ) {
+            buf[used++] = '/';
+        }
+        memcpy(buf + used, name, n);
+        used += n;
+    }
+    buf[used] = '\0';
+    return 0;
+}
+
+/* Open the directory holding an archive member, as cleaned up by member_path(),
+   walking down from the root without following any symbolic link so that nothing
+   can be written outside of it. The missing directories are created if 'create'
+   is set. Returns a descriptor to close, and points 'name' at the last component.
+ */
+static int open_member_parent(product_t *product, const char *path, int create,
+                              const char **name)
+{
+    char buf[PATH_MAX];
+    char *comp, *slash;
+    int fd, next;
+
+    if ( get_rootfd(product) < 0 || strlen(path) >= sizeof(buf) ) {
+        return -1;
+    }
+    fd = dup(product->rootfd);
+    strcpy(buf, path);
+    for ( comp = buf; fd >= 0 && (slash = strchr(comp, '/')); comp = slash + 1 ) {
+        *slash = '\0';
+        if ( create ) {
+            mkdirat(fd, comp, 0755);
+        }
+        /* Fails on symbolic links, as they are not directories themselves */
+        next = openat(fd, comp, O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    *name = path + (comp - buf);
+    return fd;
+}
+
+/* Whether a symbolic link created at 'path' would stay under the root */
+static int safe_link_target(const char *path, const char *target)
+{
+    const char *end;
+    int depth = 0;
+
+    if ( *target == '/' ) {
+        return 0;
+    }
+    /* Depth of the directory holding the link */
+    for ( ; *path; ++path ) {
+        if ( *path == '/' ) {
+            ++depth;
+        }
+    }
+    for ( ; *target; target = end ) {
+        while ( *target == '/' ) {
+            ++target;
+        }
+        end = strchr(target, '/');
+        if ( !end ) {
+            end = target + strlen(target);
+        }
+        if ( end - target == 2 && !strncmp(target, "..", 2) ) {
+            if ( --depth < 0 ) {
+                return 0;
+            }
+        } else if ( end > target && !(end - target == 1 && *target == '.') ) {
+            ++depth;
+        }
+    }
+    return 1;
+}
+
+/* Create anything but a regular file or a hard link from an archive member */
+static int extract_special(tar_entry_t *entry, int dirfd, const char *path)
+{
+    int fd, ret;
+
+    if ( entry->type == TAR_DIR ) {
+        if ( mkdirat(dirfd, path, 0700) < 0 && errno != EEXIST ) {
+            return -1;
+        }
+        /* Not through a symbolic link that would be there instead */
+        fd = openat(dirfd, path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if ( fd < 0 ) {
+            return -1;
+        }
+        ret = fchmod(fd, entry->mode);
+        close(fd);
+        return ret;
+    }
+    /* Replace whatever was there, except directories */
+    if ( unlinkat(dirfd, path, 0) < 0 && errno != ENOENT && errno != EISDIR ) {
+        return -1;
+    }
+    switch (entry->type) {
+    case TAR_SYMLINK:
+        return symlinkat(entry->linkname, dirfd, path);
+    case TAR_FIFO:
+        return mkfifoat(dirfd, path, entry->mode);
+    case TAR_CHAR:
+        return mknodat(dirfd, path, S_IFCHR | entry->mode, makedev(entry->devmajor, entry->devminor));
+    case TAR_BLOCK:
+        return mknodat(dirfd, path, S_IFBLK | entry->mode, makedev(entry->devmajor, entry->devminor));
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+int loki_extract_tarball(product_option_t *option, const char *archive, int flags)
+{
+    product_t *product = option->component->product;
+    char path[PATH_MAX], target[PATH_MAX], md5sum[CHECKSUM_SIZE+1];
+    const char *atpath, *atfrom, *md5;
+    tar_reader_t *tar;
+    tar_entry_t entry;
+    product_file_t *file;
+    struct stat st;
+    int ret, dirfd, fromfd, count = 0;
+
+    tar = tar_open(archive);
+    if ( !tar ) {
+        return -1;
+    }
+    while ( (ret = tar_next(tar, &entry)) > 0 ) {
+        if ( member_path(entry.path, path, sizeof(path)) < 0 ) {
+            fprintf(stderr, "Skipping unsafe archive member %s\n", entry.path);
+            continue;
+        }
+        if ( !*path ) {
+            continue; /* The root itself */
+        }
+        if ( entry.type == TAR_SYMLINK && !safe_link_target(path, entry.linkname) ) {
+            fprintf(stderr, "Skipping symbolic link pointing out of the root: %s -> %s\n",
+                    entry.path, entry.linkname);
+            continue;
+        }
+        dirfd = open_member_parent(product, path, 1, &atpath);
+        if ( dirfd < 0 ) {
+            fprintf(stderr, "Skipping archive member %s: %s\n", entry.path, strerror(errno));
+            continue;
+        }
+
+        file = NULL;
+        switch (entry.type) {
+        case TAR_REGULAR:
+        case TAR_CONTIG:
+            file = install_stream(option, path, dirfd, atpath, entry.mode, entry.mtime, flags,
+                                  copy_hash_tar, tar);
+            break;
+        case TAR_HARDLINK:
+            /* The target was extracted before, its checksum is known */
+            if ( member_path(entry.linkname, target, sizeof(target)) < 0 || !*target ||
+                 (fromfd = open_member_parent(product, target, 0, &atfrom)) < 0 ) {
+                fprintf(stderr, "Skipping unsafe archive member %s\n", entry.path);
+                break;
+            }
+            unlinkat(dirfd, atpath, 0);
+            ret = linkat(fromfd, atfrom, dirfd, atpath, 0);
+            close(fromfd);
+            if ( ret < 0 || fstatat(dirfd, atpath, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+                perror(path);
+                break;
+            }
+            md5 = NULL;
+            file = find_file_by_name(option, target);
+            if ( file && file->type == LOKI_FILE_REGULAR ) {
+                format_md5(file->data.md5sum, md5sum);
+                md5 = md5sum;
+            }
+            file = register_installed(option, path, md5, &st);
+            break;
+        case TAR_SYMLINK:
+        case TAR_DIR:
+        case TAR_FIFO:
+        case TAR_CHAR:
+        case TAR_BLOCK:
+            if ( extract_special(&entry, dirfd, atpath) < 0 ||
+                 fstatat(dirfd, atpath, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+                perror(path);
+                break;
+            }
+            file = register_installed(option, path, NULL, &st);
+            break;
+        default:
+            fprintf(stderr, "Skipping archive member %s of unsupported type '%c'\n",
+                    entry.path, entry.type);
+            break;
+        }
+        close(dirfd);
+        if ( file ) {
+            ++count;
+        }
+    }
+    tar_close(tar);
+    if ( ret < 0 ) {
+        fprintf(stderr, "Error reading archive %s\n", archive);
+        return -1;
+    }
+    return count;
+}
+
+/* Indicate that a file is a desktop item for a binary */
+int loki_setdesktop_file(product_file_t *file, const char *binary)
+{
+	if ( file && binary ) {
+		if ( file->desktop && !strcmp(file->desktop, binary) )
+			return 1;
+		if ( file->desktop )
+			free(file->desktop);
+		file->desktop = strdup(binary);
+		xmlSetProp(file->node, BAD_CAST "desktop", BAD_CAST binary);
+		file->option->component->product->changed |= LOKI_DIRTY_FILES;
+		record_change(file->option->component->product, LOKI_CHANGE_UPDATE, file->path);
+		return 1;
+	}
+	return 0;
+}
+
+/* Test whether a file is a desktop item, optionally if it matches a binary */
+int loki_isdesktop_file(product_file_t *file, const char *binary)
+{
+	if ( file ) {
+		if ( binary ) {
+			return file->desktop && !strcmp(file->desktop, binary);
+		} else {
+			return file->desktop != NULL;
+		}
+	}
+	return 0;
+}
+
+/* Check a file against its MD5 checksum, for integrity */
+file_check_t loki_check_file(product_file_t *file)
+{
+	char full[PATH_MAX];
+	char md5sum[33];
+	char *str;
+	const char *path;
+	struct stat st;
+	int dirfd;
+	file_check_t ret = LOKI_OK;
+
+	if ( file->hash )
+		loki_flush_hashes(file->option->component->product);
+	path = at_path(file->option->component->product, file->path, &dirfd, full, sizeof(full));
+
+    switch(file->type) {
+    case LOKI_FILE_REGULAR:
+		if ( faccessat(dirfd, path, F_OK, 0) < 0 )
+			return LOKI_REMOVED;
+		if ( file->mutable )
+			return LOKI_OK;
+
+		/* Compare MD5 checksums if file exists */
+		if ( md5_compute_at(dirfd, path, -1, md5sum, NULL, NULL) < 0 )
+			return LOKI_CHANGED;
+		str = (char *)xmlGetProp(file->node, BAD_CAST "md5");
+		if ( str && strncmp(md5sum, str, CHECKSUM_SIZE) ) {
+			ret = LOKI_CHANGED;
+		}
+		xmlFree(str);
+		break;
+    case LOKI_FILE_SYMLINK:
+		if ( fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) < 0 )
+			return LOKI_REMOVED;
+		if ( file->mutable )
+			return LOKI_OK;
+		/*  Compare symlinks contents */
+		str = (char *)xmlGetProp(file->node, BAD_CAST "dest");
+		if ( str ) {
+			char buf[PATH_MAX];
+			int count;
+
+			count = readlinkat(dirfd, path, buf, sizeof(buf)-1);
+			if ( count < 0 ) {
+				xmlFree(str);
+				return LOKI_CHANGED;
+			} else {
+				buf[count] = '\0';
+			}
+			if ( strcmp(buf, str) )
+				ret = LOKI_CHANGED;
+			xmlFree(str);
+		}
+		break;
+    case LOKI_FILE_DEVICE:
+		if ( fstatat(dirfd, path, &st, 0) < 0 )
+			return LOKI_REMOVED;
+		/* Check that device has the same characteristics */
+		str = (char *)xmlGetProp(file->node, BAD_CAST "type");
+		if ( str ) {
+			if ( !strcmp(str, "block") && !S_ISBLK(st.st_mode) ) {
+				ret =  LOKI_CHANGED;
+			} else if ( !strcmp(str, "char") && !S_ISCHR(st.st_mode) ) {
+				ret = LOKI_CHANGED;
+			} else {
+				xmlFree(str);
+				str = (char *)xmlGetProp(file->node, BAD_CAST "major");
+				if ( str && major(st.st_rdev)!=atoi(str) ) {
+					ret = LOKI_CHANGED;
+				} else {
+					xmlFree(str);
+					str = (char *)xmlGetProp(file->node, BAD_CAST "minor");
+					if ( str && minor(st.st_rdev)!=atoi(str) )
+						ret = LOKI_CHANGED;
+				}
+			}
+			xmlFree(str);
+		}
+		break;
+    case LOKI_FILE_DIRECTORY:
+    case LOKI_FILE_SOCKET:
+    case LOKI_FILE_FIFO:
+		/* FIXME: Only test for existence */
+		if ( faccessat(dirfd, path, F_OK, 0) < 0 )
+			return LOKI_REMOVED;
+		break;
+    case LOKI_FILE_RPM:
+    case LOKI_FILE_SCRIPT:
+    case LOKI_FILE_NONE:
+		/* Do nothing */
+		break;
+	}
+	return ret;
+}
+
+file_check_t loki_check_file_chunked(product_file_t *file, int nthreads, chunk_cb cb, void *data)
+{
+	char full[PATH_MAX];
+	char *str, *sums;
+	const char *path;
+	struct stat st;
+	off_t start, end;
+	size_t i, num;
+	int dirfd, fd;
+	file_check_t ret = LOKI_OK;
+
+	if ( file->type != LOKI_FILE_REGULAR )
+		return loki_check_file(file);
+	if ( file->hash )
+		loki_flush_hashes(file->option->component->product);
+	str = (char *)xmlGetProp(file->node, BAD_CAST "chunks");
+	if ( !str || file->unsized || strlen(str) != NUM_CHUNKS(file->size)*CHECKSUM_SIZE ) {
+		xmlFree(str);
+		return loki_check_file(file);
+	}
+	path = at_path(file->option->component->product, file->path, &dirfd, full, sizeof(full));
+
+	fd = openat(dirfd, path, O_RDONLY|O_CLOEXEC);
+	if ( fd < 0 || fstat(fd, &st) < 0 ) {
+		ret = LOKI_REMOVED;
+	} else if ( file->mutable ) {
+		ret = LOKI_OK;
+	} else if ( (size_t)st.st_size != file->size ) {
+		ret = LOKI_CHANGED;
+	} else if ( !(sums = compute_chunks(fd, st.st_size, nthreads)) ) {
+		ret = LOKI_CHANGED;
+	} else {
+		/* Consecutive chunks that differ are reported as one range */
+		num = NUM_CHUNKS(st.st_size);
+		for ( i = 0; i < num; ++i ) {
+			if ( !strncmp(sums + i*CHECKSUM_SIZE, str + i*CHECKSUM_SIZE, CHECKSUM_SIZE) ) {
+				continue;
+			}
+			start = (off_t)i * CHUNK_SIZE;
+			while ( i+1 < num && strncmp(sums + (i+1)*CHECKSUM_SIZE,
+										 str + (i+1)*CHECKSUM_SIZE, CHECKSUM_SIZE) ) {
+				++i;
+			}
+			end = (off_t)(i+1) * CHUNK_SIZE;
+			if ( end > st.st_size ) {
+				end = st.st_size;
+			}
+			ret = LOKI_CHANGED;
+			if ( cb ) {
+				cb(file, start, end - start, data);
+			}
+		}
+		free(sums);
+	}
+	if ( fd >= 0 ) {
+		close(fd);
+	}
+	xmlFree(str);
+	return ret;
+}
+
+file_check_t loki_check_file_tiered(product_file_t *file, check_level_t level)
+{
+	char full[PATH_MAX], sum[CHECKSUM_SIZE+1];
+	char *str;
+	const char *path;
+	struct stat st;
+	int dirfd, fd;
+	file_check_t ret = LOKI_OK;
+
+	if ( file->type != LOKI_FILE_REGULAR )
+		return loki_check_file(file);
+	if ( file->hash )
+		loki_flush_hashes(file->option->component->product);
+	path = at_path(file->option->component->product, file->path, &dirfd, full, sizeof(full));
+
+	if ( fstatat(dirfd, path, &st, 0) < 0 )
+		return LOKI_REMOVED;
+	if ( file->mutable )
+		return LOKI_OK;
+	if ( !S_ISREG(st.st_mode) || (!file->unsized && (size_t)st.st_size != file->size) )
+		return LOKI_CHANGED;
+	if ( level == LOKI_CHECK_STAT )
+		return LOKI_OK;
+
+	fd = openat(dirfd, path, O_RDONLY|O_CLOEXEC);
+	if ( fd < 0 )
+		return LOKI_REMOVED;
+	str = (char *)xmlGetProp(file->node, BAD_CAST "fingerprint");
+	if ( str ) {
+		compute_fingerprint(fd, st.st_size, sum);
+		if ( strcmp(sum, str) ) {
+			ret = LOKI_CHANGED;
+		}
+		xmlFree(str);
+		if ( ret != LOKI_OK || level == LOKI_CHECK_FINGERPRINT ) {
+			close(fd);
+			return ret;
+		}
+	}
+
+	/* The descriptor is closed by the checksum */
+	if ( md5_compute_fd_size(fd, st.st_size, sum, 1) < 0 )
+		return LOKI_CHANGED;
+	str = (char *)xmlGetProp(file->node, BAD_CAST "md5");
+	if ( str && strncmp(sum, str, CHECKSUM_SIZE) ) {
+		ret = LOKI_CHANGED;
+	}
+	xmlFree(str);
+	return ret;
+}
+
+/* State shared by the threads of loki_check_product() */
+typedef struct {
+    int level; /* Of loki_check_file_tiered(), or -1 for loki_check_file() */
+    check_cb cb;
+    void *data;
+    int problems;
+    pthread_mutex_t lock;
+} check_job_t;
+
+static void check_item(void *item, void *data)
+{
+    product_file_t *file = *(product_file_t **)item;
+    check_job_t *job = (check_job_t *)data;
+    file_check_t status = (job->level < 0) ? loki_check_file(file) :
+        loki_check_file_tiered(file, (check_level_t)job->level);
+
+    pthread_mutex_lock(&job->lock);
+    if ( status != LOKI_OK ) {
+        ++job->problems;
+    }
+    if ( job->cb ) {
+        job->cb(file, status, job->data);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Check an array of files with 'nthreads' threads, returns how many have problems */
+static int run_checks(product_file_t **files, int count, int level, int nthreads,
+                      check_cb cb, void *data)
+{
+    check_job_t job;
+
+    job.level = level;
+    job.cb = cb;
+    job.data = data;
+    job.problems = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    parallel_run(files, count, sizeof(product_file_t *), nthreads, check_item, &job);
+    pthread_mutex_destroy(&job.lock);
+    return job.problems;
+}
+
+static int check_product(product_t *product, product_component_t *comp, int level,
+                         int nthreads, check_cb cb, void *data)
+{
+    product_component_t *c;
+    product_option_t *opt;
+    product_file_t *file, **files;
+    file_check_t status;
+    char *str;
+    int i, count = 0, total, first_chunked, problems;
+
+    /* The workers must not have to open the root or record checksums */
+    if ( get_rootfd(product) < 0 ) {
+        fprintf(stderr, "Could not open %s: %s\n", product->info.root, strerror(errno));
+        return -1;
+    }
+    loki_flush_hashes(product);
+
+    for ( c = comp ? comp : product->components; c; c = comp ? NULL : c->next ) {
+        for ( opt = c->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                ++count;
+            }
+        }
+    }
+    files = (product_file_t **)malloc((count+1) * sizeof(product_file_t *));
+    total = first_chunked = count;
+    count = 0;
+    for ( c = comp ? comp : product->components; c; c = comp ? NULL : c->next ) {
+        for ( opt = c->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type == LOKI_FILE_RPM ) {
+                    continue;
+                }
+                /* Files with chunk checksums go at the end, to be done one by one */
+                str = NULL;
+                if ( file->type == LOKI_FILE_REGULAR && (level < 0 || level == LOKI_CHECK_FULL) ) {
+                    str = (char *)xmlGetProp(file->node, BAD_CAST "chunks");
+                }
+                if ( str ) {
+                    files[--first_chunked] = file;
+                    xmlFree(str);
+                } else {
+                    files[count++] = file;
+                }
             }
         }
-        prev = c;
     }
-    
-    comp->product->changed = 1;
-    free(comp);
-}
 
-/* Set a specific URL for updates to that component */
-void loki_seturl_component(product_component_t *comp, const char *url)
-{
-    xmlSetProp(comp->node, BAD_CAST "update_url", BAD_CAST url);
-    free(comp->url);
-    if ( url ) {
-        comp->url = strdup(url);
-    } else {
-        comp->url = NULL;
+    problems = run_checks(files, count, level, nthreads, cb, data);
+    /* A single huge file can use all the threads */
+    for ( i = first_chunked; i < total; ++i ) {
+        status = loki_check_file_chunked(files[i], nthreads, NULL, NULL);
+        if ( status != LOKI_OK ) {
+            ++problems;
+        }
+        if ( cb ) {
+            cb(files[i], status, data);
+        }
     }
+    free(files);
+    return problems;
 }
 
-void loki_setversion_component(product_component_t *comp, const char *version)
+int loki_check_product(product_t *product, product_component_t *comp, int nthreads,
+                       check_cb cb, void *data)
 {
-    xmlSetProp(comp->node, BAD_CAST "version", BAD_CAST version);
-    free(comp->version);
-    comp->version = strdup(version);
-    comp->product->changed = 1;
+    return check_product(product, comp, -1, nthreads, cb, data);
 }
 
-/* Get the URL for updates for a component; defaults to the product's URL if not defined */
-const char *loki_geturl_component(product_component_t *comp)
+int loki_check_product_tiered(product_t *product, product_component_t *comp,
+                              check_level_t level, int nthreads, check_cb cb, void *data)
 {
-    return comp->url ? comp->url : comp->product->info.url;
+    return check_product(product, comp, level, nthreads, cb, data);
 }
 
-/* Enumerate options from components */
+/* Regular files considered by loki_check_product_sampled() */
+typedef struct {
+    product_file_t *file;
+    double key;
+} sample_item_t;
 
-product_option_t *loki_getfirst_option(product_component_t *component)
+static int compare_keys(const void *a, const void *b)
 {
-    return component->options;
+    double ka = ((const sample_item_t *)a)->key, kb = ((const sample_item_t *)b)->key;
+    return (ka > kb) - (ka < kb);
 }
 
-product_option_t *loki_getnext_option(product_option_t *opt)
+int loki_check_product_sampled(product_t *product, double budget, unsigned int seed,
+                               int nthreads, check_cb cb, void *data,
+                               sample_summary_t *summary)
 {
-    return opt ? opt->next : NULL;
-}
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file, **files;
+    sample_item_t *items;
+    sample_summary_t dummy;
+    double total = 0.0, taken = 0.0, u, p, n, z = 1.96;
+    int i, count = 0, num_items = 0, num_files = 0;
+
+    if ( ! summary ) {
+        summary = &dummy;
+    }
+    memset(summary, 0, sizeof(*summary));
+    if ( get_rootfd(product) < 0 ) {
+        fprintf(stderr, "Could not open %s: %s\n", product->info.root, strerror(errno));
+        return -1;
+    }
+    loki_flush_hashes(product);
 
-product_option_t *loki_find_option(product_component_t *comp, const char *name)
-{
-    product_option_t *ret = comp->options;
-    while ( ret ) {
-        if ( !strcmp(ret->name, name) ) {
-            return ret;
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            fill_sizes(opt);
+            for ( file = opt->files; file; file = file->next ) {
+                ++count;
+            }
         }
-        ret = ret->next;
     }
-    return NULL;
+    items = (sample_item_t *)malloc((count+1) * sizeof(sample_item_t));
+    files = (product_file_t **)malloc((count+1) * sizeof(product_file_t *));
+
+    /* Executables and desktop items are always checked, the rest is picked at
+       random with a probability proportional to the size (Efraimidis-Spirakis keys) */
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type != LOKI_FILE_REGULAR ) {
+                    continue;
+                }
+                if ( file->desktop || (file->mode & 0111) ) {
+                    files[num_files++] = file;
+                    summary->bytes += file->size;
+                } else {
+                    u = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+                    items[num_items].file = file;
+                    items[num_items].key = -log(u) / (file->size + 1.0);
+                    total += file->size;
+                    ++num_items;
+                }
+            }
+        }
+    }
+    summary->forced = num_files;
+    summary->forced_problems = run_checks(files, num_files, -1, nthreads, cb, data);
+    if ( budget <= 1.0 ) {
+        budget *= total;
+    }
+    qsort(items, num_items, sizeof(sample_item_t), compare_keys);
+    for ( i = 0; i < num_items && taken < budget; ++i ) {
+        files[summary->sampled++] = items[i].file;
+        taken += items[i].file->size;
+    }
+    free(items);
+    summary->bytes += (size_t)taken;
+    summary->problems = run_checks(files, summary->sampled, -1, nthreads, cb, data);
+    free(files);
+
+    /* Wilson score interval, at 95%. Each file picked at random is a draw weighted
+       by its size, so the fraction of bad draws estimates the fraction of bad bytes
+       (closely while the sample is a small part of the files, as they are picked
+       without replacement). The forced files aren't draws at all. */
+    if ( summary->sampled > 0 ) {
+        n = summary->sampled;
+        p = summary->problems / n;
+        summary->rate = p;
+        summary->upper = (p + z*z/(2*n) + z*sqrt(p*(1-p)/n + z*z/(4*n*n))) / (1 + z*z/n);
+    } else {
+        summary->upper = 1.0;
+    }
+    return summary->forced_problems + summary->problems;
 }
 
-const char *loki_getname_option(product_option_t *opt)
+static void unregister_file(product_file_t *file, product_file_t **opt)
 {
-    return opt->name;
+    /* Remove the file from the list */
+    if ( *opt == file ) {
+        *opt = file->next;
+    } else {
+        product_file_t *f;
+        for(f = *opt; f; f = f->next) {
+            if (f->next == file ) {
+                f->next = file->next;
+                break;
+            }
+        }
+    }
+    delete_file(file);
 }
 
-const char *loki_gettag_option(product_option_t *opt)
+/* Remove a file from the registry. */
+int loki_unregister_path(product_option_t *option, const char *path)
 {
-    return opt->tag;
+    product_file_t *file = find_file_by_name(option,
+                                             loki_remove_root(option->component->product,path));
+    if ( file ) {
+        record_change(option->component->product, LOKI_CHANGE_REMOVE, file->path);
+        unregister_file(file, &option->files);
+        option->component->product->changed |= LOKI_DIRTY_FILES;
+        return 0;
+    }
+    return -1;
 }
 
-size_t loki_getsize_option(product_option_t *opt)
+int loki_unregister_file(product_file_t *file)
 {
-    size_t size = 0;
-    product_file_t *file;
-    struct stat sb;
-
-    for ( file = loki_getfirst_file(opt);
-          file;
-          file = loki_getnext_file(file) ) {
-        if ( stat(loki_getpath_file(file), &sb) == 0 ) {
-            size += sb.st_size;
+    if ( file ) {
+        product_option_t *option = file->option;
+        if ( option ) { /* Does not work for scripts anyway */
+            record_change(option->component->product, LOKI_CHANGE_REMOVE, file->path);
+            unregister_file(file, &option->files);
+            option->component->product->changed |= LOKI_DIRTY_FILES;
+            return 0;
         }
     }
-    return size;
+    return -1;
 }
 
-product_option_t *loki_create_option(product_component_t *component, const char *name, const char *tag)
+typedef struct {
+    product_file_t *file;
+    char *dest;        /* Recorded symlink target */
+    int missing, changed, failed;
+    char md5sum[CHECKSUM_SIZE+1];
+    char fingerprint[CHECKSUM_SIZE+1];
+    char *chunks;
+    struct stat st;
+} refresh_item_t;
+
+static void refresh_item(void *item, void *data)
 {
-    xmlNodePtr node = xmlNewChild(component->node, NULL, BAD_CAST "option", NULL);
-    if ( node ) {
-        product_option_t *ret = (product_option_t *)malloc(sizeof(product_option_t));
-        ret->node = node;
-        ret->component = component;
-        ret->name = strdup(name);
-		ret->tag = tag ? strdup(tag) : NULL;
-        ret->next = component->options;
-        ret->files = NULL;
-        component->options = ret;
-        component->product->changed = 1;
-        xmlSetProp(node, BAD_CAST "name", BAD_CAST name);
-		if ( tag ) {
-			xmlSetProp(node, BAD_CAST "tag", BAD_CAST tag);
-		}
-        return ret;
+    refresh_item_t *it = (refresh_item_t *)item;
+    product_file_t *file = it->file;
+    char buf[PATH_MAX], link[PATH_MAX];
+    const char *path;
+    int dirfd, count;
+
+    path = at_path((product_t *)data, file->path, &dirfd, buf, sizeof(buf));
+    if ( fstatat(dirfd, path, &it->st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+        it->missing = 1;
+        return;
+    }
+    switch ( file->type ) {
+    case LOKI_FILE_REGULAR:
+        if ( !S_ISREG(it->st.st_mode) ) {
+            it->missing = 1;
+        } else if ( file->unsized || file->size != (size_t)it->st.st_size ||
+                    file->mtime != it->st.st_mtime ) {
+            /* Only these get hashed again */
+            if ( md5_compute_at(dirfd, path, it->st.st_size, it->md5sum, it->fingerprint,
+                                wants_chunks((product_t *)data, it->st.st_size) ? &it->chunks : NULL) == 0 ) {
+                it->changed = 1;
+            } else {
+                it->failed = 1;
+            }
+        }
+        break;
+    case LOKI_FILE_SYMLINK:
+        if ( !S_ISLNK(it->st.st_mode) ) {
+            it->missing = 1;
+        } else {
+            count = readlinkat(dirfd, path, link, sizeof(link)-1);
+            if ( count >= 0 ) {
+                link[count] = '\0';
+                if ( !it->dest || strcmp(link, it->dest) ) {
+                    free(it->dest);
+                    it->dest = strdup(link);
+                    it->changed = 1;
+                }
+            } else {
+                it->failed = 1;
+            }
+        }
+        break;
+    default:
+        break;
     }
-    return NULL;
 }
 
-void loki_remove_option(product_option_t *opt)
+static int refresh_files(product_t *product, product_option_t **opts, int num_opts,
+                         int flags, int nthreads, refresh_summary_t *summary)
 {
-    product_file_t *file, *nextfile;
-    product_option_t *c, *prev = NULL;
-    char script[PATH_MAX];
-
-    xmlUnlinkNode(opt->node);
-    xmlFreeNode(opt->node);
-    free(opt->name);
-	if ( opt->tag )
-		free(opt->tag);
+    product_file_t *file, **link;
+    refresh_item_t *items;
+    unsigned char *md5bin;
+    char *str;
+    int i, count = 0;
 
-    file = opt->files;
-    while ( file ) {
-        nextfile = file->next;
-        if ( file->type == LOKI_FILE_SCRIPT ) {
-            snprintf(script, sizeof(script),"%s/.manifest/scripts/%s.sh", 
-                     opt->component->product->info.root, file->path);
-            unlink(script);
+    memset(summary, 0, sizeof(*summary));
+    if ( get_rootfd(product) < 0 ) {
+        fprintf(stderr, "Could not open %s: %s\n", product->info.root, strerror(errno));
+        return -1;
+    }
+    loki_flush_hashes(product);
+    for ( i = 0; i < num_opts; ++i ) {
+        for ( file = opts[i]->files; file; file = file->next ) {
+            ++count;
         }
-        free(file->path);
-        free(file);
-        file = nextfile;
     }
-
-    /* Remove this option from the linked list */
-    for ( c = opt->component->options; c; c = c->next) {
-        if ( c == opt ) {
-            if ( prev ) {
-                prev->next = opt->next;
-            } else {
-                opt->component->options = opt->next;
+    items = (refresh_item_t *)malloc((count+1) * sizeof(refresh_item_t));
+    count = 0;
+    for ( i = 0; i < num_opts; ++i ) {
+        for ( file = opts[i]->files; file; file = file->next ) {
+            if ( file->type == LOKI_FILE_SCRIPT || file->type == LOKI_FILE_RPM ) {
+                continue;
             }
+            items[count].file = file;
+            items[count].dest = NULL;
+            items[count].chunks = NULL;
+            items[count].missing = items[count].changed = items[count].failed = 0;
+            if ( file->type == LOKI_FILE_SYMLINK ) {
+                str = (char *)xmlGetProp(file->node, BAD_CAST "dest");
+                if ( str ) {
+                    items[count].dest = strdup(str);
+                    xmlFree(str);
+                }
+            }
+            ++count;
         }
-        prev = c;
     }
 
-    opt->component->product->changed = 1;
-    free(opt);
+    parallel_run(items, count, sizeof(refresh_item_t), nthreads, refresh_item, product);
+
+    /* Apply the results to the tree from this thread only */
+    summary->checked = count;
+    for ( i = 0; i < count; ++i ) {
+        file = items[i].file;
+        file->removed = 0;
+        summary->failed += items[i].failed;
+        if ( items[i].missing ) {
+            ++summary->missing;
+            file->removed = (flags & LOKI_REFRESH_DROP_MISSING) != 0;
+        } else if ( file->type == LOKI_FILE_REGULAR ) {
+            if ( items[i].changed ) {
+                ++summary->rehashed;
+                xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST items[i].md5sum);
+                md5bin = get_md5_bin(items[i].md5sum);
+                if ( memcmp(file->data.md5sum, md5bin, 16) ) {
+                    memcpy(file->data.md5sum, md5bin, 16);
+                    loki_setpatched_file(file, 1);
+                    ++summary->changed;
+                }
+                set_file_fingerprint(file, items[i].fingerprint);
+                set_file_chunks(file, items[i].chunks);
+            }
+            if ( items[i].changed || file->size != (size_t)items[i].st.st_size ||
+                 file->mtime != items[i].st.st_mtime ) {
+                set_file_size(file, items[i].st.st_size);
+                set_file_mtime(file, items[i].st.st_mtime);
+                product->changed |= LOKI_DIRTY_FILES;
+            }
+        } else if ( file->type == LOKI_FILE_SYMLINK && items[i].changed ) {
+            xmlSetProp(file->node, BAD_CAST "dest", BAD_CAST items[i].dest);
+            loki_setpatched_file(file, 1);
+            ++summary->changed;
+        }
+        free(items[i].dest);
+        free(items[i].chunks);
+    }
+    free(items);
+
+    if ( flags & LOKI_REFRESH_DROP_MISSING ) {
+        for ( i = 0; i < num_opts; ++i ) {
+            link = &opts[i]->files;
+            while ( (file = *link) != NULL ) {
+                if ( file->type != LOKI_FILE_SCRIPT && file->type != LOKI_FILE_RPM && file->removed ) {
+                    record_change(product, LOKI_CHANGE_REMOVE, file->path);
+                    *link = file->next;
+                    delete_file(file);
+                    ++summary->dropped;
+                    product->changed |= LOKI_DIRTY_FILES;
+                } else {
+                    link = &file->next;
+                }
+            }
+        }
+    }
+    return summary->changed;
 }
 
-/* Enumerate files from options */
+int loki_refresh_option(product_option_t *opt, int flags, int nthreads, refresh_summary_t *summary)
+{
+    refresh_summary_t dummy;
 
-product_file_t *loki_getfirst_file(product_option_t *opt)
+    return refresh_files(opt->component->product, &opt, 1, flags, nthreads,
+                         summary ? summary : &dummy);
+}
+
+int loki_refresh_product(product_t *product, int flags, int nthreads, refresh_summary_t *summary)
 {
-    return opt->files;
+    refresh_summary_t dummy;
+    product_component_t *comp;
+    product_option_t *opt, **opts;
+    int num_opts = 0, ret;
+
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            ++num_opts;
+        }
+    }
+    opts = (product_option_t **)malloc((num_opts+1) * sizeof(product_option_t *));
+    num_opts = 0;
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            opts[num_opts++] = opt;
+        }
+    }
+    if ( !summary ) {
+        summary = &dummy;
+    }
+    ret = refresh_files(product, opts, num_opts, flags, nthreads, summary);
+    free(opts);
+    return ret;
 }
 
-product_file_t *loki_getnext_file(product_file_t *file)
+/* Set of the paths registered in a product, relative to its root */
+typedef struct {
+    char **keys;
+    unsigned char *kinds;
+    product_file_t **files;
+    size_t size, count;
+} path_set_t;
+
+#define PATH_REGISTERED 1
+#define PATH_PARENT     2  /* Directory holding registered paths */
+#define PATH_MATCHED    4  /* Found by unregister_matching() */
+
+static size_t path_set_slot(path_set_t *set, const char *path, size_t len)
 {
-    return file ? file->next : NULL;
+    size_t i = hash_path(path, len) & (set->size - 1);
+
+    while ( set->keys[i] && (strncmp(set->keys[i], path, len) || set->keys[i][len]) ) {
+        i = (i + 1) & (set->size - 1);
+    }
+    return i;
 }
 
-static product_file_t *find_file_by_name(product_option_t *opt, const char *path)
+static size_t path_set_add(path_set_t *set, const char *path, size_t len, int kind)
 {
-    product_file_t *file = opt->files;
-    while ( file ) {
-        if ( !strcmp(path, file->path) ) {
-            return file;
+    size_t i;
+
+    if ( (set->count+1) * 2 > set->size ) {
+        path_set_t bigger;
+        size_t j;
+
+        bigger.size = set->size ? set->size * 2 : 1024;
+        bigger.count = set->count;
+        bigger.keys = (char **)calloc(bigger.size, sizeof(char *));
+        bigger.kinds = (unsigned char *)calloc(bigger.size, 1);
+        bigger.files = (product_file_t **)calloc(bigger.size, sizeof(product_file_t *));
+        for ( j = 0; j < set->size; ++j ) {
+            if ( set->keys[j] ) {
+                i = path_set_slot(&bigger, set->keys[j], strlen(set->keys[j]));
+                bigger.keys[i] = set->keys[j];
+                bigger.kinds[i] = set->kinds[j];
+                bigger.files[i] = set->files[j];
+            }
         }
-        file = file->next;
+        free(set->keys);
+        free(set->kinds);
+        free(set->files);
+        *set = bigger;
     }
-    return NULL;
+    i = path_set_slot(set, path, len);
+    if ( !set->keys[i] ) {
+        set->keys[i] = (char *)malloc(len+1);
+        memcpy(set->keys[i], path, len);
+        set->keys[i][len] = '\0';
+        ++set->count;
+    }
+    set->kinds[i] |= kind;
+    return i;
 }
 
-/* Get informations from a file */
-file_type_t loki_gettype_file(product_file_t *file)
+static int path_set_find(path_set_t *set, const char *path)
 {
-    return file->type;
+    size_t i;
+
+    if ( !set->size ) {
+        return 0;
+    }
+    i = path_set_slot(set, path, strlen(path));
+    return set->keys[i] ? set->kinds[i] : 0;
 }
 
-/* This returns the expanded full path of the file if applicable */
-const char *loki_getpath_file(product_file_t *file)
+static product_file_t *path_set_file(path_set_t *set, const char *path)
 {
-    if ( file->type == LOKI_FILE_RPM || file->type == LOKI_FILE_SCRIPT ) {
-        return file->path;
-    } else {
-        static char buf[PATH_MAX]; /* FIXME: Evil static buffer */
-        expand_path(file->option->component->product, file->path, buf, sizeof(buf));
-        return buf;
+    size_t i;
+
+    if ( !set->size ) {
+        return NULL;
     }
+    i = path_set_slot(set, path, strlen(path));
+    return set->keys[i] ? set->files[i] : NULL;
 }
 
-unsigned int loki_getmode_file(product_file_t *file)
+static void path_set_free(path_set_t *set)
 {
-    return file->mode;
+    size_t i;
+
+    for ( i = 0; i < set->size; ++i ) {
+        free(set->keys[i]);
+    }
+    free(set->keys);
+    free(set->kinds);
+    free(set->files);
 }
 
-/* Set the UNIX mode for the file */
-void loki_setmode_file(product_file_t *file, unsigned int mode)
+/* Add the registered paths under the root, and all their parent directories */
+static void build_path_set(product_t *product, path_set_t *set)
 {
-    char buf[20];
-    file->mode = mode;
-    snprintf(buf, sizeof(buf), "%04o", mode);
-    xmlSetProp(file->node, BAD_CAST "mode", BAD_CAST buf);
-    file->option->component->product->changed = 1;
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file;
+    const char *path;
+    size_t len;
+
+    memset(set, 0, sizeof(*set));
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type == LOKI_FILE_SCRIPT || file->type == LOKI_FILE_RPM ) {
+                    continue;
+                }
+                path = loki_remove_root(product, file->path);
+                if ( *path == '/' ) {
+                    continue; /* Outside of the root */
+                }
+                len = strlen(path);
+                while ( len > 0 && path[len-1] == '/' ) {
+                    --len;
+                }
+                if ( len == 0 ) {
+                    continue;
+                }
+                path_set_add(set, path, len, PATH_REGISTERED);
+                while ( len > 0 ) {
+                    while ( len > 0 && path[len-1] != '/' ) {
+                        --len;
+                    }
+                    while ( len > 0 && path[len-1] == '/' ) {
+                        --len;
+                    }
+                    if ( len > 0 ) {
+                        path_set_add(set, path, len, PATH_PARENT);
+                    }
+                }
+            }
+        }
+    }
 }
 
-const char *loki_get_secontext_file(product_file_t *file)
+/* Directories waiting to be read by the workers */
+typedef struct _walk_dir_t {
+    char *path;
+    struct _walk_dir_t *next;
+} walk_dir_t;
+
+typedef struct _walk_job_t walk_job_t;
+
+/* Called for each directory entry, returns non-zero to go into directories.
+   'path' is relative to the root of the product, unless it is absolute. */
+typedef int (*walk_func)(walk_job_t *job, const char *path, file_type_t type);
+
+struct _walk_job_t {
+    product_t *product;
+    walk_func visit;
+    void *data;
+    walk_dir_t *queue;
+    int busy;
+    pthread_mutex_t lock; /* Also available to serialize the visitors */
+    pthread_cond_t cond;
+};
+
+static void push_walk_dir(walk_job_t *job, const char *path)
 {
-#ifdef __linux
-	return file->se_context;
-#else
-	return NULL;
-#endif
+    walk_dir_t *dir = (walk_dir_t *)malloc(sizeof(walk_dir_t));
+
+    dir->path = strdup(path);
+    pthread_mutex_lock(&job->lock);
+    dir->next = job->queue;
+    job->queue = dir;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
 }
 
-void loki_set_secontext_file(product_file_t *file, const char *context)
+static void walk_dir(walk_job_t *job, const char *path)
 {
-#ifdef __linux
-	file->se_context = strdup(context);
-    xmlSetProp(file->node, BAD_CAST "secontext", BAD_CAST context);
-    file->option->component->product->changed = 1;
+    char sub[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    file_type_t type;
+    DIR *dir;
+    int fd;
+
+    /* Paths are relative to the root, unless they are absolute */
+    fd = openat(job->product->rootfd, *path ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( fd < 0 || !(dir = fdopendir(fd)) ) {
+        if ( fd >= 0 ) {
+            close(fd);
+        }
+        fprintf(stderr, "Could not read directory %s: %s\n", *path ? path : job->product->info.root,
+                strerror(errno));
+        return;
+    }
+    while ( (entry = readdir(dir)) != NULL ) {
+        if ( !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+             (!*path && !strcmp(entry->d_name, ".manifest")) ) {
+            continue;
+        }
+        if ( *path ) {
+            snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+        } else {
+            snprintf(sub, sizeof(sub), "%s", entry->d_name);
+        }
+        type = LOKI_FILE_NONE;
+#ifdef DT_DIR
+        switch ( entry->d_type ) {
+        case DT_REG:  type = LOKI_FILE_REGULAR; break;
+        case DT_DIR:  type = LOKI_FILE_DIRECTORY; break;
+        case DT_LNK:  type = LOKI_FILE_SYMLINK; break;
+        case DT_FIFO: type = LOKI_FILE_FIFO; break;
+        case DT_SOCK: type = LOKI_FILE_SOCKET; break;
+        case DT_BLK:
+        case DT_CHR:  type = LOKI_FILE_DEVICE; break;
+        default:      break;
+        }
 #endif
+        if ( type == LOKI_FILE_NONE && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 ) {
+            type = stat_type(st.st_mode);
+        }
+        if ( job->visit(job, sub, type) && type == LOKI_FILE_DIRECTORY ) {
+            push_walk_dir(job, sub);
+        }
+    }
+    closedir(dir);
 }
 
-/* Get / set the 'patched' attribute of a flag, i.e. it should not be removed unless
-   the whole application is removed */
-int loki_getpatched_file(product_file_t *file)
+static void *walk_worker(void *data)
 {
-    return file->patched;
-}
+    walk_job_t *job = (walk_job_t *)data;
+    walk_dir_t *dir;
 
-void loki_setpatched_file(product_file_t *file, int flag)
-{
-    file->patched = flag;
-    xmlSetProp(file->node, BAD_CAST "patched", flag ? BAD_CAST "yes" : BAD_CAST "no");
-    file->option->component->product->changed = 1;
+    pthread_mutex_lock(&job->lock);
+    for ( ;; ) {
+        while ( !job->queue && job->busy > 0 ) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if ( !job->queue ) {
+            break;
+        }
+        dir = job->queue;
+        job->queue = dir->next;
+        ++job->busy;
+        pthread_mutex_unlock(&job->lock);
+
+        walk_dir(job, dir->path);
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&job->lock);
+        if ( --job->busy == 0 && !job->queue ) {
+            /* All done, wake up the others */
+            pthread_cond_broadcast(&job->cond);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
 }
 
-int loki_getmutable_file(product_file_t *file)
+/* Walk a directory tree with up to 'nthreads' threads. The .manifest directory
+   at the top of the root is always skipped. */
+static int walk_tree(product_t *product, const char *path, int nthreads,
+                     walk_func visit, void *data)
 {
-	return file->mutable;
+    walk_job_t job;
+    pthread_t *threads;
+    int i, started = 0;
+
+    if ( get_rootfd(product) < 0 ) {
+        fprintf(stderr, "Could not open %s: %s\n", product->info.root, strerror(errno));
+        return -1;
+    }
+    job.product = product;
+    job.visit = visit;
+    job.data = data;
+    job.queue = NULL;
+    job.busy = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    push_walk_dir(&job, path);
+
+    if ( nthreads <= 0 ) {
+        nthreads = parallel_cpus();
+    }
+    threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    for ( i = 0; i < nthreads-1; ++i ) {
+        if ( pthread_create(&threads[started], NULL, walk_worker, &job) == 0 ) {
+            ++started;
+        }
+    }
+    walk_worker(&job);
+    for ( i = 0; i < started; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    return 0;
 }
 
-void loki_setmutable_file(product_file_t *file, int flag)
+typedef struct {
+    path_set_t set;
+    orphan_cb cb;
+    int count;
+} orphan_scan_t;
+
+static int visit_orphan(walk_job_t *job, const char *path, file_type_t type)
 {
-    file->mutable = flag;
-    xmlSetProp(file->node, BAD_CAST "mutable", flag ? BAD_CAST "yes" : BAD_CAST "no");
-    file->option->component->product->changed = 1;
+    orphan_scan_t *scan = (orphan_scan_t *)job->data;
+    char full[PATH_MAX];
+    int kind = path_set_find(&scan->set, path);
+    int len;
+
+    /* Directories are not always registered, only the files in them */
+    if ( (kind & PATH_REGISTERED) ||
+         ((kind & PATH_PARENT) && type == LOKI_FILE_DIRECTORY) ) {
+        return kind != 0;
+    }
+    /* Nothing registered in there, no need to look inside directories */
+    len = snprintf(full, sizeof(full), "%s/%s", job->product->info.root, path);
+    if ( len < 0 || len >= (int)sizeof(full) ) {
+        fprintf(stderr, "Path too long: %s/%s\n", job->product->info.root, path);
+        return 0;
+    }
+    pthread_mutex_lock(&job->lock);
+    ++scan->count;
+    if ( scan->cb ) {
+        scan->cb(full, type);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return 0;
 }
 
-product_option_t *loki_getoption_file(product_file_t *file)
+int loki_scan_orphans(product_t *product, int nthreads, orphan_cb cb)
 {
-    return file->option;
+    orphan_scan_t scan;
+    int ret;
+
+    build_path_set(product, &scan.set);
+    scan.cb = cb;
+    scan.count = 0;
+    ret = walk_tree(product, "", nthreads, visit_orphan, &scan);
+    path_set_free(&scan.set);
+    return (ret < 0) ? ret : scan.count;
 }
 
-product_component_t *loki_getcomponent_file(product_file_t *file)
+/* Entries found by loki_register_tree() */
+typedef struct {
+    char *path;
+    struct stat st;
+    int hashed;
+    char md5sum[CHECKSUM_SIZE+1];
+    char fingerprint[CHECKSUM_SIZE+1];
+    char *chunks;
+} tree_entry_t;
+
+typedef struct {
+    product_t *product;
+    tree_entry_t *entries;
+    int num, max;
+    register_filter_cb filter;
+} tree_scan_t;
+
+static void add_tree_entry(tree_scan_t *scan, const char *path, const struct stat *st)
 {
-    return file->option->component;
+    if ( scan->num == scan->max ) {
+        scan->max = scan->max ? scan->max * 2 : 1024;
+        scan->entries = (tree_entry_t *)realloc(scan->entries, scan->max * sizeof(tree_entry_t));
+    }
+    scan->entries[scan->num].path = strdup(path);
+    scan->entries[scan->num].st = *st;
+    scan->entries[scan->num].hashed = 0;
+    scan->entries[scan->num].fingerprint[0] = '\0';
+    scan->entries[scan->num].chunks = NULL;
+    ++scan->num;
 }
 
-product_t *loki_getproduct_file(product_file_t *file)
+static int visit_tree(walk_job_t *job, const char *path, file_type_t type)
 {
-    return file->option->component->product;
+    tree_scan_t *scan = (tree_scan_t *)job->data;
+    struct stat st;
+    int keep;
+
+    if ( fstatat(job->product->rootfd, path, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+        return 0;
+    }
+    type = stat_type(st.st_mode);
+    if ( type == LOKI_FILE_SOCKET || type == LOKI_FILE_NONE ) {
+        return 0; /* Can't be registered */
+    }
+    pthread_mutex_lock(&job->lock);
+    keep = !scan->filter || scan->filter(path, type);
+    if ( keep ) {
+        add_tree_entry(scan, path, &st);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return keep;
 }
 
-unsigned char *loki_getmd5_file(product_file_t *file)
+static int compare_tree_entries(const void *a, const void *b)
 {
-    return file->type==LOKI_FILE_REGULAR ? file->data.md5sum : NULL;
+    return strcmp(((const tree_entry_t *)a)->path, ((const tree_entry_t *)b)->path);
 }
 
-/* Enumerate all files of an option through a callback function */
-int loki_enumerate_files(product_option_t *opt, product_file_cb cb)
+static void hash_tree_entry(void *item, void *data)
 {
+    tree_entry_t *entry = (tree_entry_t *)item;
     char buf[PATH_MAX];
-    int count = 0;
-    product_file_t *file = opt->files;
-
-    while ( file ) {
-        if ( file->type == LOKI_FILE_RPM || file->type == LOKI_FILE_SCRIPT ) {
-            strncpy(buf, file->path, sizeof(buf));
-        } else {
-            expand_path(opt->component->product, file->path, buf, sizeof(buf));
-        }
-        cb(buf, file->type, opt->component, opt);
-        count ++;
-        file = file->next;
+    const char *path;
+    int dirfd;
+
+    if ( S_ISREG(entry->st.st_mode) ) {
+        path = at_path((product_t *)data, entry->path, &dirfd, buf, sizeof(buf));
+        entry->hashed = (md5_compute_at(dirfd, path, entry->st.st_size, entry->md5sum,
+                                          entry->fingerprint,
+                                          wants_chunks((product_t *)data, entry->st.st_size) ?
+                                          &entry->chunks : NULL) == 0);
     }
-    return count;
 }
 
-product_file_t *loki_findpath(const char *path, product_t *product)
+/* Map the paths of the product to the files registering them */
+static void build_file_map(product_t *product, path_set_t *set)
 {
-    if ( product ) {
-        product_component_t *comp;
-        product_option_t *opt;
-        product_file_t *file;
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file;
+    size_t i;
 
-        for( comp = product->components; comp; comp = comp->next ) {
-            for( opt = comp->options; opt; opt = opt->next ) {
-                for( file = opt->files; file; file = file->next ) {
-                    if ( file->type!=LOKI_FILE_SCRIPT && file->type!=LOKI_FILE_RPM ) {
-                        if ( ! strcmp(loki_remove_root(product, path), file->path) ) {
-                            /* We found our match */
-                            return file;
-                        }
-                    }
+    memset(set, 0, sizeof(*set));
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( file = opt->files; file; file = file->next ) {
+                if ( file->type != LOKI_FILE_SCRIPT && file->type != LOKI_FILE_RPM ) {
+                    i = path_set_add(set, file->path, strlen(file->path), PATH_REGISTERED);
+                    set->files[i] = file;
                 }
             }
         }
-    } else {
-        /* TODO: Try for each available product */
     }
-    return NULL;
 }
 
-static product_file_t *registerfile_new(product_option_t *option, const char *path, const char *md5)
+/* Register a batch of entries in the option, and free their paths. The entries are
+   appended in the order given, or update what the option already has. */
+static int register_entries(product_option_t *option, tree_entry_t *entries, int num,
+                            int skip_dirs)
 {
-    struct stat st;
-    char dev[10];
-    char full[PATH_MAX];
-    product_file_t *file;
+    product_file_t *file, **link;
+    path_set_t registered;
+    tree_entry_t *entry;
+    size_t j;
+    int i, count = 0;
 
-    expand_path(option->component->product, path, full, sizeof(full));
-    if ( lstat(full, &st) < 0 ) {
-        return NULL;
-    }
-    file = (product_file_t *)malloc(sizeof(product_file_t));
-    file->path = strdup(path);
-#ifdef __linux
-	file->se_context = NULL;
-#endif
-	file->desktop = NULL;
-    memset(file->data.md5sum, 0, 16);
-    if ( S_ISREG(st.st_mode) ) {
-        file->type = LOKI_FILE_REGULAR;
-        if ( md5 ) {
-            file->node = xmlNewChild(option->node, NULL, BAD_CAST "file", BAD_CAST substitute_xml_string(path));
-            xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5);
-            memcpy(file->data.md5sum, get_md5_bin(md5), 16);
-        } else {
-            char md5sum[33];
-            if ( *path == '/' ) {
-                md5_compute(path, md5sum, 1);
+    /* Where the files are registered so far, so that moving them is cheap */
+    build_file_map(option->component->product, &registered);
+    for ( link = &option->files; *link; link = &(*link)->next )
+        ;
+
+    for ( i = 0; i < num; ++i ) {
+        entry = &entries[i];
+        if ( !S_ISDIR(entry->st.st_mode) || !skip_dirs ) {
+            file = path_set_file(&registered, entry->path);
+            if ( file && file->option == option ) {
+                file = registerfile_update(option, file, entry->hashed ? entry->md5sum : NULL);
             } else {
-                char fpath[PATH_MAX];
-                snprintf(fpath, sizeof(fpath), "%s/%s", option->component->product->info.root, path);
-                md5_compute(fpath, md5sum, 1);
+                if ( file ) {
+                    loki_unregister_file(file);
+                }
+                file = registerfile_stat(option, entry->path, entry->hashed ? entry->md5sum : NULL,
+                                         &entry->st, &link);
+                if ( file ) {
+                    /* The same path may come up again */
+                    j = path_set_add(&registered, file->path, strlen(file->path), PATH_REGISTERED);
+                    registered.files[j] = file;
+                }
+            }
+            if ( file ) {
+                if ( file->type == LOKI_FILE_REGULAR && entry->hashed &&
+                     (set_file_fingerprint(file, entry->fingerprint) |
+                      set_file_chunks(file, entry->chunks)) ) {
+                    option->component->product->changed |= LOKI_DIRTY_FILES;
+                }
+                ++count;
             }
-            file->node = xmlNewChild(option->node, NULL, BAD_CAST "file", BAD_CAST substitute_xml_string(path));
-            xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5sum);
-            memcpy(file->data.md5sum, get_md5_bin(md5sum), 16);
-        }
-    } else if ( S_ISDIR(st.st_mode) ) {
-        file->type = LOKI_FILE_DIRECTORY;
-        file->node = xmlNewChild(option->node, NULL, BAD_CAST "directory", BAD_CAST substitute_xml_string(path));
-    } else if ( S_ISLNK(st.st_mode) ) {
-        char buf[PATH_MAX];
-        int count;
-
-        file->type = LOKI_FILE_SYMLINK;
-        file->node = xmlNewChild(option->node, NULL, BAD_CAST "symlink", BAD_CAST substitute_xml_string(path));
-        count = readlink(full, buf, sizeof(buf));
-        if ( count < 0 ) {
-            fprintf(stderr, "readlink: Could not find symbolic link %s\n", full);
-        } else {
-            buf[count] = '\0';
-            xmlSetProp(file->node, BAD_CAST "dest", BAD_CAST buf);
         }
-    } else if ( S_ISFIFO(st.st_mode) ) {
-        file->type = LOKI_FILE_FIFO;
-        file->node = xmlNewChild(option->node, NULL, BAD_CAST "fifo", BAD_CAST substitute_xml_string(path));
-    } else if ( S_ISBLK(st.st_mode) ) {
-        file->type = LOKI_FILE_DEVICE;
-        file->node = xmlNewChild(option->node, NULL, BAD_CAST "device", BAD_CAST substitute_xml_string(path));
-        xmlSetProp(file->node, BAD_CAST "type", BAD_CAST "block");
-        /* Get the major/minor device number info */
-        snprintf(dev,sizeof(dev),"%d", major(st.st_rdev));
-        xmlSetProp(file->node, BAD_CAST "major", BAD_CAST dev);
-        snprintf(dev,sizeof(dev),"%d", minor(st.st_rdev));
-        xmlSetProp(file->node, BAD_CAST "minor", BAD_CAST dev);
-    } else if ( S_ISCHR(st.st_mode) ) {
-        file->type = LOKI_FILE_DEVICE;
-        file->node = xmlNewChild(option->node, NULL, BAD_CAST "device", BAD_CAST substitute_xml_string(path));
-        xmlSetProp(file->node, BAD_CAST "type", BAD_CAST "char");
-        /* Get the major/minor device number info */
-        snprintf(dev,sizeof(dev),"%d", major(st.st_rdev));
-        xmlSetProp(file->node, BAD_CAST "major", BAD_CAST dev);
-        snprintf(dev,sizeof(dev),"%d", minor(st.st_rdev));
-        xmlSetProp(file->node, BAD_CAST "minor", BAD_CAST dev);
-    } else {
-        file->node = NULL;
-        file->type = LOKI_FILE_NONE;
-        /* TODO: Warning? */
-        return NULL;
+        free(entry->path);
+        free(entry->chunks);
     }
-    file->patched = 0;
-	/* Get the actual mode from the file */
-    file->mode = (st.st_mode & 07777);
-	snprintf(dev, sizeof(dev), "%04o", file->mode);
-    xmlSetProp(file->node, BAD_CAST "mode", BAD_CAST dev);
-    file->option = option;
-    insert_end_file(file, &option->files);
-
-    option->component->product->changed = 1;
-    return file;
+    path_set_free(&registered);
+    return count;
 }
 
-static product_file_t *registerfile_update(product_option_t *option, product_file_t *file,
-                                           const char *md5)
+int loki_register_tree(product_option_t *option, const char *dir, register_filter_cb filter,
+                       int flags, int nthreads)
 {
-    char buf[PATH_MAX];
-    int count;
-    unsigned char *md5bin;
+    product_t *product = option->component->product;
+    char top[PATH_MAX], buf[PATH_MAX];
+    const char *path;
+    tree_scan_t scan;
+    struct stat st;
+    int dirfd, count;
+
+    snprintf(top, sizeof(top), "%s", loki_remove_root(product, dir));
+    loki_trim_slashes(top);
+    path = at_path(product, top, &dirfd, buf, sizeof(buf));
+    if ( fstatat(dirfd, path, &st, 0) < 0 || !S_ISDIR(st.st_mode) ) {
+        fprintf(stderr, "%s is not a directory\n", dir);
+        return -1;
+    }
 
-    switch(file->type) {
-    case LOKI_FILE_REGULAR:
-        /* Compare MD5 checksums; if different then the 'patched' attribute is set automatically */
-        if ( md5 ) {
-            md5bin = get_md5_bin(md5);
-            xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5);
-            if ( memcmp(file->data.md5sum, md5bin, 16) ) {
-                loki_setpatched_file(file, 1);
-            }
-            memcpy(file->data.md5sum, md5bin, 16);
-        } else {
-            char md5sum[33];
-            if ( *file->path == '/' ) {
-                md5_compute(file->path, md5sum, 1);
-            } else {
-                snprintf(buf, sizeof(buf), "%s/%s", option->component->product->info.root, file->path);
-                md5_compute(buf, md5sum, 1);
-            }
-            xmlSetProp(file->node, BAD_CAST "md5", BAD_CAST md5sum);
-            md5bin = get_md5_bin(md5sum);
-            if ( memcmp(file->data.md5sum, md5bin, 16) ) {
-                loki_setpatched_file(file, 1);
-            }
-            memcpy(file->data.md5sum, md5bin, 16);
-        }
-        option->component->product->changed = 1;
-        break;
-    case LOKI_FILE_SYMLINK:
-        if ( *file->path == '/' ) {
-            count = readlink(file->path, buf, sizeof(buf));
-            if ( count < 0 ) {
-                fprintf(stderr, "Couldn't read link: %s\n", file->path);
-            }
-        } else {
-            char path[PATH_MAX];
-            snprintf(path, sizeof(path), "%s/%s", option->component->product->info.root, file->path);
-            count = readlink(path, buf, sizeof(buf));
-            if ( count < 0 ) {
-                fprintf(stderr, "Couldn't read link: %s\n", path);
-            }
+    scan.product = product;
+    scan.entries = NULL;
+    scan.num = scan.max = 0;
+    scan.filter = filter;
+    if ( *top ) {
+        if ( filter && !filter(top, LOKI_FILE_DIRECTORY) ) {
+            return 0;
         }
-        if ( count >= 0 ) {
-            buf[count] = '\0';
-            xmlSetProp(file->node, BAD_CAST "dest", BAD_CAST buf);
-        }   
-        option->component->product->changed = 1;
-        break;
-
-    case LOKI_FILE_DIRECTORY:
-    case LOKI_FILE_DEVICE:
-    case LOKI_FILE_SOCKET:
-    case LOKI_FILE_FIFO:
-    case LOKI_FILE_RPM:
-    case LOKI_FILE_SCRIPT:
-    case LOKI_FILE_NONE:
-        /* We don't need to update the MD5 checksums of these elements */
-        break;
+        add_tree_entry(&scan, top, &st);
+    }
+    if ( walk_tree(product, top, nthreads, visit_tree, &scan) < 0 ) {
+        return -1;
     }
-    return file;
-}
 
-/* Register a file, returns 0 if OK */
-product_file_t *loki_register_file(product_option_t *option, const char *path, const char *md5)
-{
-    const char *nrpath = loki_remove_root(option->component->product, path);
-    product_file_t *file;
+    /* Manifests don't depend on the order the threads found the files in */
+    qsort(scan.entries, scan.num, sizeof(tree_entry_t), compare_tree_entries);
+    parallel_run(scan.entries, scan.num, sizeof(tree_entry_t), nthreads, hash_tree_entry, product);
 
-	if ( ! *nrpath )  /* Trying to register the root path */
-		return NULL;
+    count = register_entries(option, scan.entries, scan.num, flags & LOKI_REGISTER_SKIP_DIRS);
+    free(scan.entries);
+    return count;
+}
 
-    /* Check if this file is already registered for this option */
-    file = find_file_by_name(option, nrpath);
-    if ( file ) {
-        return registerfile_update(option, file, md5);
-    } else {
-        file = loki_findpath(path, option->component->product);
-        if ( file ) {
-            loki_unregister_file(file);
+/* Check a few of the imported checksums against the files, picked at random */
+static int spot_check(product_t *product, tree_entry_t *entries, int num)
+{
+    char buf[PATH_MAX], md5sum[CHECKSUM_SIZE+1];
+    const char *path;
+    unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    tree_entry_t *entry;
+    int *regular, i, j, n, count = 0, dirfd, failed = 0;
+
+    /* Only regular files have a checksum to check */
+    regular = (int *)malloc((num + 1) * sizeof(int));
+    if ( !regular ) {
+        return -1;
+    }
+    for ( i = 0; i < num; ++i ) {
+        if ( S_ISREG(entries[i].st.st_mode) ) {
+            regular[count++] = i;
+        }
+    }
+    n = count / 100;
+    if ( n < 8 ) {
+        n = 8;
+    }
+    if ( n > count ) {
+        n = count;
+    }
+    /* Draw distinct files, by shuffling the first ones in place */
+    for ( j = 0; j < n; ++j ) {
+        i = j + rand_r(&seed) % (count - j);
+        entry = &entries[regular[i]];
+        regular[i] = regular[j];
+        path = at_path(product, entry->path, &dirfd, buf, sizeof(buf));
+        /* A file that can't be read doesn't match its checksum either */
+        if ( md5_compute_at(dirfd, path, -1, md5sum, NULL, NULL) < 0 ||
+             strcmp(md5sum, entry->md5sum) ) {
+            fprintf(stderr, "Checksum mismatch for %s\n", entry->path);
+            ++failed;
         }
-        return registerfile_new(option, nrpath, md5);
     }
+    free(regular);
+    return failed ? -1 : 0;
 }
 
-/* Indicate that a file is a desktop item for a binary */
-int loki_setdesktop_file(product_file_t *file, const char *binary)
+int loki_import_checksums(product_option_t *option, const char *listfile, int flags)
 {
-	if ( file && binary ) {
-		if ( file->desktop )
-			free(file->desktop);
-		file->desktop = strdup(binary);
-		xmlSetProp(file->node, BAD_CAST "desktop", BAD_CAST binary);
-		file->option->component->product->changed = 1;
-		return 1;
-	}
-	return 0;
+    product_t *product = option->component->product;
+    char line[PATH_MAX + CHECKSUM_SIZE + 8], buf[PATH_MAX];
+    char *csum, *file;
+    const char *path;
+    tree_scan_t scan;
+    struct stat st;
+    FILE *fp;
+    int i, dirfd, len, count;
+
+    fp = strcmp(listfile, "-") ? fopen(listfile, "r") : stdin;
+    if ( ! fp ) {
+        perror(listfile);
+        return -1;
+    }
+    memset(&scan, 0, sizeof(scan));
+    while ( fgets(line, sizeof(line), fp) ) {
+        len = strlen(line);
+        while ( len > 0 && (line[len-1] == '\n' || line[len-1] == '\r') ) {
+            line[--len] = '\0';
+        }
+        if ( ! *line ) {
+            continue;
+        }
+        /* Same format as md5sum: checksum, spaces, and a '*' for binary mode */
+        csum = line;
+        for ( file = csum; *file && !isspace((unsigned char)*file); ++file )
+            ;
+        if ( (file - csum) != CHECKSUM_SIZE || ! *file ) {
+            fprintf(stderr, "Malformed line: %s\n", line);
+            continue;
+        }
+        *file++ = '\0';
+        while ( isspace((unsigned char)*file) ) {
+            ++file;
+        }
+        if ( *file == '*' ) {
+            ++file;
+        }
+        for ( i = 0; i < CHECKSUM_SIZE && isxdigit((unsigned char)csum[i]); ++i ) {
+            csum[i] = tolower((unsigned char)csum[i]);
+        }
+        if ( i != CHECKSUM_SIZE || ! *file ) {
+            fprintf(stderr, "Malformed line: %s\n", line);
+            continue;
+        }
+
+        /* Only the metadata comes from the file itself */
+        file = (char *)loki_remove_root(product, file);
+        path = at_path(product, file, &dirfd, buf, sizeof(buf));
+        if ( fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+            perror(file);
+            continue;
+        }
+        add_tree_entry(&scan, file, &st);
+        memcpy(scan.entries[scan.num-1].md5sum, csum, CHECKSUM_SIZE+1);
+        scan.entries[scan.num-1].hashed = S_ISREG(st.st_mode);
+    }
+    if ( fp != stdin ) {
+        fclose(fp);
+    }
+
+    if ( (flags & LOKI_IMPORT_VERIFY) && spot_check(product, scan.entries, scan.num) < 0 ) {
+        fprintf(stderr, "%s doesn't match the installed files, nothing imported\n", listfile);
+        for ( i = 0; i < scan.num; ++i ) {
+            free(scan.entries[i].path);
+        }
+        free(scan.entries);
+        return -1;
+    }
+    count = register_entries(option, scan.entries, scan.num, 0);
+    free(scan.entries);
+    return count;
 }
 
-/* Test whether a file is a desktop item, optionally if it matches a binary */
-int loki_isdesktop_file(product_file_t *file, const char *binary)
+/* Nodes of a fragment that register a path */
+static int is_path_node(xmlNodePtr node)
 {
-	if ( file ) {
-		if ( binary ) {
-			return file->desktop && !strcmp(file->desktop, binary);
-		} else {
-			return file->desktop != NULL;
-		}
-	}
-	return 0;
+    return node->type == XML_ELEMENT_NODE && XML_CHILDREN(node) &&
+           strcmp((char *)node->name, "script") && strcmp((char *)node->name, "rpm");
 }
 
-/* Check a file against its MD5 checksum, for integrity */
-file_check_t loki_check_file(product_file_t *file)
+product_component_t *loki_merge_component(product_t *product, const char *fragment,
+                                          merge_policy_t policy)
 {
-	char path[PATH_MAX];
-	char md5sum[33];
-	char *str;
-	struct stat st;
-	file_check_t ret = LOKI_OK;
-
-	expand_path(file->option->component->product, file->path, path, sizeof(path));
+    xmlDocPtr doc;
+    xmlNodePtr root, node, optnode, filenode, next;
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file;
+    path_set_t registered;
+    xmlChar *path;
+    char *name;
+    size_t i;
+    int conflicts = 0;
 
-    switch(file->type) {
-    case LOKI_FILE_REGULAR:
-		if ( access(path, F_OK) < 0 )
-			return LOKI_REMOVED;
-		if ( file->mutable )
-			return LOKI_OK;
+    doc = xmlParseFile(fragment);
+    if ( ! doc ) {
+        fprintf(stderr, "Unable to parse %s\n", fragment);
+        return NULL;
+    }
+    root = XML_ROOT(doc);
+    if ( ! root || strcmp((char *)root->name, "component") ) {
+        fprintf(stderr, "%s is not a component\n", fragment);
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+    name = (char *)xmlGetProp(root, BAD_CAST "name");
+    if ( ! name || loki_find_component(product, name) ) {
+        fprintf(stderr, "Component %s already exists in %s\n", name ? name : "(null)",
+                product->info.name);
+        xmlFree(name);
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+    xmlFree(name);
+
+    /* A single pass over the fragment, against a hash of the paths of the product.
+       Failing leaves everything untouched, as nothing is changed for that policy. */
+    build_file_map(product, &registered);
+    for ( optnode = XML_CHILDREN(root); registered.size && optnode; optnode = optnode->next ) {
+        if ( optnode->type != XML_ELEMENT_NODE || strcmp((char *)optnode->name, "option") ) {
+            continue;
+        }
+        for ( filenode = XML_CHILDREN(optnode); filenode; filenode = next ) {
+            next = filenode->next;
+            if ( ! is_path_node(filenode) ) {
+                continue;
+            }
+            path = xmlNodeListGetString(doc, XML_CHILDREN(filenode), 1);
+            i = path_set_slot(&registered, (char *)path, strlen((char *)path));
+            if ( registered.keys[i] ) {
+                ++conflicts;
+                switch (policy) {
+                case LOKI_MERGE_MOVE:
+                    if ( registered.files[i] ) {
+                        loki_unregister_file(registered.files[i]);
+                        registered.files[i] = NULL;
+                    }
+                    break;
+                case LOKI_MERGE_SKIP:
+                    xmlUnlinkNode(filenode);
+                    xmlFreeNode(filenode);
+                    break;
+                case LOKI_MERGE_FAIL:
+                    fprintf(stderr, "%s is already registered\n", (char *)path);
+                    break;
+                }
+            }
+            xmlFree(path);
+        }
+    }
+    path_set_free(&registered);
+    if ( conflicts && policy == LOKI_MERGE_FAIL ) {
+        xmlFreeDoc(doc);
+        return NULL;
+    }
 
-		/* Compare MD5 checksums if file exists */
-		md5_compute(path, md5sum, 1);
-		str = (char *)xmlGetProp(file->node, BAD_CAST "md5");
-		if ( str && strncmp(md5sum, str, CHECKSUM_SIZE) ) {
-			ret = LOKI_CHANGED;
-		}
-		xmlFree(str);
-		break;
-    case LOKI_FILE_SYMLINK:
-		if ( lstat(path, &st) < 0 )
-			return LOKI_REMOVED;
-		if ( file->mutable )
-			return LOKI_OK;
-		/*  Compare symlinks contents */
-		str = (char *)xmlGetProp(file->node, BAD_CAST "dest");
-		if ( str ) {
-			char buf[PATH_MAX];
-			int count;
+    /* There can only be one default component */
+    if ( product->default_comp ) {
+        xmlUnsetProp(root, BAD_CAST "default");
+    }
+    node = XML_COPY_NODE(root, product->doc);
+    xmlAddChild(XML_ROOT(product->doc), node);
+    xmlFreeDoc(doc);
 
-			count = readlink(path, buf, sizeof(buf));
-			if ( count < 0 ) {
-				xmlFree(str);
-				return LOKI_CHANGED;
-			} else {
-				buf[count] = '\0';
-			}
-			if ( strcmp(buf, str) )
-				ret = LOKI_CHANGED;
-			xmlFree(str);
-		}
-		break;
-    case LOKI_FILE_DEVICE:
-		if ( stat(path, &st) < 0 )
-			return LOKI_REMOVED;
-		/* Check that device has the same characteristics */
-		str = (char *)xmlGetProp(file->node, BAD_CAST "type");
-		if ( str ) {
-			if ( !strcmp(str, "block") && !S_ISBLK(st.st_mode) ) {
-				ret =  LOKI_CHANGED;
-			} else if ( !strcmp(str, "char") && !S_ISCHR(st.st_mode) ) {
-				ret = LOKI_CHANGED;
-			} else {
-				xmlFree(str);
-				str = (char *)xmlGetProp(file->node, BAD_CAST "major");
-				if ( str && major(st.st_rdev)!=atoi(str) ) {
-					ret = LOKI_CHANGED;
-				} else {
-					xmlFree(str);
-					str = (char *)xmlGetProp(file->node, BAD_CAST "minor");
-					if ( str && minor(st.st_rdev)!=atoi(str) )
-						ret = LOKI_CHANGED;
-				}
-			}
-			xmlFree(str);
-		}
-		break;
-    case LOKI_FILE_DIRECTORY:
-    case LOKI_FILE_SOCKET:
-    case LOKI_FILE_FIFO:
-		/* FIXME: Only test for existence */
-		if ( access(path, F_OK) < 0 )
-			return LOKI_REMOVED;
-		break;
-    case LOKI_FILE_RPM:
-    case LOKI_FILE_SCRIPT:
-    case LOKI_FILE_NONE:
-		/* Do nothing */
-		break;
-	}
-	return ret;
+    comp = parse_component(product, node);
+    for ( opt = comp->options; opt; opt = opt->next ) {
+        for ( file = opt->files; file; file = file->next ) {
+            if ( file->type != LOKI_FILE_RPM ) {
+                record_change(product, LOKI_CHANGE_ADD, file->path);
+            }
+        }
+    }
+    product->changed |= LOKI_DIRTY_COMPONENTS|LOKI_DIRTY_FILES;
+    return comp;
 }
 
-static void unregister_file(product_file_t *file, product_file_t **opt)
+/* Drop the files of the product for which 'match' returns non-zero, in a single
+   pass over the options. Returns the number of files removed. */
+static int unregister_matching(product_t *product, int (*match)(const char *path, void *data),
+                               void *data)
 {
-    xmlUnlinkNode(file->node);
-    xmlFreeNode(file->node);
-    /* Remove the file from the list */
-    if ( *opt == file ) {
-        *opt = file->next;
-    } else {
-        product_file_t *f;
-        for(f = *opt; f; f = f->next) {
-            if (f->next == file ) {
-                f->next = file->next;
-                break;
+    product_component_t *comp;
+    product_option_t *opt;
+    product_file_t *file, **link;
+    int count = 0;
+
+    for ( comp = product->components; comp; comp = comp->next ) {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            for ( link = &opt->files; (file = *link) != NULL; ) {
+                if ( file->type != LOKI_FILE_SCRIPT && file->type != LOKI_FILE_RPM &&
+                     match(file->path, data) ) {
+                    *link = file->next;
+                    record_change(product, LOKI_CHANGE_REMOVE, file->path);
+                    delete_file(file);
+                    ++count;
+                } else {
+                    link = &file->next;
+                }
             }
         }
     }
-    free(file->path);
-#ifdef __linux
-	free(file->se_context);
-#endif
-    free(file);
+    if ( count ) {
+        product->changed |= LOKI_DIRTY_FILES;
+    }
+    return count;
 }
 
-/* Remove a file from the registry. */
-int loki_unregister_path(product_option_t *option, const char *path)
+static int match_path_set(const char *path, void *data)
 {
-    product_file_t *file = find_file_by_name(option,
-                                             loki_remove_root(option->component->product,path));
-    if ( file ) {
-        unregister_file(file, &option->files);
-        option->component->product->changed = 1;
+    path_set_t *set = (path_set_t *)data;
+    size_t i;
+
+    if ( !set->size ) {
         return 0;
     }
-    return -1;
+    i = path_set_slot(set, path, strlen(path));
+    if ( !set->keys[i] ) {
+        return 0;
+    }
+    set->kinds[i] |= PATH_MATCHED;
+    return 1;
 }
 
-int loki_unregister_file(product_file_t *file)
+int loki_unregister_paths(product_t *product, const char **paths, int n, int *unmatched)
 {
-    if ( file ) {
-        product_option_t *option = file->option;
-        if ( option ) { /* Does not work for scripts anyway */
-            unregister_file(file, &option->files);
-            option->component->product->changed = 1;
-            return 0;
+    char buf[PATH_MAX];
+    path_set_t set;
+    int i, count;
+
+    memset(&set, 0, sizeof(set));
+    for ( i = 0; i < n; ++i ) {
+        snprintf(buf, sizeof(buf), "%s", loki_remove_root(product, paths[i]));
+        loki_trim_slashes(buf);
+        path_set_add(&set, buf, strlen(buf), PATH_REGISTERED);
+    }
+    count = unregister_matching(product, match_path_set, &set);
+    if ( unmatched ) {
+        *unmatched = 0;
+        for ( i = 0; i < n; ++i ) {
+            snprintf(buf, sizeof(buf), "%s", loki_remove_root(product, paths[i]));
+            loki_trim_slashes(buf);
+            if ( !(path_set_find(&set, buf) & PATH_MATCHED) ) {
+                ++*unmatched;
+            }
         }
     }
-    return -1;
+    path_set_free(&set);
+    return count;
+}
+
+static int match_prefix(const char *path, void *data)
+{
+    const char *prefix = (const char *)data;
+    size_t len = strlen(prefix);
+
+    return !strncmp(path, prefix, len) && (path[len] == '/' || !path[len]);
+}
+
+int loki_unregister_prefix(product_t *product, const char *prefix)
+{
+    char buf[PATH_MAX];
+
+    snprintf(buf, sizeof(buf), "%s", loki_remove_root(product, prefix));
+    loki_trim_slashes(buf);
+    /* The root itself would be everything */
+    if ( !*buf ) {
+        return -1;
+    }
+    return unregister_matching(product, match_prefix, buf);
 }
 
 /* Register a new RPM as having been installed by this product */
@@ -1774,6 +5884,7 @@ int loki_register_rpm(product_option_t *option, const char *name, const char *ve
     char rev[10];
 
     rpm = (product_file_t *) malloc(sizeof(product_file_t));
+    rpm->hash = NULL;
     rpm->node = xmlNewChild(option->node, NULL, BAD_CAST "rpm", BAD_CAST substitute_xml_string(name));
     xmlSetProp(rpm->node, BAD_CAST "version", BAD_CAST version);
     snprintf(rev, sizeof(rev), "%d", revision);
@@ -1784,9 +5895,12 @@ int loki_register_rpm(product_option_t *option, const char *name, const char *ve
     rpm->path = strdup(name);
     rpm->type = LOKI_FILE_RPM;
 	rpm->desktop = NULL;
+#ifdef __linux
+	rpm->se_context = NULL;
+#endif
     rpm->next = option->files;
     option->files = rpm;
-    option->component->product->changed = 1;
+    option->component->product->changed |= LOKI_DIRTY_FILES;
 
     return 0;
 }
@@ -1795,8 +5909,6 @@ int loki_unregister_rpm(product_t *product, const char *name)
 {
     /* TODO: Search for a match */
 
-    product->changed = 1;
-
     return -1;
 }
 
@@ -1852,6 +5964,7 @@ static product_file_t *registerscript(xmlNodePtr parent, script_type_t type, con
     if (fd) {
         product_file_t *scr;
         scr = (product_file_t *) malloc(sizeof(product_file_t));
+        scr->hash = NULL;
 
         fprintf(fd, "#! /bin/sh\n");
         fprintf(fd, "%s", script);
@@ -1860,7 +5973,7 @@ static product_file_t *registerscript(xmlNodePtr parent, script_type_t type, con
 
         scr->node = xmlNewChild(parent, NULL, BAD_CAST "script", BAD_CAST substitute_xml_string(name));
         xmlSetProp(scr->node, BAD_CAST "type", BAD_CAST script_types[type]);
-        product->changed = 1;
+        product->changed |= LOKI_DIRTY_SCRIPTS;
 
         scr->path = strdup(name);
         scr->type = LOKI_FILE_SCRIPT;
@@ -1978,7 +6091,7 @@ int loki_unregister_script(product_component_t *comp, const char *name)
     for ( file = comp->scripts; file; file = file->next ) {
         if( !strcmp(file->path, name) ) {
             unregister_file(file, &comp->scripts);
-            comp->product->changed = 1;
+            comp->product->changed |= LOKI_DIRTY_SCRIPTS;
             return ret;
         }
     }
@@ -1987,7 +6100,7 @@ int loki_unregister_script(product_component_t *comp, const char *name)
         for ( file = opt->files; file; file = file->next ) {
             if( !strcmp(file->path, name) ) {
                 unregister_file(file, &opt->files);
-                comp->product->changed = 1;
+                comp->product->changed |= LOKI_DIRTY_SCRIPTS;
                 return ret;
             }
         }
@@ -2032,7 +6145,7 @@ static int register_envvar(product_t *product, product_envvar_t **vars, const ch
 	xmlSetProp(var->node, BAD_CAST "var", BAD_CAST name);
 	xmlSetProp(var->node, BAD_CAST "value", BAD_CAST env);
 
-	product->changed = 1;
+	product->changed |= LOKI_DIRTY_ENVVARS;
 	return 1;
 }
 
@@ -2053,7 +6166,7 @@ static int unregister_envvar(product_t *product, product_envvar_t **vars, const
 			free(var->name);
 			free(var->value);
 			free(var);
-			product->changed = 1;
+			product->changed |= LOKI_DIRTY_ENVVARS;
 			return 1;
 		}
 		prev = var;
@@ -2192,6 +6305,170 @@ int loki_runscripts(product_component_t *comp, script_type_t type)
     return count;
 }
 
+/* Files and directories being removed by loki_uninstall_component() */
+typedef struct {
+    product_file_t *file;
+    int depth;
+} uninstall_item_t;
+
+typedef struct {
+    product_t *product;
+    int rootfd, flags, done, total;
+    uninstall_progress_cb progress;
+    pthread_mutex_t lock;
+} uninstall_job_t;
+
+static void uninstall_item(void *item, void *data)
+{
+    uninstall_item_t *it = (uninstall_item_t *)item;
+    uninstall_job_t *job = (uninstall_job_t *)data;
+    product_file_t *file = it->file;
+    char path[PATH_MAX];
+    int shared = 0;
+
+    if ( job->flags & LOKI_UNINSTALL_KEEP_SHARED ) {
+        /* Whatever its checksum there, the other product still expects the file */
+        expand_path(job->product, file->path, path, sizeof(path));
+        shared = find_owners(path, NULL, NULL, 0, NULL, job->product->info.name) > 0;
+    }
+    if ( !shared ) {
+        /* Absolute paths outside of the root work as well with unlinkat() */
+        if ( unlinkat(job->rootfd, file->path,
+                      (file->type == LOKI_FILE_DIRECTORY) ? AT_REMOVEDIR : 0) == 0 ||
+             errno == ENOENT ) {
+            file->removed = 1;
+        } else if ( file->type != LOKI_FILE_DIRECTORY ||
+                    (errno != ENOTEMPTY && errno != EEXIST) ) {
+            fprintf(stderr, "Could not remove %s: %s\n", file->path, strerror(errno));
+        }
+    }
+    pthread_mutex_lock(&job->lock);
+    ++job->done;
+    if ( job->progress ) {
+        job->progress(file->path, file->removed, job->done, job->total);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Deepest directories first */
+static int compare_depths(const void *a, const void *b)
+{
+    return ((const uninstall_item_t *)b)->depth - ((const uninstall_item_t *)a)->depth;
+}
+
+int loki_uninstall_component(product_component_t *comp, int flags, int nthreads,
+                             uninstall_progress_cb progress)
+{
+    product_t *product = comp->product;
+    product_option_t *opt;
+    product_file_t *file, **link;
+    uninstall_item_t *files, *dirs;
+    uninstall_job_t job;
+    const char *ptr;
+    int i, j, num_files = 0, num_dirs = 0, kept = 0, removed = 0;
+
+    job.rootfd = get_rootfd(product);
+    if ( job.rootfd < 0 ) {
+        fprintf(stderr, "Could not open %s: %s\n", product->info.root, strerror(errno));
+        return -1;
+    }
+    if ( loki_runscripts(comp, LOKI_SCRIPT_PREUNINSTALL) < 0 ) {
+        return -1;
+    }
+    loki_flush_hashes(product);
+
+    /* Sort out what is to be removed */
+    for ( opt = comp->options; opt; opt = opt->next ) {
+        for ( file = opt->files; file; file = file->next ) {
+            ++num_files;
+        }
+    }
+    files = (uninstall_item_t *)malloc((num_files+1) * sizeof(uninstall_item_t));
+    dirs = (uninstall_item_t *)malloc((num_files+1) * sizeof(uninstall_item_t));
+    num_files = 0;
+    for ( opt = comp->options; opt; opt = opt->next ) {
+        for ( file = opt->files; file; file = file->next ) {
+            file->removed = 0;
+            if ( file->type == LOKI_FILE_SCRIPT || file->type == LOKI_FILE_RPM ) {
+                /* Nothing to do on disk, these go away with the component */
+                file->removed = 1;
+                continue;
+            }
+            if ( (file->patched && !(flags & LOKI_UNINSTALL_ALL)) ||
+                 (file->mutable && (flags & LOKI_UNINSTALL_KEEP_MUTABLE)) ) {
+                ++kept;
+                continue;
+            }
+            if ( file->type == LOKI_FILE_DIRECTORY ) {
+                dirs[num_dirs].file = file;
+                dirs[num_dirs].depth = 0;
+                for ( ptr = file->path; *ptr; ++ptr ) {
+                    if ( *ptr == '/' ) {
+                        ++dirs[num_dirs].depth;
+                    }
+                }
+                ++num_dirs;
+            } else {
+                files[num_files++].file = file;
+            }
+        }
+    }
+
+    job.product = product;
+    job.flags = flags;
+    job.done = 0;
+    job.total = num_files + num_dirs;
+    job.progress = progress;
+    pthread_mutex_init(&job.lock, NULL);
+    if ( flags & LOKI_UNINSTALL_KEEP_SHARED ) {
+        /* Make sure the index exists before the workers look into it */
+        find_owners(product->info.root, NULL, NULL, 0, NULL, NULL);
+    }
+
+    parallel_run(files, num_files, sizeof(uninstall_item_t), nthreads, uninstall_item, &job);
+
+    /* Directories at the same depth can go at the same time */
+    qsort(dirs, num_dirs, sizeof(uninstall_item_t), compare_depths);
+    for ( i = 0; i < num_dirs; i = j ) {
+        for ( j = i; j < num_dirs && dirs[j].depth == dirs[i].depth; ++j )
+            ;
+        parallel_run(dirs+i, j-i, sizeof(uninstall_item_t), nthreads, uninstall_item, &job);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    for ( i = 0; i < num_files; ++i ) {
+        removed += files[i].file->removed;
+    }
+    for ( i = 0; i < num_dirs; ++i ) {
+        removed += dirs[i].file->removed;
+    }
+    kept += job.total - removed;
+    free(files);
+    free(dirs);
+
+    loki_runscripts(comp, LOKI_SCRIPT_POSTUNINSTALL);
+
+    /* Update the registry in one go */
+    if ( kept == 0 ) {
+        loki_remove_component(comp);
+    } else {
+        for ( opt = comp->options; opt; opt = opt->next ) {
+            link = &opt->files;
+            while ( (file = *link) != NULL ) {
+                if ( file->removed && file->type != LOKI_FILE_SCRIPT && file->type != LOKI_FILE_RPM ) {
+                    record_change(product, LOKI_CHANGE_REMOVE, file->path);
+                    *link = file->next;
+                    delete_file(file);
+                } else {
+                    link = &file->next;
+                }
+            }
+        }
+        product->changed |= LOKI_DIRTY_FILES;
+    }
+    return removed;
+}
+
 /* This copies a binary that might be from a CD mounted with noexec attributes to 
    a temporary place where we are sure to be able to run it */
 static const char *copy_binary_to_tmp(const char *path)
@@ -33,6 +33,9 @@ typedef struct _loki_product_option_t product_option_t;
 struct _loki_product_file_t;
 typedef struct _loki_product_file_t product_file_t;
 
+struct _loki_close_handle_t;
+typedef struct _loki_close_handle_t loki_close_handle_t;
+
 typedef struct {
     char name[64];
     char description[128];
@@ -59,12 +62,25 @@ typedef enum {
     LOKI_SCRIPT_POSTUNINSTALL
 } script_type_t;
 
+typedef enum {
+	LOKI_CHANGE_ADD = 0,
+	LOKI_CHANGE_UPDATE,
+	LOKI_CHANGE_REMOVE
+} change_type_t;
+
 typedef enum {
 	LOKI_OK,
 	LOKI_CHANGED,
 	LOKI_REMOVED
 } file_check_t;
 
+/* Bits returned by loki_getdirty_product() */
+#define LOKI_DIRTY_PRODUCT    0x01 /* Product attributes */
+#define LOKI_DIRTY_COMPONENTS 0x02 /* Components and options */
+#define LOKI_DIRTY_FILES      0x04 /* Registered files */
+#define LOKI_DIRTY_SCRIPTS    0x08 /* Uninstall scripts */
+#define LOKI_DIRTY_ENVVARS    0x10 /* Environment variables */
+
 /* Enumerate all products, returns name or NULL if end of list */
 
 const char *loki_getfirstproduct(void);
@@ -75,6 +91,19 @@ const char *loki_getnextproduct(void);
 
 product_t *loki_openproduct(const char *name);
 
+/* Flags for loki_openproduct_flags() */
+#define LOKI_OPEN_READONLY  0x01  /* Changes are not written back */
+
+/* Same as above, with flags. The manifest is locked for the lifetime of the product:
+   read-only opens share the lock, while writers get exclusive access.
+   Returns NULL if the lock could not be obtained within the timeout.
+ */
+product_t *loki_openproduct_flags(const char *name, int flags);
+
+/* Set how long to wait for a lock on a manifest, in milliseconds.
+   A negative value (the default) waits forever. */
+void loki_setlocktimeout(int msecs);
+
 /* Create a new product entry */
 
 product_t *loki_create_product(const char *name, const char *root, const char *desc, const char *url);
@@ -88,12 +117,44 @@ void loki_setupdateurl_product(product_t *product, const char *url);
 /* Set a path prefix for the installation media for the product */
 void loki_setprefix_product(product_t *product, const char *prefix);
 
+/* Set the gzip compression level (0-9) used when writing the XML file of the product.
+   Compressed files are detected automatically by loki_openproduct(), and keep their
+   name so that existing symlinks and uninstall scripts still work.
+   The default for new products can be set with the SETUPDB_COMPRESS environment variable.
+ */
+void loki_setcompression_product(product_t *product, int level);
+int loki_getcompression_product(product_t *product);
+
+/* Record the checksums of the 8 MB chunks of the regular files of at least 'min_size'
+   bytes hashed from now on, along with their whole checksum, so that they can be
+   verified by several threads with loki_check_file_chunked(). 0, the default, disables it.
+ */
+void loki_setchunking_product(product_t *product, off_t min_size);
+off_t loki_getchunking_product(product_t *product);
+
+/* Return the LOKI_DIRTY_* bits of the parts of the product that were actually
+   modified since it was opened; 0 means loki_closeproduct() will not write anything.
+   Setters called with the value already stored do not count as changes.
+ */
+int loki_getdirty_product(product_t *product);
+
 /* Close a product entry and free all allocated memory.
    Also writes back to the database all changes that may have been made.
  */
 
 int loki_closeproduct(product_t *product);
 
+/* Same as loki_closeproduct(), but the XML file is written by a background thread.
+   Returns immediately with a handle that has to be released with loki_wait_close().
+   Pending writes are flushed when the process exits, and opening the product
+   again waits for them to complete.
+ */
+loki_close_handle_t *loki_closeproduct_async(product_t *product);
+
+/* Wait for an asynchronous close to complete and free the handle.
+   Returns the same value as loki_closeproduct() would have. */
+int loki_wait_close(loki_close_handle_t *handle);
+
 /* Clean up a product from the registry, i.e. removes all support files and directories.
    No need to close the procuct after that */
 int loki_removeproduct(product_t *product);
@@ -102,6 +163,23 @@ int loki_removeproduct(product_t *product);
 
 product_info_t *loki_getinfo_product(product_t *product);
 
+/* Get the generation number of the product, which is increased every time
+   the product is saved with changes */
+unsigned long loki_get_generation(product_t *product);
+
+/* Callback function type for change enumerations */
+typedef void (*product_change_cb)(unsigned long generation, change_type_t op, const char *path,
+                                  void *data);
+
+/* Enumerate the file changes saved after a given generation, oldest first.
+   Returns the number of changes, or -1 if they are no longer all in the bounded
+   change log, in which case the whole product has to be scanned again.
+   Changes that are not file-related only increase the generation number.
+   'data' is passed on to the callback.
+ */
+int loki_changes_since(product_t *product, unsigned long generation, product_change_cb cb,
+                       void *data);
+
 /* Enumerate the installed components */
 
 product_component_t *loki_getfirst_component(product_t *product);
@@ -161,6 +239,12 @@ file_type_t loki_gettype_file(product_file_t *file);
 const char *loki_getpath_file(product_file_t *file);
 unsigned char *loki_getmd5_file(product_file_t *file);
 unsigned int loki_getmode_file(product_file_t *file);
+/* Size of a regular file, as recorded when it was registered or updated */
+size_t loki_getsize_file(product_file_t *file);
+/* Partial fingerprint of a large regular file (the MD5 of its size and of its first,
+   middle and last 64 KB), as recorded when it was registered or updated.
+   'fingerprint' must hold 33 chars; returns -1 if the file has none. */
+int loki_getfingerprint_file(product_file_t *file, char fingerprint[]);
 
 /* Set the UNIX mode for the file */
 void loki_setmode_file(product_file_t *file, unsigned int mode);
@@ -183,6 +267,87 @@ product_option_t *loki_getoption_file(product_file_t *file);
 product_component_t *loki_getcomponent_file(product_file_t *file);
 product_t *loki_getproduct_file(product_file_t *file);
 
+/* The sizes of components and options are totals of the recorded sizes of their
+   files, maintained as files are registered. This updates them from the disk,
+   using up to 'nthreads' threads (0 for one per processor), and returns the
+   number of files whose size changed.
+ */
+int loki_recompute_sizes(product_t *product, int nthreads);
+
+/* Summary of the changes found by loki_refresh_option() / loki_refresh_product() */
+typedef struct {
+    int checked;   /* Registered paths looked at */
+    int rehashed;  /* Regular files whose size or modification time changed */
+    int changed;   /* Files with new contents or link target, now marked as patched */
+    int missing;   /* Files that no longer exist */
+    int dropped;   /* Missing files removed from the registry */
+    int failed;    /* Files that couldn't be read, left as they were recorded */
+} refresh_summary_t;
+
+/* Flags for the refresh functions */
+#define LOKI_REFRESH_DROP_MISSING 0x01  /* Unregister the files that disappeared */
+
+/* Bring the registry up to date with the files on disk, e.g. after a patch.
+   Only the files whose size or modification time changed are hashed again,
+   using up to 'nthreads' threads (0 for one per processor). The summary is
+   optional; returns the number of changed files, or -1 if the root can't be opened.
+ */
+int loki_refresh_option(product_option_t *opt, int flags, int nthreads, refresh_summary_t *summary);
+int loki_refresh_product(product_t *product, int flags, int nthreads, refresh_summary_t *summary);
+
+/* Callback function type for loki_scan_orphans(). Calls are serialized,
+   but may come from other threads. */
+typedef void (*orphan_cb)(const char *path, file_type_t type);
+
+/* Find the files under the root of the product that are not registered in it,
+   using up to 'nthreads' threads (0 for one per processor). Unregistered
+   directories are reported without their contents, and the .manifest directory
+   is skipped. Returns the number of orphans found, or -1 on error.
+ */
+int loki_scan_orphans(product_t *product, int nthreads, orphan_cb cb);
+
+/* Filter for loki_register_tree(), returns non-zero to register a path (relative to
+   the root when it is under it) and, for directories, what they contain.
+   Calls are serialized, but may come from other threads. */
+typedef int (*register_filter_cb)(const char *path, file_type_t type);
+
+/* Flags for loki_register_tree() */
+#define LOKI_REGISTER_SKIP_DIRS 0x01  /* Only register what the directories contain */
+
+/* Register a directory and everything in it, the same way as loki_register_file().
+   The tree is walked and the files hashed using up to 'nthreads' threads (0 for one
+   per processor), and the entries are added in sorted order. The filter is optional.
+   Returns the number of entries registered, or -1 if 'dir' is not a directory.
+ */
+int loki_register_tree(product_option_t *option, const char *dir, register_filter_cb filter,
+                       int flags, int nthreads);
+
+/* Flags for loki_import_checksums() */
+#define LOKI_IMPORT_VERIFY 0x01  /* Rehash a random sample of the files first */
+
+/* Register the files listed in a file in md5sum format ("-" for the standard input),
+   trusting the checksums it gives. The files are only lstat'ed for their type, mode
+   and size. Relative paths are under the product root. With LOKI_IMPORT_VERIFY,
+   nothing is registered if one of the sampled files doesn't match.
+   Returns the number of entries registered, or -1 on error.
+ */
+int loki_import_checksums(product_option_t *option, const char *listfile, int flags);
+
+/* What to do when a merged component registers a path the product already has */
+typedef enum {
+    LOKI_MERGE_MOVE,   /* The new component takes the path over */
+    LOKI_MERGE_SKIP,   /* The path stays where it is registered */
+    LOKI_MERGE_FAIL    /* Nothing is merged */
+} merge_policy_t;
+
+/* Add a component from an XML fragment holding a <component> element, as found in
+   manifests. The structures are built straight from the fragment, and the files
+   are not looked at. Returns the new component, or NULL if a component with the
+   same name exists, the fragment can't be parsed, or the policy says to fail.
+ */
+product_component_t *loki_merge_component(product_t *product, const char *fragment,
+                                          merge_policy_t policy);
+
 /* Callback function type for file enumerations */
 typedef void (*product_file_cb)(const char *path, file_type_t type,
                                 product_component_t *comp,
@@ -195,6 +360,33 @@ int loki_enumerate_files(product_option_t *opt, product_file_cb cb);
 
 product_file_t *loki_findpath(const char *path, product_t *product);
 
+/* When no product is given to loki_findpath(), the absolute path is looked up in
+   the index of the files of all installed products, and the owning product is
+   opened read-only. The caller must then close it when done with the file, with
+   loki_closeproduct(loki_getproduct_file(file)).
+ */
+
+/* Callback function type for loki_find_owners() */
+typedef void (*path_owner_cb)(const char *path, const char *product,
+                              const char *component, const char *option);
+
+/* Enumerate the products owning an absolute path, using the index.
+   Returns the number of owners, or -1 if the index can't be read.
+ */
+int loki_find_owners(const char *path, path_owner_cb cb);
+
+/* Count the products owning an absolute path, with the given MD5 checksum
+   if 'md5' is not NULL. The index only knows about the saved manifests, so
+   the current state of 'product' (if not NULL) is used instead of its saved
+   one: once a file is unregistered, a count of 0 means nothing else uses it.
+ */
+int loki_path_refcount(product_t *product, const char *path, const unsigned char *md5);
+
+/* Rebuild the index from all the installed products.
+   It is otherwise kept up to date whenever a product is saved or removed.
+ */
+int loki_rebuild_path_index(void);
+
 /* Remove the root directory from the filename to obtain a relative path */
 const char *loki_remove_dirroot(const char *dir, const char *path);
 /* Remove the install path component from the filename to obtain a relative path */
@@ -211,14 +403,114 @@ char *loki_trim_slashes(char *str);
  */
 product_file_t *loki_register_file(product_option_t *option, const char *path, const char *md5);
 
+/* Flags for loki_install_file() */
+#define LOKI_INSTALL_NOCLOBBER 0x01  /* Fail if the destination already exists */
+#define LOKI_INSTALL_SYNC      0x02  /* Flush the data to disk before it is renamed into place */
+
+/* Copy a file into place and register it, computing its checksum while it is written
+   instead of reading it back. The copy is written to a temporary name next to 'dest'
+   and renamed over it, so the destination directory must exist. If 'mode' is negative,
+   the permissions of the source are kept. Returns NULL on error.
+ */
+product_file_t *loki_install_file(product_option_t *option, const char *src, const char *dest,
+                                  int mode, int flags);
+/* Same as above, reading from an open descriptor from its current offset, e.g. a pipe */
+product_file_t *loki_install_file_fd(product_option_t *option, int fd, const char *dest,
+                                     int mode, int flags);
+
+/* Extract a tar archive (ustar or pax, possibly gzip compressed, "-" for the standard
+   input) under the product root, registering its files, directories, links and special
+   files in the option as they are written. Files are hashed while extracted, so the
+   archive is only read once. Ownership is not restored. 'flags' are the same as for
+   loki_install_file(). Returns the number of entries registered, or -1 on error.
+ */
+int loki_extract_tarball(product_option_t *option, const char *archive, int flags);
+
+/* Compute the checksums of the files registered from now on in the background, using
+   'nthreads' threads (0 for one per processor), so that registration doesn't wait for
+   them. The checksums are filled in by loki_flush_hashes(), or by anything that needs
+   them. A negative 'nthreads' flushes and goes back to hashing during registration.
+ */
+int loki_defer_hashes(product_t *product, int nthreads);
+
+/* Wait for the checksums computed in the background and record them. This is done
+   when the product is closed. Returns -1 if a file couldn't be read.
+ */
+int loki_flush_hashes(product_t *product);
+
 /* Check a file against its MD5 checksum, for integrity */
 file_check_t loki_check_file(product_file_t *file);
 
+/* How far loki_check_file_tiered() may go */
+typedef enum {
+	LOKI_CHECK_STAT,        /* Existence and size */
+	LOKI_CHECK_FINGERPRINT, /* Then the partial fingerprint, or the checksum of small files */
+	LOKI_CHECK_FULL         /* Then the checksum of all files */
+} check_level_t;
+
+/* Check a file in increasingly expensive steps, stopping at the first one that finds
+   a difference or at 'level'. Only regular files have several steps. */
+file_check_t loki_check_file_tiered(product_file_t *file, check_level_t level);
+
+/* Callback function type for loki_check_file_chunked(), with a range of bytes that changed */
+typedef void (*chunk_cb)(product_file_t *file, off_t offset, off_t length, void *data);
+
+/* Check a regular file against the checksums of its chunks, reading them with up to
+   'nthreads' threads (0 for one per processor), and call 'cb' for each range of
+   changed chunks. Falls back to loki_check_file() for files without chunk checksums.
+ */
+file_check_t loki_check_file_chunked(product_file_t *file, int nthreads, chunk_cb cb, void *data);
+
+/* Callback function type for loki_check_product(). Calls are serialized, but
+   may come from other threads, in the order the checks complete. */
+typedef void (*check_cb)(product_file_t *file, file_check_t status, void *data);
+
+/* Check all the files of a product, or of one component if 'comp' isn't NULL, as
+   loki_check_file() does, using up to 'nthreads' threads (0 for one per processor).
+   Returns the number of files changed or removed, or -1 if the root can't be opened.
+ */
+int loki_check_product(product_t *product, product_component_t *comp, int nthreads,
+                       check_cb cb, void *data);
+/* Same as loki_check_product(), using loki_check_file_tiered() */
+int loki_check_product_tiered(product_t *product, product_component_t *comp,
+                              check_level_t level, int nthreads, check_cb cb, void *data);
+
+/* Summary of loki_check_product_sampled() */
+typedef struct {
+    int sampled;         /* Files picked at random and checked */
+    int problems;        /* Files picked at random that were changed or removed */
+    int forced;          /* Executables and desktop items, which are always checked */
+    int forced_problems; /* Executables and desktop items that were changed or removed */
+    size_t bytes;        /* Total size of the files checked */
+    double rate;         /* Fraction of the bytes of the files not always checked that
+                            is in changed or removed files, as estimated from the sample */
+    double upper;        /* 95% upper confidence bound of that fraction (Wilson score) */
+} sample_summary_t;
+
+/* Quick check of a random subset of the regular files of a product. Files are
+   picked with a probability proportional to their size until 'budget' bytes are
+   reached; a budget up to 1.0 is a fraction of the total size instead. Executables
+   and desktop items are checked in addition, and left out of the estimated rate.
+   The same seed picks the same files.
+   Returns the number of files checked with problems, or -1 on error.
+ */
+int loki_check_product_sampled(product_t *product, double budget, unsigned int seed,
+                               int nthreads, check_cb cb, void *data,
+                               sample_summary_t *summary);
+
 /* Remove a file from the registry. Actually removing the file is up to the caller. */
 int loki_unregister_path(product_option_t *option, const char *path);
 /* Variant using an iterator */
 int loki_unregister_file(product_file_t *file);
 
+/* Remove a list of paths from the registry at once, in time linear with the number of
+   files of the product. Returns the number of files removed; the number of paths that
+   matched nothing is stored in 'unmatched' if it is not NULL. */
+int loki_unregister_paths(product_t *product, const char **paths, int n, int *unmatched);
+/* Remove a directory and everything registered under it.
+   Returns the number of files removed, or -1 if the prefix is the install path itself */
+int loki_unregister_prefix(product_t *product, const char *prefix);
+
 /* Update the MD5 sum of a specific file */
 int loki_updatemd5_file(product_t *product, const char *path);
 
@@ -261,6 +553,25 @@ product_file_t *loki_find_script(product_t *product, product_component_t *compon
 /* Run all scripts of a given type, returns the number of scripts successfully run */
 int loki_runscripts(product_component_t *component, script_type_t type);
 
+/* Flags for loki_uninstall_component() */
+#define LOKI_UNINSTALL_ALL          0x01  /* The whole product goes, patched files too */
+#define LOKI_UNINSTALL_KEEP_MUTABLE 0x02  /* Keep the files marked as mutable */
+#define LOKI_UNINSTALL_KEEP_SHARED  0x04  /* Keep the files other products still own */
+
+/* Progress callback for loki_uninstall_component(). Calls are serialized,
+   but may come from other threads. */
+typedef void (*uninstall_progress_cb)(const char *path, int removed, int done, int total);
+
+/* Remove the files of a component from the disk, using up to 'nthreads' threads
+   (0 for one per processor). Pre-uninstall scripts are run first, then files,
+   directories (deepest first) and post-uninstall scripts. If everything could be
+   removed the component is removed as well, otherwise only the removed files are
+   unregistered. Returns the number of files removed, or -1 if the pre-uninstall
+   scripts failed. The changes are saved when the product is closed.
+ */
+int loki_uninstall_component(product_component_t *comp, int flags, int nthreads,
+                             uninstall_progress_cb progress);
+
 /* Environment variables management */
 /* Product-wide */
 int loki_register_envvar(product_t *product, const char *var);
@@ -284,6 +595,30 @@ int loki_put_envvars_component(product_component_t *comp);
  */
 int loki_upgrade_uninstall(product_t *prod, const char *src, const char *locale_path);
 
+/**** Optional SQLite copies of the manifests, available when built with --with-sqlite.
+      The XML manifests remain the registry and the library never reads the database:
+      it is an export for other tools, indexed on the paths, types and desktop binaries
+      of the files. A manifest can be converted to the database and back without
+      losing anything.
+ ****/
+
+struct _loki_sqlite_t;
+typedef struct _loki_sqlite_t loki_sqlite_t;
+
+/* Open or create a database, returns NULL if SQLite support is not available */
+loki_sqlite_t *loki_sqlite_open(const char *path);
+void loki_sqlite_close(loki_sqlite_t *db);
+
+/* Convert an XML manifest into the database, replacing any previous version
+   of the same product. Returns 0 if OK */
+int loki_sqlite_from_xml(loki_sqlite_t *db, const char *manifest);
+
+/* Convert a product stored in the database back to an XML manifest file */
+int loki_sqlite_to_xml(loki_sqlite_t *db, const char *name, const char *manifest);
+
+/* Remove a product from the database */
+int loki_sqlite_remove(loki_sqlite_t *db, const char *name);
+
 /* Extract base and extension from a version string */
 extern void loki_split_version(const char *version,
                                char *base, int maxbase,
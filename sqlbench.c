@@ -0,0 +1,158 @@
+/* Compare the XML manifests with their SQLite copies, on a generated product */
+/* Usage: sqlbench [files [lookups]] */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "setupdb.h"
+
+static struct timeval start;
+
+static void begin(void)
+{
+    gettimeofday(&start, NULL);
+}
+
+static void report(const char *what, const char *backend, int count)
+{
+    struct timeval now;
+    double msecs;
+
+    gettimeofday(&now, NULL);
+    msecs = (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+    printf("%-10s %-12s %8d %12.2f ms %10.2f us/op\n", what, backend, count, msecs,
+           count ? msecs * 1000.0 / count : 0.0);
+}
+
+/* Paths are spread over directories, like a real install */
+static void file_path(char *buf, size_t len, int i)
+{
+    snprintf(buf, len, "d%03d/f%06d", i % 100, i);
+}
+
+int main(int argc, char **argv)
+{
+    char root[] = "/tmp/sqlbenchXXXXXX";
+    char name[64], path[32], full[PATH_MAX], db_path[PATH_MAX], xml_path[PATH_MAX];
+    int files = (argc > 1) ? atoi(argv[1]) : 20000;
+    int lookups = (argc > 2) ? atoi(argv[2]) : 1000;
+    int extra = files / 100 + 1;
+    product_option_t *opt;
+    product_t *product;
+    loki_sqlite_t *db;
+    int i, fd, found;
+
+    if ( !mkdtemp(root) ) {
+        perror(root);
+        return 2;
+    }
+    snprintf(name, sizeof(name), "sqlbench-%d", (int)getpid());
+    snprintf(db_path, sizeof(db_path), "%s/bench.db", root);
+    snprintf(xml_path, sizeof(xml_path), "%s/back.xml", root);
+    for ( i = 0; i < 100; ++i ) {
+        snprintf(full, sizeof(full), "%s/d%03d", root, i);
+        mkdir(full, 0755);
+    }
+    for ( i = 0; i < files + extra; ++i ) {
+        file_path(path, sizeof(path), i);
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+        fd = open(full, O_WRONLY|O_CREAT, 0644);
+        if ( fd >= 0 ) {
+            close(fd);
+        }
+    }
+
+    product = loki_create_product(name, root, "SQLite benchmark", "");
+    if ( !product ) {
+        fprintf(stderr, "Unable to create product %s\n", name);
+        return 2;
+    }
+    opt = loki_create_option(loki_create_component(product, "base", "1.0"), "files", NULL);
+    for ( i = 0; i < files; ++i ) {
+        file_path(path, sizeof(path), i);
+        loki_register_file(opt, path, "d41d8cd98f00b204e9800998ecf8427e");
+    }
+    loki_closeproduct(product);
+    printf("%d files, %d lookups\n\n", files, lookups);
+    printf("%-10s %-12s %8s %15s %16s\n", "operation", "backend", "count", "total", "per op");
+
+    /* Open */
+    begin();
+    product = loki_openproduct_flags(name, LOKI_OPEN_READONLY);
+    report("open", "xml", 1);
+    db = loki_sqlite_open(db_path);
+    if ( !db ) {
+        loki_closeproduct(product);
+        return 2;
+    }
+    loki_sqlite_from_xml(db, loki_getinfo_product(product)->registry_path);
+    loki_sqlite_close(db);
+    begin();
+    db = loki_sqlite_open(db_path);
+    report("open", "sqlite", 1);
+
+    /* Lookup of the owner of a path */
+    srand(1);
+    begin();
+    for ( i = 0, found = 0; i < lookups; ++i ) {
+        file_path(path, sizeof(path), rand() % files);
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+        found += loki_findpath(full, product) != NULL;
+    }
+    report("lookup", "xml", found);
+    srand(1);
+    begin();
+    for ( i = 0, found = 0; i < lookups; ++i ) {
+        file_path(path, sizeof(path), rand() % files);
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+        found += loki_find_owners(full, NULL) > 0;
+    }
+    report("lookup", "xml+index", found);
+    loki_closeproduct(product);
+
+    /* Registering more files: the database copy has to be converted again */
+    product = loki_openproduct(name);
+    opt = loki_find_option(loki_find_component(product, "base"), "files");
+    begin();
+    for ( i = files; i < files + extra; ++i ) {
+        file_path(path, sizeof(path), i);
+        loki_register_file(opt, path, "d41d8cd98f00b204e9800998ecf8427e");
+    }
+    report("register", "xml", extra);
+
+    /* Saving */
+    begin();
+    loki_closeproduct(product);
+    report("save", "xml", 1);
+    product = loki_openproduct_flags(name, LOKI_OPEN_READONLY);
+    begin();
+    loki_sqlite_from_xml(db, loki_getinfo_product(product)->registry_path);
+    report("save", "sqlite", 1);
+    loki_closeproduct(product);
+    begin();
+    loki_sqlite_to_xml(db, name, xml_path);
+    report("to_xml", "sqlite", 1);
+    loki_sqlite_close(db);
+
+    /* Clean up, the product removes its root once empty */
+    for ( i = 0; i < files + extra; ++i ) {
+        file_path(path, sizeof(path), i);
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+        unlink(full);
+    }
+    for ( i = 0; i < 100; ++i ) {
+        snprintf(full, sizeof(full), "%s/d%03d", root, i);
+        rmdir(full);
+    }
+    unlink(db_path);
+    unlink(xml_path);
+    product = loki_openproduct(name);
+    loki_removeproduct(product);
+    return 0;
+}
@@ -0,0 +1,696 @@
+/* Optional conversion of the product manifests to an SQLite database.
+   The XML manifests remain the registry, the library never reads the database:
+   a manifest can be exported to it for other tools, and written back from it
+   without losing anything.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "setup-xml.h"
+#include "setupdb.h"
+
+#if defined(HAVE_SQLITE) && defined(HAVE_SQLITE3_H)
+
+#include <sqlite3.h>
+
+struct _loki_sqlite_t
+{
+    sqlite3 *db;
+};
+
+/* Attributes without a column of their own are kept in the 'attrs' table, and the
+   elements without a table of their own (e.g. messages and the change log) in the
+   'extras' one, as XML. The kinds of owners of the attributes: */
+enum {
+    KIND_PRODUCT, KIND_COMPONENT, KIND_OPTION, KIND_FILE, KIND_SCRIPT, KIND_ENVVAR
+};
+
+static const char *schema =
+    "CREATE TABLE IF NOT EXISTS products (id INTEGER PRIMARY KEY, name TEXT UNIQUE NOT NULL COLLATE NOCASE,"
+    " description TEXT, root TEXT, update_url TEXT, prefix TEXT, xmlversion TEXT, generation TEXT);"
+    "CREATE TABLE IF NOT EXISTS components (id INTEGER PRIMARY KEY, product_id INTEGER NOT NULL,"
+    " name TEXT NOT NULL, version TEXT, update_url TEXT, is_default INTEGER);"
+    "CREATE TABLE IF NOT EXISTS options (id INTEGER PRIMARY KEY, component_id INTEGER NOT NULL,"
+    " name TEXT NOT NULL, tag TEXT);"
+    "CREATE TABLE IF NOT EXISTS files (id INTEGER PRIMARY KEY, option_id INTEGER NOT NULL,"
+    " type TEXT NOT NULL, path TEXT NOT NULL, abspath TEXT, md5 TEXT, mode TEXT,"
+    " patched TEXT, mutable TEXT, desktop TEXT);"
+    "CREATE TABLE IF NOT EXISTS attrs (kind INTEGER NOT NULL, owner_id INTEGER NOT NULL,"
+    " name TEXT NOT NULL, value TEXT);"
+    "CREATE TABLE IF NOT EXISTS extras (id INTEGER PRIMARY KEY, product_id INTEGER NOT NULL,"
+    " component_id INTEGER, xml TEXT NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS scripts (id INTEGER PRIMARY KEY, component_id INTEGER NOT NULL,"
+    " option_id INTEGER, name TEXT NOT NULL, type TEXT);"
+    "CREATE TABLE IF NOT EXISTS envvars (id INTEGER PRIMARY KEY, product_id INTEGER NOT NULL,"
+    " component_id INTEGER, var TEXT NOT NULL, value TEXT);"
+    "CREATE INDEX IF NOT EXISTS files_abspath ON files(abspath);"
+    "CREATE INDEX IF NOT EXISTS files_type ON files(type);"
+    "CREATE INDEX IF NOT EXISTS files_desktop ON files(desktop);"
+    "CREATE INDEX IF NOT EXISTS files_option ON files(option_id);"
+    "CREATE INDEX IF NOT EXISTS attrs_owner ON attrs(kind, owner_id);"
+    "CREATE INDEX IF NOT EXISTS extras_product ON extras(product_id);"
+    "CREATE INDEX IF NOT EXISTS scripts_type ON scripts(type);"
+    "CREATE INDEX IF NOT EXISTS scripts_component ON scripts(component_id);"
+    "CREATE INDEX IF NOT EXISTS options_component ON options(component_id);"
+    "CREATE INDEX IF NOT EXISTS components_product ON components(product_id);"
+    "CREATE INDEX IF NOT EXISTS envvars_product ON envvars(product_id);";
+
+/* Attributes that have their own column, for each kind */
+static const char *product_columns[] = { "name", "desc", "root", "update_url", "prefix",
+                                         "xmlversion", "generation", NULL };
+static const char *component_columns[] = { "name", "version", "update_url", NULL };
+static const char *option_columns[] = { "name", "tag", NULL };
+static const char *file_columns[] = { "md5", "mode", "patched", "mutable", "desktop", NULL };
+static const char *script_columns[] = { "type", NULL };
+static const char *envvar_columns[] = { "var", "value", NULL };
+
+static const char **columns[] = {
+    product_columns, component_columns, option_columns,
+    file_columns, script_columns, envvar_columns
+};
+
+static int is_column(int kind, const char *attr)
+{
+    int i;
+    for ( i = 0; columns[kind][i]; ++i ) {
+        if ( !strcmp(columns[kind][i], attr) )
+            return 1;
+    }
+    return 0;
+}
+
+static int exec_sql(loki_sqlite_t *db, const char *sql)
+{
+    char *err = NULL;
+
+    if ( sqlite3_exec(db->db, sql, NULL, NULL, &err) != SQLITE_OK ) {
+        fprintf(stderr, "SQLite error: %s\n", err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+static sqlite3_stmt *prepare(loki_sqlite_t *db, const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+
+    if ( sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL) != SQLITE_OK ) {
+        fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(db->db));
+        return NULL;
+    }
+    return stmt;
+}
+
+/* Bind an attribute of a node, NULL if it isn't set */
+static void bind_prop(sqlite3_stmt *stmt, int col, xmlNodePtr node, const char *name)
+{
+    char *str = (char *)xmlGetProp(node, BAD_CAST name);
+
+    if ( str ) {
+        sqlite3_bind_text(stmt, col, str, -1, SQLITE_TRANSIENT);
+        xmlFree(str);
+    } else {
+        sqlite3_bind_null(stmt, col);
+    }
+}
+
+static const char *column_text(sqlite3_stmt *stmt, int col)
+{
+    return (const char *)sqlite3_column_text(stmt, col);
+}
+
+static void set_prop(xmlNodePtr node, const char *name, sqlite3_stmt *stmt, int col)
+{
+    const char *str = column_text(stmt, col);
+    if ( str ) {
+        xmlSetProp(node, BAD_CAST name, BAD_CAST str);
+    }
+}
+
+static xmlNodePtr new_text_child(xmlNodePtr parent, const char *name, const char *text)
+{
+    xmlNodePtr node = xmlNewChild(parent, NULL, BAD_CAST name, NULL);
+    if ( text && *text ) {
+        xmlAddChild(node, xmlNewText(BAD_CAST text));
+    }
+    return node;
+}
+
+static void expand(const char *root, const char *path, char *buf, size_t len)
+{
+    if ( *path == '/' || !root ) {
+        snprintf(buf, len, "%s", path);
+    } else {
+        snprintf(buf, len, "%s/%s", root, path);
+    }
+    loki_trim_slashes(buf);
+}
+
+loki_sqlite_t *loki_sqlite_open(const char *path)
+{
+    loki_sqlite_t *db = (loki_sqlite_t *)malloc(sizeof(loki_sqlite_t));
+
+    if ( db ) {
+        if ( sqlite3_open(path, &db->db) != SQLITE_OK ) {
+            fprintf(stderr, "Could not open %s: %s\n", path, sqlite3_errmsg(db->db));
+            sqlite3_close(db->db);
+            free(db);
+            return NULL;
+        }
+        if ( exec_sql(db, schema) < 0 ) {
+            loki_sqlite_close(db);
+            return NULL;
+        }
+    }
+    return db;
+}
+
+void loki_sqlite_close(loki_sqlite_t *db)
+{
+    if ( db ) {
+        sqlite3_close(db->db);
+        free(db);
+    }
+}
+
+/* Delete all the rows for a product, within the current transaction */
+static int delete_product(loki_sqlite_t *db, const char *name)
+{
+    static const char *queries[] = {
+        "DELETE FROM attrs WHERE kind=0 AND owner_id IN (SELECT id FROM products WHERE name=?1);",
+        "DELETE FROM attrs WHERE kind=1 AND owner_id IN (SELECT c.id FROM components c"
+        " JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM attrs WHERE kind=2 AND owner_id IN (SELECT o.id FROM options o"
+        " JOIN components c ON o.component_id=c.id JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM attrs WHERE kind=3 AND owner_id IN (SELECT f.id FROM files f"
+        " JOIN options o ON f.option_id=o.id JOIN components c ON o.component_id=c.id"
+        " JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM attrs WHERE kind=4 AND owner_id IN (SELECT s.id FROM scripts s"
+        " JOIN components c ON s.component_id=c.id JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM attrs WHERE kind=5 AND owner_id IN (SELECT e.id FROM envvars e"
+        " JOIN products p ON e.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM extras WHERE product_id IN (SELECT id FROM products WHERE name=?1);",
+        "DELETE FROM files WHERE option_id IN (SELECT o.id FROM options o"
+        " JOIN components c ON o.component_id=c.id JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM scripts WHERE component_id IN (SELECT c.id FROM components c"
+        " JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM options WHERE component_id IN (SELECT c.id FROM components c"
+        " JOIN products p ON c.product_id=p.id WHERE p.name=?1);",
+        "DELETE FROM envvars WHERE product_id IN (SELECT id FROM products WHERE name=?1);",
+        "DELETE FROM components WHERE product_id IN (SELECT id FROM products WHERE name=?1);",
+        "DELETE FROM products WHERE name=?1;",
+        NULL
+    };
+    sqlite3_stmt *stmt;
+    int i, ret = 0;
+
+    for ( i = 0; queries[i] && !ret; ++i ) {
+        stmt = prepare(db, queries[i]);
+        if ( !stmt )
+            return -1;
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        if ( sqlite3_step(stmt) != SQLITE_DONE ) {
+            fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(db->db));
+            ret = -1;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return ret;
+}
+
+int loki_sqlite_remove(loki_sqlite_t *db, const char *name)
+{
+    if ( exec_sql(db, "BEGIN;") < 0 )
+        return -1;
+    if ( delete_product(db, name) < 0 ) {
+        exec_sql(db, "ROLLBACK;");
+        return -1;
+    }
+    return exec_sql(db, "COMMIT;");
+}
+
+/* Prepared statements used while storing a manifest */
+enum {
+    INS_PRODUCT, INS_COMPONENT, INS_OPTION, INS_FILE, INS_ATTR, INS_SCRIPT, INS_ENVVAR,
+    INS_EXTRA, NUM_INSERTS
+};
+
+static const char *inserts[NUM_INSERTS] = {
+    "INSERT INTO products (name, description, root, update_url, prefix, xmlversion, generation)"
+    " VALUES (?,?,?,?,?,?,?);",
+    "INSERT INTO components (product_id, name, version, update_url, is_default)"
+    " VALUES (?,?,?,?,?);",
+    "INSERT INTO options (component_id, name, tag) VALUES (?,?,?);",
+    "INSERT INTO files (option_id, type, path, abspath, md5, mode, patched, mutable, desktop)"
+    " VALUES (?,?,?,?,?,?,?,?,?);",
+    "INSERT INTO attrs (kind, owner_id, name, value) VALUES (?,?,?,?);",
+    "INSERT INTO scripts (component_id, option_id, name, type) VALUES (?,?,?,?);",
+    "INSERT INTO envvars (product_id, component_id, var, value) VALUES (?,?,?,?);",
+    "INSERT INTO extras (product_id, component_id, xml) VALUES (?,?,?);"
+};
+
+static int step(loki_sqlite_t *db, sqlite3_stmt *stmt)
+{
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if ( ret != SQLITE_DONE ) {
+        fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(db->db));
+        return -1;
+    }
+    return 0;
+}
+
+/* Store the attributes of a node that don't have a column of their own */
+static int export_attrs(loki_sqlite_t *db, sqlite3_stmt **stmt, int kind, sqlite3_int64 id,
+                        xmlNodePtr node)
+{
+    xmlAttrPtr attr;
+    int ret = 0;
+
+    for ( attr = node->properties; attr && !ret; attr = attr->next ) {
+        if ( is_column(kind, (const char *)attr->name) )
+            continue;
+        sqlite3_bind_int(stmt[INS_ATTR], 1, kind);
+        sqlite3_bind_int64(stmt[INS_ATTR], 2, id);
+        sqlite3_bind_text(stmt[INS_ATTR], 3, (const char *)attr->name, -1, SQLITE_TRANSIENT);
+        bind_prop(stmt[INS_ATTR], 4, node, (const char *)attr->name);
+        ret = step(db, stmt[INS_ATTR]);
+    }
+    return ret;
+}
+
+/* Store an element that has no table of its own as it is */
+static int export_extra(loki_sqlite_t *db, sqlite3_stmt **stmt, xmlDocPtr doc, xmlNodePtr node,
+                        sqlite3_int64 prod, sqlite3_int64 comp)
+{
+    xmlBufferPtr buf = xmlBufferCreate();
+    int ret;
+
+    xmlNodeDump(buf, doc, node, 0, 0);
+    sqlite3_bind_int64(stmt[INS_EXTRA], 1, prod);
+    if ( comp ) {
+        sqlite3_bind_int64(stmt[INS_EXTRA], 2, comp);
+    }
+    sqlite3_bind_text(stmt[INS_EXTRA], 3, (const char *)xmlBufferContent(buf),
+                      xmlBufferLength(buf), SQLITE_TRANSIENT);
+    ret = step(db, stmt[INS_EXTRA]);
+    xmlBufferFree(buf);
+    return ret;
+}
+
+static int export_script(loki_sqlite_t *db, sqlite3_stmt **stmt, xmlDocPtr doc, xmlNodePtr node,
+                         sqlite3_int64 comp, sqlite3_int64 opt)
+{
+    char *name = (char *)xmlNodeListGetString(doc, XML_CHILDREN(node), 1);
+    int ret;
+
+    sqlite3_bind_int64(stmt[INS_SCRIPT], 1, comp);
+    if ( opt ) {
+        sqlite3_bind_int64(stmt[INS_SCRIPT], 2, opt);
+    }
+    sqlite3_bind_text(stmt[INS_SCRIPT], 3, name ? name : "", -1, SQLITE_TRANSIENT);
+    bind_prop(stmt[INS_SCRIPT], 4, node, "type");
+    ret = step(db, stmt[INS_SCRIPT]);
+    xmlFree(name);
+    if ( ret == 0 ) {
+        ret = export_attrs(db, stmt, KIND_SCRIPT, sqlite3_last_insert_rowid(db->db), node);
+    }
+    return ret;
+}
+
+static int export_envvar(loki_sqlite_t *db, sqlite3_stmt **stmt, xmlNodePtr node,
+                         sqlite3_int64 prod, sqlite3_int64 comp)
+{
+    sqlite3_bind_int64(stmt[INS_ENVVAR], 1, prod);
+    if ( comp ) {
+        sqlite3_bind_int64(stmt[INS_ENVVAR], 2, comp);
+    }
+    bind_prop(stmt[INS_ENVVAR], 3, node, "var");
+    bind_prop(stmt[INS_ENVVAR], 4, node, "value");
+    if ( step(db, stmt[INS_ENVVAR]) < 0 )
+        return -1;
+    return export_attrs(db, stmt, KIND_ENVVAR, sqlite3_last_insert_rowid(db->db), node);
+}
+
+static int export_file(loki_sqlite_t *db, sqlite3_stmt **stmt, xmlDocPtr doc, xmlNodePtr node,
+                       const char *root, sqlite3_int64 opt)
+{
+    char abspath[PATH_MAX];
+    char *path = (char *)xmlNodeListGetString(doc, XML_CHILDREN(node), 1);
+
+    /* Elements with no text are kept too, with an empty path */
+    sqlite3_bind_int64(stmt[INS_FILE], 1, opt);
+    sqlite3_bind_text(stmt[INS_FILE], 2, (const char *)node->name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt[INS_FILE], 3, path ? path : "", -1, SQLITE_TRANSIENT);
+    if ( path && *path ) {
+        expand(root, path, abspath, sizeof(abspath));
+        sqlite3_bind_text(stmt[INS_FILE], 4, abspath, -1, SQLITE_TRANSIENT);
+    }
+    bind_prop(stmt[INS_FILE], 5, node, "md5");
+    bind_prop(stmt[INS_FILE], 6, node, "mode");
+    bind_prop(stmt[INS_FILE], 7, node, "patched");
+    bind_prop(stmt[INS_FILE], 8, node, "mutable");
+    bind_prop(stmt[INS_FILE], 9, node, "desktop");
+    xmlFree(path);
+    if ( step(db, stmt[INS_FILE]) < 0 )
+        return -1;
+    return export_attrs(db, stmt, KIND_FILE, sqlite3_last_insert_rowid(db->db), node);
+}
+
+static int export_doc(loki_sqlite_t *db, sqlite3_stmt **stmt, xmlDocPtr doc)
+{
+    xmlNodePtr root = XML_ROOT(doc), node, optnode, filenode;
+    sqlite3_int64 prod, comp, opt;
+    char *name, *str, *rootdir;
+    int ret = 0;
+
+    name = (char *)xmlGetProp(root, BAD_CAST "name");
+    if ( !name ) {
+        fprintf(stderr, "Invalid manifest: the product has no name\n");
+        return -1;
+    }
+    if ( delete_product(db, name) < 0 ) {
+        xmlFree(name);
+        return -1;
+    }
+    sqlite3_bind_text(stmt[INS_PRODUCT], 1, name, -1, SQLITE_TRANSIENT);
+    xmlFree(name);
+    bind_prop(stmt[INS_PRODUCT], 2, root, "desc");
+    bind_prop(stmt[INS_PRODUCT], 3, root, "root");
+    bind_prop(stmt[INS_PRODUCT], 4, root, "update_url");
+    bind_prop(stmt[INS_PRODUCT], 5, root, "prefix");
+    bind_prop(stmt[INS_PRODUCT], 6, root, "xmlversion");
+    bind_prop(stmt[INS_PRODUCT], 7, root, "generation");
+    if ( step(db, stmt[INS_PRODUCT]) < 0 )
+        return -1;
+    prod = sqlite3_last_insert_rowid(db->db);
+    if ( export_attrs(db, stmt, KIND_PRODUCT, prod, root) < 0 )
+        return -1;
+    rootdir = (char *)xmlGetProp(root, BAD_CAST "root");
+
+    for ( node = XML_CHILDREN(root); node && !ret; node = node->next ) {
+        if ( node->type != XML_ELEMENT_NODE ) {
+            continue;
+        } else if ( !strcmp((char *)node->name, "component") ) {
+            sqlite3_bind_int64(stmt[INS_COMPONENT], 1, prod);
+            bind_prop(stmt[INS_COMPONENT], 2, node, "name");
+            bind_prop(stmt[INS_COMPONENT], 3, node, "version");
+            bind_prop(stmt[INS_COMPONENT], 4, node, "update_url");
+            str = (char *)xmlGetProp(node, BAD_CAST "default");
+            sqlite3_bind_int(stmt[INS_COMPONENT], 5, str && *str=='y');
+            xmlFree(str);
+            if ( step(db, stmt[INS_COMPONENT]) < 0 ) {
+                ret = -1;
+                break;
+            }
+            comp = sqlite3_last_insert_rowid(db->db);
+            ret = export_attrs(db, stmt, KIND_COMPONENT, comp, node);
+
+            for ( optnode = XML_CHILDREN(node); optnode && !ret; optnode = optnode->next ) {
+                if ( optnode->type != XML_ELEMENT_NODE ) {
+                    continue;
+                } else if ( !strcmp((char *)optnode->name, "option") ) {
+                    sqlite3_bind_int64(stmt[INS_OPTION], 1, comp);
+                    bind_prop(stmt[INS_OPTION], 2, optnode, "name");
+                    bind_prop(stmt[INS_OPTION], 3, optnode, "tag");
+                    if ( step(db, stmt[INS_OPTION]) < 0 ) {
+                        ret = -1;
+                        break;
+                    }
+                    opt = sqlite3_last_insert_rowid(db->db);
+                    ret = export_attrs(db, stmt, KIND_OPTION, opt, optnode);
+                    for ( filenode = XML_CHILDREN(optnode); filenode && !ret; filenode = filenode->next ) {
+                        if ( filenode->type != XML_ELEMENT_NODE ) {
+                            continue;
+                        } else if ( !strcmp((char *)filenode->name, "script") ) {
+                            ret = export_script(db, stmt, doc, filenode, comp, opt);
+                        } else {
+                            ret = export_file(db, stmt, doc, filenode, rootdir, opt);
+                        }
+                    }
+                } else if ( !strcmp((char *)optnode->name, "script") ) {
+                    ret = export_script(db, stmt, doc, optnode, comp, 0);
+                } else if ( !strcmp((char *)optnode->name, "environment") ) {
+                    ret = export_envvar(db, stmt, optnode, prod, comp);
+                } else {
+                    ret = export_extra(db, stmt, doc, optnode, prod, comp);
+                }
+            }
+        } else if ( !strcmp((char *)node->name, "environment") ) {
+            ret = export_envvar(db, stmt, node, prod, 0);
+        } else {
+            ret = export_extra(db, stmt, doc, node, prod, 0);
+        }
+    }
+    xmlFree(rootdir);
+    return ret;
+}
+
+/* Store the contents of an XML manifest in the database, replacing any previous version */
+int loki_sqlite_from_xml(loki_sqlite_t *db, const char *manifest)
+{
+    sqlite3_stmt *stmt[NUM_INSERTS];
+    xmlDocPtr doc;
+    int i, ret;
+
+    doc = xmlParseFile(manifest);
+    if ( !doc ) {
+        fprintf(stderr, "Could not parse %s\n", manifest);
+        return -1;
+    }
+
+    memset(stmt, 0, sizeof(stmt));
+    ret = exec_sql(db, "BEGIN;");
+    for ( i = 0; i < NUM_INSERTS && !ret; ++i ) {
+        stmt[i] = prepare(db, inserts[i]);
+        if ( !stmt[i] )
+            ret = -1;
+    }
+    if ( !ret ) {
+        ret = export_doc(db, stmt, doc);
+    }
+    for ( i = 0; i < NUM_INSERTS; ++i ) {
+        sqlite3_finalize(stmt[i]);
+    }
+    if ( ret < 0 ) {
+        exec_sql(db, "ROLLBACK;");
+    } else {
+        ret = exec_sql(db, "COMMIT;");
+    }
+    xmlFreeDoc(doc);
+    return ret;
+}
+
+/* Restore the attributes stored in the 'attrs' table, through the given statement */
+static void import_attrs(sqlite3_stmt *attrs, xmlNodePtr node, int kind, sqlite3_int64 id)
+{
+    sqlite3_bind_int(attrs, 1, kind);
+    sqlite3_bind_int64(attrs, 2, id);
+    while ( sqlite3_step(attrs) == SQLITE_ROW ) {
+        set_prop(node, column_text(attrs, 0), attrs, 1);
+    }
+    sqlite3_reset(attrs);
+}
+
+static void import_extras(loki_sqlite_t *db, xmlNodePtr parent, sqlite3_int64 prod, sqlite3_int64 comp)
+{
+    sqlite3_stmt *stmt;
+    xmlDocPtr doc;
+    const char *xml;
+
+    if ( comp ) {
+        stmt = prepare(db, "SELECT xml FROM extras WHERE component_id=? ORDER BY id;");
+        sqlite3_bind_int64(stmt, 1, comp);
+    } else {
+        stmt = prepare(db, "SELECT xml FROM extras WHERE product_id=? AND component_id IS NULL"
+                       " ORDER BY id;");
+        sqlite3_bind_int64(stmt, 1, prod);
+    }
+    while ( stmt && sqlite3_step(stmt) == SQLITE_ROW ) {
+        xml = column_text(stmt, 0);
+        doc = xmlParseMemory(xml, strlen(xml));
+        if ( doc ) {
+            xmlAddChild(parent, XML_COPY_NODE(XML_ROOT(doc), parent->doc));
+            xmlFreeDoc(doc);
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void import_envvars(loki_sqlite_t *db, sqlite3_stmt *attrs, xmlNodePtr parent,
+                           sqlite3_int64 prod, sqlite3_int64 comp)
+{
+    sqlite3_stmt *stmt;
+    xmlNodePtr node;
+
+    if ( comp ) {
+        stmt = prepare(db, "SELECT var, value, id FROM envvars WHERE component_id=? ORDER BY id;");
+        sqlite3_bind_int64(stmt, 1, comp);
+    } else {
+        stmt = prepare(db, "SELECT var, value, id FROM envvars WHERE product_id=? AND component_id IS NULL"
+                       " ORDER BY id;");
+        sqlite3_bind_int64(stmt, 1, prod);
+    }
+    while ( stmt && sqlite3_step(stmt) == SQLITE_ROW ) {
+        node = xmlNewChild(parent, NULL, BAD_CAST "environment", NULL);
+        set_prop(node, "var", stmt, 0);
+        set_prop(node, "value", stmt, 1);
+        import_attrs(attrs, node, KIND_ENVVAR, sqlite3_column_int64(stmt, 2));
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void import_scripts(loki_sqlite_t *db, sqlite3_stmt *attrs, xmlNodePtr parent,
+                           sqlite3_int64 comp, sqlite3_int64 opt)
+{
+    sqlite3_stmt *stmt;
+    xmlNodePtr node;
+
+    if ( opt ) {
+        stmt = prepare(db, "SELECT name, type, id FROM scripts WHERE option_id=? ORDER BY id;");
+        sqlite3_bind_int64(stmt, 1, opt);
+    } else {
+        stmt = prepare(db, "SELECT name, type, id FROM scripts WHERE component_id=? AND option_id IS NULL"
+                       " ORDER BY id;");
+        sqlite3_bind_int64(stmt, 1, comp);
+    }
+    while ( stmt && sqlite3_step(stmt) == SQLITE_ROW ) {
+        node = new_text_child(parent, "script", column_text(stmt, 0));
+        set_prop(node, "type", stmt, 1);
+        import_attrs(attrs, node, KIND_SCRIPT, sqlite3_column_int64(stmt, 2));
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void import_files(loki_sqlite_t *db, sqlite3_stmt *attrs, xmlNodePtr parent, sqlite3_int64 opt)
+{
+    sqlite3_stmt *stmt;
+    xmlNodePtr node;
+    int i;
+
+    stmt = prepare(db, "SELECT id, type, path, md5, mode, patched, mutable, desktop FROM files"
+                   " WHERE option_id=? ORDER BY id;");
+    if ( stmt ) {
+        sqlite3_bind_int64(stmt, 1, opt);
+        while ( sqlite3_step(stmt) == SQLITE_ROW ) {
+            node = new_text_child(parent, column_text(stmt, 1), column_text(stmt, 2));
+            for ( i = 0; file_columns[i]; ++i ) {
+                set_prop(node, file_columns[i], stmt, i+3);
+            }
+            import_attrs(attrs, node, KIND_FILE, sqlite3_column_int64(stmt, 0));
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+/* Write a product stored in the database back to an XML manifest */
+int loki_sqlite_to_xml(loki_sqlite_t *db, const char *name, const char *manifest)
+{
+    sqlite3_stmt *prod, *comps, *opts, *attrs;
+    xmlDocPtr doc;
+    xmlNodePtr root, node, optnode;
+    sqlite3_int64 id, comp;
+    int ret = -1;
+
+    prod = prepare(db, "SELECT id, name, description, root, update_url, prefix, xmlversion, generation"
+                   " FROM products WHERE name=?;");
+    if ( !prod )
+        return -1;
+    sqlite3_bind_text(prod, 1, name, -1, SQLITE_STATIC);
+    if ( sqlite3_step(prod) != SQLITE_ROW ) {
+        fprintf(stderr, "Product %s is not in the database\n", name);
+        sqlite3_finalize(prod);
+        return -1;
+    }
+    id = sqlite3_column_int64(prod, 0);
+
+    doc = xmlNewDoc(BAD_CAST "1.0");
+    root = xmlNewDocNode(doc, NULL, BAD_CAST "product", NULL);
+    xmlDocSetRootElement(doc, root);
+    set_prop(root, "name", prod, 1);
+    set_prop(root, "desc", prod, 2);
+    set_prop(root, "root", prod, 3);
+    set_prop(root, "update_url", prod, 4);
+    set_prop(root, "prefix", prod, 5);
+    set_prop(root, "xmlversion", prod, 6);
+    set_prop(root, "generation", prod, 7);
+    sqlite3_finalize(prod);
+
+    comps = prepare(db, "SELECT id, name, version, update_url FROM components"
+                    " WHERE product_id=? ORDER BY id;");
+    opts = prepare(db, "SELECT id, name, tag FROM options WHERE component_id=? ORDER BY id;");
+    attrs = prepare(db, "SELECT name, value FROM attrs WHERE kind=? AND owner_id=? ORDER BY rowid;");
+    if ( comps && opts && attrs ) {
+        import_attrs(attrs, root, KIND_PRODUCT, id);
+        sqlite3_bind_int64(comps, 1, id);
+        while ( sqlite3_step(comps) == SQLITE_ROW ) {
+            comp = sqlite3_column_int64(comps, 0);
+            node = xmlNewChild(root, NULL, BAD_CAST "component", NULL);
+            set_prop(node, "name", comps, 1);
+            set_prop(node, "version", comps, 2);
+            set_prop(node, "update_url", comps, 3);
+            /* Including 'default' */
+            import_attrs(attrs, node, KIND_COMPONENT, comp);
+
+            sqlite3_bind_int64(opts, 1, comp);
+            while ( sqlite3_step(opts) == SQLITE_ROW ) {
+                optnode = xmlNewChild(node, NULL, BAD_CAST "option", NULL);
+                set_prop(optnode, "name", opts, 1);
+                set_prop(optnode, "tag", opts, 2);
+                import_attrs(attrs, optnode, KIND_OPTION, sqlite3_column_int64(opts, 0));
+                import_files(db, attrs, optnode, sqlite3_column_int64(opts, 0));
+                import_scripts(db, attrs, optnode, comp, sqlite3_column_int64(opts, 0));
+            }
+            sqlite3_reset(opts);
+            import_scripts(db, attrs, node, comp, 0);
+            import_envvars(db, attrs, node, id, comp);
+            import_extras(db, node, id, comp);
+        }
+        import_envvars(db, attrs, root, id, 0);
+        import_extras(db, root, id, 0);
+        if ( XML_SAVE_FILE(manifest, doc) < 0 ) {
+            fprintf(stderr, "Could not write %s\n", manifest);
+        } else {
+            ret = 0;
+        }
+    }
+    sqlite3_finalize(attrs);
+    sqlite3_finalize(opts);
+    sqlite3_finalize(comps);
+    xmlFreeDoc(doc);
+    return ret;
+}
+
+#else /* No SQLite support */
+
+loki_sqlite_t *loki_sqlite_open(const char *path)
+{
+    fprintf(stderr, "This version of setupdb was built without SQLite support.\n");
+    return NULL;
+}
+
+void loki_sqlite_close(loki_sqlite_t *db)
+{
+}
+
+int loki_sqlite_remove(loki_sqlite_t *db, const char *name)
+{
+    return -1;
+}
+
+int loki_sqlite_from_xml(loki_sqlite_t *db, const char *manifest)
+{
+    return -1;
+}
+
+int loki_sqlite_to_xml(loki_sqlite_t *db, const char *name, const char *manifest)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,347 @@
+/* Streaming reader for ustar and pax archives, optionally gzip compressed */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+
+#include "tar.h"
+
+#define BLOCK_SIZE 512
+/* Largest member size, leaving room for the padding to the next block */
+#define MAX_SIZE   ((off_t)(~0ULL >> (65 - 8*sizeof(off_t))) - BLOCK_SIZE)
+
+struct _tar_reader_t {
+#ifdef NO_ZLIB
+    int fd;
+#else
+    gzFile gz;
+#endif
+    off_t left;      /* Data left in the current member */
+    off_t padding;   /* Up to the next header */
+    char *path, *linkname;
+};
+
+/* Read exactly 'len' bytes, returns less at the end of the archive or -1 on error */
+static ssize_t read_raw(tar_reader_t *tar, void *buf, size_t len)
+{
+    size_t done = 0, chunk;
+    ssize_t count;
+
+    while ( done < len ) {
+        /* gzread() takes an unsigned int */
+        chunk = (len - done > INT_MAX) ? INT_MAX : len - done;
+#ifdef NO_ZLIB
+        count = read(tar->fd, (char *)buf + done, chunk);
+#else
+        count = gzread(tar->gz, (char *)buf + done, chunk);
+#endif
+        if ( count < 0 ) {
+            return -1;
+        }
+        if ( count == 0 ) {
+            break;
+        }
+        done += count;
+    }
+    return done;
+}
+
+static int skip_raw(tar_reader_t *tar, off_t len)
+{
+    char buf[8192];
+    ssize_t count;
+
+    while ( len > 0 ) {
+        count = read_raw(tar, buf, (len < (off_t)sizeof(buf)) ? (size_t)len : sizeof(buf));
+        if ( count <= 0 ) {
+            return -1;
+        }
+        len -= count;
+    }
+    return 0;
+}
+
+/* Numeric fields are octal, or big-endian binary when the high bit is set.
+   Returns -1 for negative binary values and those that don't fit.
+ */
+static off_t parse_number(const unsigned char *field, int len)
+{
+    off_t value = 0;
+    int i;
+
+    if ( field[0] & 0x80 ) {
+        if ( field[0] & 0x40 ) {
+            return -1;
+        }
+        value = field[0] & 0x3F;
+        for ( i = 1; i < len; ++i ) {
+            if ( value > (MAX_SIZE >> 8) ) {
+                return -1;
+            }
+            value = (value << 8) | field[i];
+        }
+        return (value > MAX_SIZE) ? -1 : value;
+    }
+    for ( i = 0; i < len && field[i] == ' '; ++i )
+        ;
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; ++i ) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+/* Fields that fill their whole width are not terminated */
+static char *copy_field(const unsigned char *field, int len)
+{
+    char *str = (char *)malloc(len + 1);
+
+    memcpy(str, field, len);
+    str[len] = '\0';
+    return str;
+}
+
+static int check_header(const unsigned char *block)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for ( i = 0; i < BLOCK_SIZE; ++i ) {
+        sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    }
+    return sum == (unsigned int)parse_number(block + 148, 8);
+}
+
+/* Read the data of an extended header, or a GNU long name */
+static char *read_extra(tar_reader_t *tar, off_t size)
+{
+    char *data;
+
+    if ( size < 0 || size > 1024*1024 ) {
+        return NULL;
+    }
+    data = (char *)malloc(size + 1);
+    if ( read_raw(tar, data, size) != size ||
+         skip_raw(tar, (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE) < 0 ) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+/* Records are "<length> <key>=<value>\n". Returns -1 if the size is invalid */
+static int parse_pax(char *data, off_t size, char **path, char **linkname,
+                     off_t *fsize, time_t *mtime)
+{
+    char *record = data, *key, *value, *end;
+    long long number;
+    long len;
+
+    while ( record < data + size ) {
+        len = strtol(record, &key, 10);
+        if ( len <= 0 || record + len > data + size || *key != ' ' ) {
+            break;
+        }
+        end = record + len - 1;
+        *end = '\0';
+        ++key;
+        value = strchr(key, '=');
+        if ( value ) {
+            *value++ = '\0';
+            if ( !strcmp(key, "path") ) {
+                free(*path);
+                *path = strdup(value);
+            } else if ( !strcmp(key, "linkpath") ) {
+                free(*linkname);
+                *linkname = strdup(value);
+            } else if ( !strcmp(key, "size") ) {
+                errno = 0;
+                number = strtoll(value, &end, 10);
+                if ( errno || *end || end == value || number < 0 || number > MAX_SIZE ) {
+                    return -1;
+                }
+                *fsize = number;
+            } else if ( !strcmp(key, "mtime") ) {
+                *mtime = strtoll(value, NULL, 10);
+            }
+        }
+        record = record + len;
+    }
+    return 0;
+}
+
+tar_reader_t *tar_open(const char *path)
+{
+    tar_reader_t *tar;
+    int fd;
+
+    fd = strcmp(path, "-") ? open(path, O_RDONLY|O_CLOEXEC) : dup(0);
+    if ( fd < 0 ) {
+        perror(path);
+        return NULL;
+    }
+    tar = (tar_reader_t *)calloc(1, sizeof(tar_reader_t));
+#ifdef NO_ZLIB
+    tar->fd = fd;
+#else
+    /* Archives that are not compressed are read as they are */
+    tar->gz = gzdopen(fd, "rb");
+    if ( !tar->gz ) {
+        close(fd);
+        free(tar);
+        return NULL;
+    }
+    gzbuffer(tar->gz, 128*1024);
+#endif
+    return tar;
+}
+
+int tar_next(tar_reader_t *tar, tar_entry_t *entry)
+{
+    unsigned char block[BLOCK_SIZE];
+    char *extra, *path = NULL, *linkname = NULL;
+    off_t size = -1;
+    time_t mtime = -1;
+    ssize_t count;
+    int i;
+
+    if ( skip_raw(tar, tar->left + tar->padding) < 0 ) {
+        return -1;
+    }
+    tar->left = tar->padding = 0;
+    free(tar->path);
+    free(tar->linkname);
+    tar->path = tar->linkname = NULL;
+
+    for ( ;; ) {
+        count = read_raw(tar, block, sizeof(block));
+        if ( count == 0 ) {
+            break; /* Some writers leave out the end of archive blocks */
+        }
+        if ( count != BLOCK_SIZE ) {
+            goto error;
+        }
+        for ( i = 0; i < BLOCK_SIZE && !block[i]; ++i )
+            ;
+        if ( i == BLOCK_SIZE ) {
+            break;
+        }
+        if ( !check_header(block) ) {
+            fprintf(stderr, "Corrupted tar header\n");
+            goto error;
+        }
+
+        entry->type = block[156] ? block[156] : TAR_REGULAR;
+        entry->size = parse_number(block + 124, 12);
+        if ( entry->size < 0 ) {
+            fprintf(stderr, "Invalid member size in tar header\n");
+            goto error;
+        }
+        switch (entry->type) {
+        case 'x': /* pax extended header for the next member */
+        case 'L': /* GNU long name */
+        case 'K': /* GNU long link name */
+            extra = read_extra(tar, entry->size);
+            if ( !extra ) {
+                goto error;
+            }
+            if ( entry->type == 'x' ) {
+                i = parse_pax(extra, entry->size, &path, &linkname, &size, &mtime);
+                free(extra);
+                if ( i < 0 ) {
+                    fprintf(stderr, "Invalid member size in pax header\n");
+                    goto error;
+                }
+            } else if ( entry->type == 'L' ) {
+                free(path);
+                path = extra;
+            } else {
+                free(linkname);
+                linkname = extra;
+            }
+            continue;
+        case 'g': /* pax global header, nothing we use */
+            if ( skip_raw(tar, (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE) < 0 ) {
+                goto error;
+            }
+            continue;
+        }
+
+        if ( !path ) {
+            char *name = copy_field(block, 100);
+            if ( !memcmp(block + 257, "ustar", 5) && block[345] ) {
+                char *prefix = copy_field(block + 345, 155);
+                path = (char *)malloc(strlen(prefix) + strlen(name) + 2);
+                sprintf(path, "%s/%s", prefix, name);
+                free(prefix);
+                free(name);
+            } else {
+                path = name;
+            }
+        }
+        if ( !linkname ) {
+            linkname = copy_field(block + 157, 100);
+        }
+        tar->path = entry->path = path;
+        tar->linkname = entry->linkname = linkname;
+        entry->mode = parse_number(block + 100, 8) & 07777;
+        entry->mtime = (mtime >= 0) ? mtime : (time_t)parse_number(block + 136, 12);
+        if ( size >= 0 ) {
+            entry->size = size;
+        }
+        entry->devmajor = parse_number(block + 329, 8);
+        entry->devminor = parse_number(block + 337, 8);
+        /* These have no data, whatever the size says */
+        if ( strchr("123456", entry->type) ) {
+            entry->size = 0;
+        }
+        tar->left = entry->size;
+        tar->padding = (BLOCK_SIZE - entry->size % BLOCK_SIZE) % BLOCK_SIZE;
+        return 1;
+    }
+    free(path);
+    free(linkname);
+    return 0;
+
+ error:
+    free(path);
+    free(linkname);
+    return -1;
+}
+
+ssize_t tar_read(tar_reader_t *tar, void *buf, size_t len)
+{
+    ssize_t count;
+
+    if ( tar->left <= 0 ) {
+        return 0;
+    }
+    if ( (unsigned long long)len > (unsigned long long)tar->left ) {
+        len = (size_t)tar->left;
+    }
+    count = read_raw(tar, buf, len);
+    if ( count <= 0 ) {
+        return -1; /* Truncated archive */
+    }
+    tar->left -= count;
+    return count;
+}
+
+void tar_close(tar_reader_t *tar)
+{
+#ifdef NO_ZLIB
+    close(tar->fd);
+#else
+    gzclose(tar->gz);
+#endif
+    free(tar->path);
+    free(tar->linkname);
+    free(tar);
+}
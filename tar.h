@@ -0,0 +1,45 @@
+#ifndef __TAR_H__
+#define __TAR_H__
+
+/* Streaming reader for ustar and pax archives, optionally gzip compressed */
+
+#include <sys/types.h>
+#include <time.h>
+
+/* Member types */
+#define TAR_REGULAR  '0'
+#define TAR_HARDLINK '1'
+#define TAR_SYMLINK  '2'
+#define TAR_CHAR     '3'
+#define TAR_BLOCK    '4'
+#define TAR_DIR      '5'
+#define TAR_FIFO     '6'
+#define TAR_CONTIG   '7'
+
+typedef struct _tar_reader_t tar_reader_t;
+
+/* The strings belong to the reader and are only valid until the next member */
+typedef struct {
+    char type;
+    char *path;
+    char *linkname;
+    unsigned int mode;
+    off_t size;
+    time_t mtime;
+    unsigned int devmajor, devminor;
+} tar_entry_t;
+
+/* Open an archive, or the standard input if 'path' is "-" */
+tar_reader_t *tar_open(const char *path);
+
+/* Go to the next member, skipping what is left of the current one.
+   Returns 1 for a member, 0 at the end of the archive and -1 on error.
+ */
+int tar_next(tar_reader_t *tar, tar_entry_t *entry);
+
+/* Read the data of the current member, returns 0 at its end and -1 on error */
+ssize_t tar_read(tar_reader_t *tar, void *buf, size_t len);
+
+void tar_close(tar_reader_t *tar);
+
+#endif /* __TAR_H__ */